@@ -0,0 +1,604 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "env.h"
+#include "error.h"
+#include "journal.h"
+
+// splitmix64, seeded per dir so that a dir only depends on its index
+static uint64_t bench_mix(uint64_t *state) {
+  uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static uint64_t bench_state = 0x7a73716c;
+
+static double bench_uniform(void) {
+  return (double)(bench_mix(&bench_state) >> 11) / (double)(UINT64_C(1) << 53);
+}
+
+static const char *const bench_words[] = {
+    "src",     "lib",      "projects", "work",    "docs",     "Documents",
+    "build",   "target",   "release",  "include", "config",   "github.com",
+    "dotfiles", "linux",    "kernel",   "drivers", "tests",    "vendor",
+    "assets",  "api",      "internal", "cmd",     "pkg",      "scripts",
+    "notes",   "Pictures", "go",       "rust",    "python",   "website",
+};
+
+#define ARRAY_LENGTH(A) (sizeof(A) / sizeof((A)[0]))
+
+// the dir with the given index under root, like root/work/rust/kernel-2s. the
+// index ends the last component, so every dir is distinct
+static size_t bench_dir(char *dir, const char *root, size_t idx) {
+  uint64_t state = idx;
+  size_t length = (size_t)sprintf(dir, "%s", root);
+  const size_t depth = 1 + bench_mix(&state) % 5;
+  for (size_t depth_idx = 0; depth_idx < depth; ++depth_idx) {
+    length += (size_t)sprintf(
+        dir + length, "/%s",
+        bench_words[bench_mix(&state) % ARRAY_LENGTH(bench_words)]);
+  }
+
+  dir[length++] = '-';
+  const size_t code_start = length;
+  do {
+    dir[length++] = "0123456789abcdefghijklmnopqrstuvwxyz"[idx % 36];
+    idx /= 36;
+  } while (idx != 0);
+  dir[length] = 0;
+
+  // the digits were written least significant first
+  for (size_t lo = code_start, hi = length - 1; lo < hi; ++lo, --hi) {
+    const char digit = dir[lo];
+    dir[lo] = dir[hi];
+    dir[hi] = digit;
+  }
+  return length;
+}
+
+// searches pass over and forget dirs that no longer exist, so every dir has to.
+// there are far too many to make each one, so root holds a link back to itself
+// for every word, and one for the last component of every dir, which then all
+// resolve to root. links to root take no space of their own
+static zsql_error *bench_root(const char *data_dir, char *root) {
+  sprintf(root, "%s/home", data_dir);
+  if (mkdir(root, S_IRWXU) != 0) {
+    return zsql_error_from_errno(NULL);
+  }
+  strcat(root, "/u");
+  if (mkdir(root, S_IRWXU) != 0) {
+    return zsql_error_from_errno(NULL);
+  }
+
+  char link[4096];
+  for (size_t idx = 0; idx < ARRAY_LENGTH(bench_words); ++idx) {
+    snprintf(link, sizeof(link), "%s/%s", root, bench_words[idx]);
+    if (symlink(".", link) != 0) {
+      return zsql_error_from_errno(NULL);
+    }
+  }
+  return NULL;
+}
+
+// make dir, as given by bench_dir, exist
+static zsql_error *bench_link(const char *root, const char *dir) {
+  char link[4096];
+  snprintf(link, sizeof(link), "%s%s", root, strrchr(dir, '/'));
+  if (symlink(".", link) != 0 && errno != EEXIST) {
+    return zsql_error_from_errno(NULL);
+  }
+  return NULL;
+}
+
+// pick a dir out of rows, favoring the first few as a history does
+static size_t bench_popular(size_t rows) {
+  const size_t idx = (size_t)pow((double)rows, bench_uniform());
+  return idx == 0 ? 0 : idx - 1;
+}
+
+// a search for dir as someone would type it: the start of its last word and
+// the end of its index
+static void bench_needle(char *needle, const char *dir, size_t length) {
+  const char *last = strrchr(dir, '/') + 1;
+  needle[0] = last[0];
+  needle[1] = last[1];
+  needle[2] = dir[length - 1];
+  needle[3] = 0;
+}
+
+static uint64_t bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+typedef struct {
+  uint64_t *latencies;
+  size_t length;
+  size_t capacity;
+  // summed from the stats each run of z prints with ZSQL_STATS
+  unsigned long misses;
+  unsigned long errors;
+  unsigned long lock_waits;
+  double lock_waited_ms;
+  unsigned long decays;
+  double aging_ms;
+} bench_op;
+
+static zsql_error *bench_op_push(bench_op *op, uint64_t latency) {
+  if (op->length == op->capacity) {
+    const size_t capacity = op->capacity == 0 ? 256 : op->capacity * 2;
+    uint64_t *allocation =
+        realloc(op->latencies, capacity * sizeof(*op->latencies));
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    op->latencies = allocation;
+    op->capacity = capacity;
+  }
+  op->latencies[op->length++] = latency;
+  return NULL;
+}
+
+// fold what a run of z printed to stderr into op. anything but its stats or
+// a search coming up empty is an error
+static void bench_op_parse(bench_op *op, const char *stderr_path) {
+  FILE *file = fopen(stderr_path, "r");
+  if (file == NULL) {
+    ++op->errors;
+    return;
+  }
+
+  // z prints its stats a name and a value to a line
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char name[64];
+    double value;
+    if (sscanf(line, "%63[a-z_]\t%lf", name, &value) == 2) {
+      if (strcmp(name, "lock_waits") == 0) {
+        op->lock_waits += (unsigned long)value;
+      } else if (strcmp(name, "locked_ms") == 0) {
+        op->lock_waited_ms += value;
+      } else if (strcmp(name, "decays") == 0) {
+        op->decays += (unsigned long)value;
+      } else if (strcmp(name, "aging_ms") == 0) {
+        op->aging_ms += value;
+      }
+    } else if (strstr(line, ": no matches\n") != NULL) {
+      ++op->misses;
+    } else {
+      fprintf(stderr, "%s", line);
+      ++op->errors;
+    }
+  }
+  fclose(file);
+}
+
+static int bench_compare(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_op_print(bench_op *op, const char *name, int64_t rows) {
+  if (op->length == 0) {
+    return;
+  }
+  qsort(op->latencies, op->length, sizeof(*op->latencies), bench_compare);
+  printf("%" PRId64
+         "\t%s\t%zu\t%lu\t%lu\t%.3f\t%.3f\t%.3f\t%lu\t%.3f\t%lu\t%.3f\n",
+         rows, name, op->length, op->misses, op->errors,
+         (double)op->latencies[(op->length - 1) / 2] / 1e6,
+         (double)op->latencies[(op->length - 1) * 99 / 100] / 1e6,
+         (double)op->latencies[op->length - 1] / 1e6, op->lock_waits,
+         op->lock_waited_ms, op->decays, op->aging_ms);
+}
+
+// start z with args after delay_ns, throwing away its output and keeping its
+// stderr at stderr_path. its exit status is ignored, being 1 for a search with no
+// matches as well as for errors, which show up on stderr instead
+static zsql_error *bench_run(const char *z, char *const *args,
+                             const char *stderr_path, uint64_t delay_ns,
+                             pid_t *pid) {
+  *pid = fork();
+  if (*pid < 0) {
+    return zsql_error_from_errno(NULL);
+  }
+  if (*pid == 0) {
+    const struct timespec delay = {.tv_sec = (time_t)(delay_ns / 1000000000),
+                                   .tv_nsec = (long)(delay_ns % 1000000000)};
+    nanosleep(&delay, NULL);
+
+    const int null_fd = open("/dev/null", O_WRONLY);
+    const int stderr_fd =
+        open(stderr_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (null_fd < 0 || stderr_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0 ||
+        dup2(stderr_fd, STDERR_FILENO) < 0) {
+      _exit(127);
+    }
+    execv(z, args);
+    _exit(127);
+  }
+  return NULL;
+}
+
+static zsql_error *bench_run_wait(const char *z, char *const *args,
+                                  const char *stderr_path, bench_op *op) {
+  zsql_error *err = NULL;
+  pid_t pid;
+  if ((err = bench_run(z, args, stderr_path, 0, &pid)) != NULL) {
+    return err;
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) {
+    return zsql_error_from_errno(NULL);
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+    return zsql_error_from_text("could not run z", NULL);
+  }
+  bench_op_parse(op, stderr_path);
+  return NULL;
+}
+
+// aging keeps the visits of every dir under 5000 in all, so a database only
+// ever holds a few thousand dirs with a visit or more. larger ones can't be
+// reached by adding, so while they're built aging is held off, and then the
+// visits are spread over the dirs as a history would have them, most going to
+// the first few and leaving room under the limit for thousands of adds
+static const double bench_visits = 1000;
+
+static zsql_error *bench_exec(sqlite3 *conn, const char *sql) {
+  if (sqlite3_exec(conn, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    return zsql_error_from_sqlite(conn, NULL);
+  }
+  return NULL;
+}
+
+static zsql_error *bench_build(const char *z, const char *data_dir,
+                               const char *root, const char *stderr_path,
+                               size_t rows, int64_t *built) {
+  zsql_error *err = NULL;
+  bench_op op = {0};
+
+  // let z create the database with the dir every other is under, then hold
+  // off aging
+  if ((err = bench_run_wait(z, (char *[]){(char *)z, "-a", (char *)root, NULL},
+                            stderr_path, &op)) != NULL ||
+      (err = bench_run_wait(z, (char *[]){(char *)z, "home", NULL},
+                            stderr_path, &op)) != NULL) {
+    goto exit;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/zsql/zsql.db", data_dir);
+  sqlite3 *conn;
+  if (sqlite3_open_v2(path, &conn, SQLITE_OPEN_READWRITE, NULL) !=
+      SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, NULL);
+    goto cleanup_conn;
+  }
+  if ((err = bench_exec(conn, "UPDATE aging SET total=-1e300")) != NULL) {
+    goto cleanup_conn;
+  }
+
+  // visits go through the journal, as they would with no server, oldest
+  // first, and are folded in by the search after
+  snprintf(path, sizeof(path), "%s/zsql/zsql.journal", data_dir);
+  const int64_t now = (int64_t)time(NULL);
+  char dir[4096];
+  for (size_t idx = rows; idx > 0; --idx) {
+    const size_t length = bench_dir(dir, root, idx - 1);
+    size_t journal_length;
+    if ((err = bench_link(root, dir)) != NULL ||
+        (err = journal_append(path, dir, length, now - (int64_t)idx,
+                              &journal_length)) != NULL) {
+      goto cleanup_conn;
+    }
+  }
+  if ((err = bench_run_wait(z, (char *[]){(char *)z, "home", NULL},
+                            stderr_path, &op)) != NULL) {
+    goto cleanup_conn;
+  }
+
+  double harmonic = 0;
+  for (size_t idx = rows + 1; idx > 0; --idx) {
+    harmonic += 1 / (double)idx;
+  }
+  char sql[256];
+  snprintf(sql, sizeof(sql),
+           "BEGIN;"
+           "UPDATE dirs SET visits=%.17g/((SELECT MAX(id)FROM dirs)-id+1);"
+           "UPDATE aging SET total=(SELECT TOTAL(visits)FROM dirs);"
+           "COMMIT;"
+           "PRAGMA wal_checkpoint(TRUNCATE)",
+           bench_visits / harmonic);
+  if ((err = bench_exec(conn, sql)) != NULL) {
+    goto cleanup_conn;
+  }
+
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(conn, "SELECT COUNT(*)FROM dirs", -1, &stmt, NULL) !=
+      SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, NULL);
+    goto cleanup_conn;
+  }
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    err = zsql_error_from_sqlite(conn, NULL);
+  } else {
+    *built = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  if (op.misses != 0 || op.errors != 0) {
+    err = zsql_error_from_text("z failed while building the database", err);
+  }
+
+cleanup_conn:
+  sqlite3_close(conn);
+exit:
+  free(op.latencies);
+  return err;
+}
+
+typedef struct {
+  pid_t pid;
+  uint64_t started;
+  char dir[4096];
+  char stderr_path[4096];
+} bench_slot;
+
+// one searcher running z back to back until it has run searches times,
+// alongside writers adding every interval_ns, as prompts in other shells
+// would. the writers add popular dirs and now and then a new one
+static zsql_error *bench_contend(const char *z, const char *data_dir,
+                                 const char *root, size_t rows, size_t writers,
+                                 size_t searches, uint64_t interval_ns,
+                                 bench_op *search, bench_op *add) {
+  zsql_error *err = NULL;
+
+  bench_slot *slots = calloc(1 + writers, sizeof(*slots));
+  if (slots == NULL) {
+    err = zsql_error_from_errno(NULL);
+    goto exit;
+  }
+  for (size_t idx = 0; idx <= writers; ++idx) {
+    snprintf(slots[idx].stderr_path, sizeof(slots[idx].stderr_path),
+             "%s/stderr.%zu", data_dir, idx);
+  }
+
+  size_t searched = 0;
+  size_t running = 0;
+  size_t added = 0;
+  for (;;) {
+    // start every idle slot, until the searcher is done
+    for (size_t idx = 0; idx <= writers && searched < searches; ++idx) {
+      bench_slot *slot = &slots[idx];
+      if (slot->pid != 0) {
+        continue;
+      }
+
+      char needle[4];
+      char *args[4] = {(char *)z, NULL, NULL, NULL};
+      if (idx == 0) {
+        const size_t length =
+            bench_dir(slot->dir, root, bench_popular(rows));
+        bench_needle(needle, slot->dir, length);
+        args[1] = needle;
+      } else {
+        bench_dir(slot->dir, root,
+                  bench_uniform() < 0.1 ? rows + added++
+                                        : bench_popular(rows));
+        if ((err = bench_link(root, slot->dir)) != NULL) {
+          goto cleanup_slots;
+        }
+        args[1] = "-a";
+        args[2] = slot->dir;
+      }
+
+      // a writer's add is timed from when it's due, not from when it was
+      // started waiting for that
+      const uint64_t delay = idx == 0 ? 0 : interval_ns;
+      slot->started = bench_now() + delay;
+      if ((err = bench_run(z, args, slot->stderr_path, delay, &slot->pid)) !=
+          NULL) {
+        goto cleanup_slots;
+      }
+      ++running;
+    }
+    if (running == 0) {
+      break;
+    }
+
+    int status;
+    const pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      err = zsql_error_from_errno(NULL);
+      goto cleanup_slots;
+    }
+    const uint64_t finished = bench_now();
+
+    size_t idx = 0;
+    while (idx <= writers && slots[idx].pid != pid) {
+      ++idx;
+    }
+    if (idx > writers) {
+      continue;
+    }
+    --running;
+    slots[idx].pid = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+      err = zsql_error_from_text("could not run z", NULL);
+      goto cleanup_slots;
+    }
+
+    bench_op *op = idx == 0 ? search : add;
+    if ((err = bench_op_push(op, finished - slots[idx].started)) != NULL) {
+      goto cleanup_slots;
+    }
+    bench_op_parse(op, slots[idx].stderr_path);
+    searched += idx == 0;
+  }
+
+cleanup_slots:
+  // on error, wait out whatever is still running
+  while (running > 0 && wait(NULL) > 0) {
+    --running;
+  }
+  for (size_t idx = 0; idx <= writers; ++idx) {
+    unlink(slots[idx].stderr_path);
+  }
+  free(slots);
+exit:
+  return err;
+}
+
+static void bench_remove(const char *data_dir) {
+  char path[4096];
+
+  // the links bench_root and bench_link made, none of which are followed
+  snprintf(path, sizeof(path), "%s/home/u", data_dir);
+  DIR *root = opendir(path);
+  if (root != NULL) {
+    const struct dirent *entry;
+    while ((entry = readdir(root)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/home/u/%s", data_dir, entry->d_name);
+      if (unlink(path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "could not remove %s: %s\n", path, strerror(errno));
+      }
+    }
+    closedir(root);
+  }
+
+  static const char *const files[] = {
+      "/zsql/zsql.db",       "/zsql/zsql.db-wal",      "/zsql/zsql.db-shm",
+      "/zsql/zsql.journal",  "/zsql/zsql.snapshot",    "/zsql/zsql.sock",
+      "/stderr.0",           "/zsql",                  "/home/u",
+      "/home",               "",
+  };
+  for (size_t idx = 0; idx < ARRAY_LENGTH(files); ++idx) {
+    snprintf(path, sizeof(path), "%s%s", data_dir, files[idx]);
+    if (remove(path) != 0 && errno != ENOENT) {
+      fprintf(stderr, "could not remove %s: %s\n", path, strerror(errno));
+    }
+  }
+}
+
+static const size_t bench_rows[] = {1000, 10000, 100000, 1000000};
+
+int main(int argc, char **argv) {
+  int status = 0;
+  zsql_error *err = NULL;
+  zsql_env_init(argc, argv);
+
+  size_t writers = 4;
+  size_t searches = 100;
+  size_t interval_ms = 100;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:n:i:")) != -1) {
+    if (opt == 'w' && sscanf(optarg, "%zu", &writers) == 1) {
+      continue;
+    }
+    if (opt == 'i' && sscanf(optarg, "%zu", &interval_ms) == 1) {
+      continue;
+    }
+    if (opt == 'n' && sscanf(optarg, "%zu", &searches) == 1 && searches > 0) {
+      continue;
+    }
+    goto usage;
+  }
+  if (optind >= argc) {
+    goto usage;
+  }
+  const char *z = argv[optind++];
+
+  // every run of z reports its lock waits and time spent aging
+  unsetenv("ZSQL_DEBUG");
+  setenv("ZSQL_STATS", "1", 1);
+
+  printf("rows\top\tcount\tmisses\terrors\tp50_ms\tp99_ms\tmax_ms\tlock_waits\t"
+         "lock_waited_ms\tdecays\taging_ms\n");
+
+  const size_t sizes = optind < argc ? (size_t)(argc - optind)
+                                     : ARRAY_LENGTH(bench_rows);
+  for (size_t size_idx = 0; size_idx < sizes; ++size_idx) {
+    size_t rows = bench_rows[size_idx];
+    if (optind < argc &&
+        (sscanf(argv[optind + size_idx], "%zu", &rows) != 1 || rows < 2)) {
+      goto usage;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char data_dir[1024];
+    snprintf(data_dir, sizeof(data_dir), "%s/zsql-bench-XXXXXX",
+             tmp == NULL ? "/tmp" : tmp);
+    if (mkdtemp(data_dir) == NULL) {
+      err = zsql_error_from_errno(NULL);
+      goto exit;
+    }
+    setenv("XDG_DATA_HOME", data_dir, 1);
+
+    char stderr_path[4096];
+    snprintf(stderr_path, sizeof(stderr_path), "%s/stderr.0", data_dir);
+
+    const uint64_t build_started = bench_now();
+    char root[2048];
+    int64_t built = 0;
+    if ((err = bench_root(data_dir, root)) != NULL ||
+        (err = bench_build(z, data_dir, root, stderr_path, rows, &built)) !=
+            NULL) {
+      bench_remove(data_dir);
+      goto exit;
+    }
+    fprintf(stderr, "built %" PRId64 " dirs in %.1fs\n", built,
+            (double)(bench_now() - build_started) / 1e9);
+
+    bench_op search = {0};
+    bench_op add = {0};
+    err = bench_contend(z, data_dir, root, rows, writers, searches,
+                        (uint64_t)interval_ms * 1000000, &search, &add);
+    if (err == NULL) {
+      bench_op_print(&search, "search", built);
+      bench_op_print(&add, "add", built);
+      fflush(stdout);
+    }
+    free(search.latencies);
+    free(add.latencies);
+    bench_remove(data_dir);
+    if (err != NULL) {
+      goto exit;
+    }
+  }
+
+  if (0) { // error path only
+  usage:
+    fprintf(stderr,
+            "usage: %s [-w writers] [-i interval_ms] [-n searches] z "
+            "[rows...]\n",
+            argv[0]);
+    status = 2;
+  }
+exit:
+  if (err != NULL) {
+    zsql_error_print(err);
+    zsql_error_free(err);
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,660 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utf8proc.h>
+
+#include "env.h"
+#include "error.h"
+#include "fuzzy_search.h"
+
+// the bench is built with malloc, realloc and free renamed to the counting
+// versions below, so every allocation the kernels make is seen. the renaming
+// hides the real ones from stdlib.h, so they're declared here instead
+#undef malloc
+#undef realloc
+#undef free
+extern void *malloc(size_t size);
+extern void *realloc(void *ptr, size_t size);
+extern void free(void *ptr);
+
+static unsigned long bench_allocs = 0;
+
+void *bench_malloc(size_t size) {
+  ++bench_allocs;
+  return malloc(size);
+}
+void *bench_realloc(void *ptr, size_t size) {
+  ++bench_allocs;
+  return realloc(ptr, size);
+}
+void bench_free(void *ptr) { free(ptr); }
+
+// the same normalization z gives a dir searched for with a lowercase needle
+static const utf8proc_option_t bench_utf8proc_options =
+    UTF8PROC_COMPAT | UTF8PROC_COMPOSE | UTF8PROC_IGNORE | UTF8PROC_LUMP |
+    UTF8PROC_STRIPNA | UTF8PROC_CASEFOLD;
+
+// splitmix64 from a fixed seed, so every run benches the same corpus
+static uint64_t bench_state = 0x7a73716c;
+
+static uint64_t bench_random(void) {
+  uint64_t z = (bench_state += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static size_t bench_below(size_t bound) {
+  return (size_t)(bench_random() % bound);
+}
+
+// the corpus never contains a q, in any case or script, so a needle with one
+// in it only matches the rows it was spliced into
+static const char *const bench_words[] = {
+    "home",     "u",        "src",       "lib",          "usr",
+    "local",    "share",    "projects",  "work",         "docs",
+    "Documents", "Downloads", "Pictures", "node_modules", "build",
+    "target",   "release",  "debug",     "include",      "config",
+    ".config",  ".cache",   "github.com", "dotfiles",    "linux",
+    "kernel",   "drivers",  "net",       "tests",        "vendor",
+    "assets",   "images",   "2023",      "v1.2.3",       "api",
+    "internal", "cmd",      "pkg",       "scripts",      "Makefile.d",
+    "notes",    "Photos",   "go",        "rust",         "python3.11",
+};
+static const char bench_alphabet[] = "abcdefghijklmnoprstuvwxyz"
+                                     "ABCDEFGHIJKLMNOPRSTUVWXYZ"
+                                     "0123456789-_.";
+// é, ü, ß, Ω, дом, 日本語, 資料, e with a combining acute, the fi ligature,
+// Ä, a folder emoji and ñ, covering composition, folding and compatibility
+static const char *const bench_unicode[] = {
+    "\xc3\xa9",
+    "\xc3\xbc",
+    "\xc3\x9f",
+    "\xce\xa9",
+    "\xd0\xb4\xd0\xbe\xd0\xbc",
+    "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e",
+    "\xe8\xb3\x87\xe6\x96\x99",
+    "e\xcc\x81",
+    "\xef\xac\x81",
+    "\xc3\x84",
+    "\xf0\x9f\x93\x81",
+    "\xc3\xb1",
+};
+
+#define ARRAY_LENGTH(A) (sizeof(A) / sizeof((A)[0]))
+
+typedef struct {
+  char *bytes;
+  size_t length;
+  size_t capacity;
+} bench_buffer;
+
+static zsql_error *bench_append(bench_buffer *buffer, const char *bytes,
+                                size_t length) {
+  if (buffer->length + length > buffer->capacity) {
+    const size_t capacity = (buffer->length + length) * 2;
+    char *allocation = realloc(buffer->bytes, capacity);
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    buffer->bytes = allocation;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->bytes + buffer->length, bytes, length);
+  buffer->length += length;
+  return NULL;
+}
+
+static size_t bench_codepoints(const bench_buffer *buffer) {
+  size_t codepoints = 0;
+  for (size_t idx = 0; idx < buffer->length; ++idx) {
+    codepoints += (buffer->bytes[idx] & 0xc0) != 0x80;
+  }
+  return codepoints;
+}
+
+// append one component: usually a common word, otherwise random characters
+// of the given length, with some non-ascii ones mixed in when unicode is set
+static zsql_error *bench_component(bench_buffer *buffer, size_t length,
+                                   int unicode) {
+  zsql_error *err = NULL;
+  if ((err = bench_append(buffer, "/", 1)) != NULL) {
+    return err;
+  }
+
+  if (length == 0) {
+    const char *word = bench_words[bench_below(ARRAY_LENGTH(bench_words))];
+    return bench_append(buffer, word, strlen(word));
+  }
+
+  for (size_t idx = 0; idx < length; ++idx) {
+    if (unicode && bench_below(4) == 0) {
+      const char *piece =
+          bench_unicode[bench_below(ARRAY_LENGTH(bench_unicode))];
+      err = bench_append(buffer, piece, strlen(piece));
+    } else {
+      err = bench_append(
+          buffer, &bench_alphabet[bench_below(sizeof(bench_alphabet) - 1)], 1);
+    }
+    if (err != NULL) {
+      return err;
+    }
+  }
+  return NULL;
+}
+
+// one dir of the corpus. most are short and ascii like a real history; the
+// rest are deep trees, long component names, non-ascii names and dirs longer
+// than the 1024 codepoints the thread-local buffers in fuzzy_search.c hold
+static zsql_error *bench_dir(bench_buffer *buffer) {
+  zsql_error *err = NULL;
+  buffer->length = 0;
+
+  const size_t kind = bench_below(100);
+  if (kind < 55) {
+    const size_t depth = 2 + bench_below(6);
+    for (size_t idx = 0; idx < depth && err == NULL; ++idx) {
+      const size_t name_length = bench_below(3) == 0 ? 3 + bench_below(10) : 0;
+      err = bench_component(buffer, name_length, 0);
+    }
+  } else if (kind < 65) {
+    const size_t depth = 12 + bench_below(30);
+    for (size_t idx = 0; idx < depth && err == NULL; ++idx) {
+      const size_t name_length = bench_below(2) == 0 ? 2 + bench_below(8) : 0;
+      err = bench_component(buffer, name_length, 0);
+    }
+  } else if (kind < 75) {
+    const size_t depth = 2 + bench_below(4);
+    const size_t long_idx = bench_below(depth);
+    for (size_t idx = 0; idx < depth && err == NULL; ++idx) {
+      const size_t name_length = idx == long_idx ? 40 + bench_below(160) : 0;
+      err = bench_component(buffer, name_length, 0);
+    }
+  } else if (kind < 95) {
+    const size_t depth = 2 + bench_below(6);
+    for (size_t idx = 0; idx < depth && err == NULL; ++idx) {
+      const size_t name_length = bench_below(2) == 0 ? 2 + bench_below(12) : 0;
+      err = bench_component(buffer, name_length, 1);
+    }
+  } else {
+    const size_t codepoints = 1100 + bench_below(3000);
+    while (err == NULL && bench_codepoints(buffer) < codepoints) {
+      err = bench_component(buffer, 8 + bench_below(60), bench_below(4) == 0);
+    }
+  }
+  return err;
+}
+
+typedef struct {
+  // the dir as it's stored, in utf-8
+  char *dir;
+  size_t dir_length;
+  // the dir normalized as for a profile
+  int32_t *base;
+  size_t length;
+  int ascii;
+  // base with the current needle spliced in if the row should match it, and
+  // its bonus classes and ascii bytes to go with it
+  int32_t *runes;
+  uint8_t *bonus;
+  uint8_t *bytes;
+} bench_row;
+
+typedef struct {
+  bench_row *rows;
+  size_t length;
+} bench_corpus;
+
+static void bench_corpus_free(bench_corpus *corpus) {
+  for (size_t idx = 0; idx < corpus->length; ++idx) {
+    free(corpus->rows[idx].dir);
+    free(corpus->rows[idx].base);
+    free(corpus->rows[idx].runes);
+    free(corpus->rows[idx].bonus);
+    free(corpus->rows[idx].bytes);
+  }
+  free(corpus->rows);
+}
+
+static zsql_error *bench_normalize(bench_row *row) {
+  size_t length = row->dir_length;
+  int32_t *runes = NULL;
+
+retry_decompose:;
+  int32_t *allocation = realloc(runes, length * sizeof(*runes) + 1);
+  if (allocation == NULL) {
+    free(runes);
+    return zsql_error_from_errno(NULL);
+  }
+  runes = allocation;
+
+  const utf8proc_ssize_t result =
+      utf8proc_decompose((const uint8_t *)row->dir, row->dir_length, runes,
+                         length, bench_utf8proc_options);
+  if (result < 0) {
+    free(runes);
+    return zsql_error_from_text(utf8proc_errmsg(result), NULL);
+  } else if ((size_t)result > length) {
+    length = result;
+    goto retry_decompose;
+  }
+
+  row->base = runes;
+  row->length = result;
+  row->ascii = 1;
+  for (size_t idx = 0; idx < row->length; ++idx) {
+    row->ascii &= runes[idx] < 0x80;
+  }
+  return NULL;
+}
+
+static zsql_error *bench_corpus_init(bench_corpus *corpus, size_t length) {
+  zsql_error *err = NULL;
+
+  corpus->length = 0;
+  corpus->rows = calloc(length, sizeof(*corpus->rows));
+  if (corpus->rows == NULL) {
+    err = zsql_error_from_errno(NULL);
+    goto exit;
+  }
+
+  bench_buffer buffer = {0};
+  while (corpus->length < length) {
+    bench_row *row = &corpus->rows[corpus->length++];
+    if ((err = bench_dir(&buffer)) != NULL) {
+      goto cleanup_buffer;
+    }
+
+    row->dir = malloc(buffer.length);
+    if (row->dir == NULL) {
+      err = zsql_error_from_errno(NULL);
+      goto cleanup_buffer;
+    }
+    memcpy(row->dir, buffer.bytes, buffer.length);
+    row->dir_length = buffer.length;
+
+    if ((err = bench_normalize(row)) != NULL) {
+      goto cleanup_buffer;
+    }
+
+    row->runes = malloc(row->length * sizeof(*row->runes) + 1);
+    row->bonus = malloc(row->length + 1);
+    row->bytes = malloc(row->length + 1);
+    if (row->runes == NULL || row->bonus == NULL || row->bytes == NULL) {
+      err = zsql_error_from_errno(NULL);
+      goto cleanup_buffer;
+    }
+  }
+
+cleanup_buffer:
+  free(buffer.bytes);
+  if (0) { // error path only
+    bench_corpus_free(corpus);
+  }
+exit:
+  return err;
+}
+
+// a needle of letters from the corpus around a q, so that exactly the rows
+// it's spliced into can match it
+static void bench_needle(int32_t *needle, size_t needle_length) {
+  static const char letters[] = "srcdocumentsplaibz";
+  for (size_t idx = 0; idx < needle_length; ++idx) {
+    needle[idx] = letters[idx % (sizeof(letters) - 1)];
+  }
+  needle[needle_length / 2] = 'q';
+}
+
+// overwrite runes of the rows picked to match with the needle, spread evenly
+// over the dir, then redo the bonus classes as a profile would have them
+static void bench_splice(bench_corpus *corpus, const int32_t *needle,
+                         size_t needle_length, double match_rate) {
+  for (size_t row_idx = 0; row_idx < corpus->length; ++row_idx) {
+    bench_row *row = &corpus->rows[row_idx];
+    memcpy(row->runes, row->base, row->length * sizeof(*row->runes));
+
+    if ((double)bench_below(1000) < match_rate * 1000 &&
+        row->length >= needle_length) {
+      const size_t stride = row->length / needle_length;
+      for (size_t idx = 0; idx < needle_length; ++idx) {
+        row->runes[idx * stride + bench_below(stride)] = needle[idx];
+      }
+    }
+
+    fuzzy_bonus(row->bonus, row->runes, row->length);
+    for (size_t idx = 0; row->ascii && idx < row->length; ++idx) {
+      row->bytes[idx] = (uint8_t)row->runes[idx];
+    }
+  }
+}
+
+typedef struct {
+  bench_corpus *corpus;
+  const int32_t *needle;
+  const uint8_t *needle_bytes;
+  size_t needle_length;
+  // the rows fuzzy_match can't settle, which are left to fuzzy_rank_batch
+  const int32_t **unsettled;
+  const uint8_t **unsettled_bonuses;
+  size_t *unsettled_lengths;
+  size_t unsettled_length;
+} bench_cell;
+
+// keeps the compiler from dropping the results of a pass
+static volatile float bench_sink;
+
+// build a profile of each dir just as the profile() sql function does,
+// allocations included
+static zsql_error *bench_pass_profile(const bench_cell *cell) {
+  float sink = 0;
+  for (size_t row_idx = 0; row_idx < cell->corpus->length; ++row_idx) {
+    const bench_row *row = &cell->corpus->rows[row_idx];
+    const uint8_t *dir = (const uint8_t *)row->dir;
+    uint8_t *profile;
+
+    uint8_t high_bits = 0;
+    for (size_t idx = 0; idx < row->dir_length; ++idx) {
+      high_bits |= dir[idx];
+    }
+
+    if (high_bits < 0x80) {
+      profile = bench_malloc(row->dir_length * 2 + 1);
+      if (profile == NULL) {
+        return zsql_error_from_errno(NULL);
+      }
+      for (size_t idx = 0; idx < row->dir_length; ++idx) {
+        profile[idx] = dir[idx] >= 'A' && dir[idx] <= 'Z'
+                           ? dir[idx] + ('a' - 'A')
+                           : dir[idx];
+      }
+      fuzzy_bonus_ascii(profile + row->dir_length, profile, row->dir_length);
+      sink += profile[row->dir_length];
+    } else {
+      size_t runes_length = row->dir_length * 2;
+      profile = bench_malloc(runes_length * (sizeof(int32_t) + 1) + 1);
+      if (profile == NULL) {
+        return zsql_error_from_errno(NULL);
+      }
+
+    retry_decompose:;
+      const utf8proc_ssize_t result = utf8proc_decompose(
+          dir, row->dir_length, (int32_t *)profile, runes_length,
+          bench_utf8proc_options);
+      if (result < 0) {
+        bench_free(profile);
+        return zsql_error_from_text(utf8proc_errmsg(result), NULL);
+      } else if ((size_t)result > runes_length) {
+        runes_length = result;
+        uint8_t *allocation = bench_realloc(
+            profile, runes_length * (sizeof(int32_t) + 1) + 1);
+        if (allocation == NULL) {
+          bench_free(profile);
+          return zsql_error_from_errno(NULL);
+        }
+        profile = allocation;
+        goto retry_decompose;
+      }
+
+      fuzzy_bonus(profile + result * sizeof(int32_t), (int32_t *)profile,
+                  result);
+      sink += profile[result * sizeof(int32_t)];
+    }
+
+    bench_free(profile);
+  }
+  bench_sink = sink;
+  return NULL;
+}
+
+static zsql_error *bench_pass_match(const bench_cell *cell) {
+  float sink = 0;
+  for (size_t row_idx = 0; row_idx < cell->corpus->length; ++row_idx) {
+    const bench_row *row = &cell->corpus->rows[row_idx];
+    float score;
+    sink += fuzzy_match(&score, row->runes, row->length, cell->needle,
+                        cell->needle_length);
+  }
+  bench_sink = sink;
+  return NULL;
+}
+
+static zsql_error *bench_pass_match_ascii(const bench_cell *cell) {
+  float sink = 0;
+  for (size_t row_idx = 0; row_idx < cell->corpus->length; ++row_idx) {
+    const bench_row *row = &cell->corpus->rows[row_idx];
+    if (row->ascii) {
+      float score;
+      sink += fuzzy_match_ascii(&score, row->bytes, row->length,
+                                cell->needle_bytes, cell->needle_length);
+    }
+  }
+  bench_sink = sink;
+  return NULL;
+}
+
+static zsql_error *bench_pass_search(const bench_cell *cell) {
+  zsql_error *err = NULL;
+  float sink = 0;
+  for (size_t row_idx = 0; row_idx < cell->corpus->length; ++row_idx) {
+    const bench_row *row = &cell->corpus->rows[row_idx];
+    float score;
+    if ((err = fuzzy_search(&score, row->runes, row->bonus, row->length,
+                            cell->needle, cell->needle_length, -INFINITY)) !=
+        NULL) {
+      return err;
+    }
+    sink += score > -INFINITY ? score : 0;
+  }
+  bench_sink = sink;
+  return NULL;
+}
+
+static zsql_error *bench_pass_rank_batch(const bench_cell *cell) {
+  zsql_error *err = NULL;
+  static const float thresholds[FUZZY_BATCH_SIZE] = {
+      -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY,
+      -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY,
+      -INFINITY, -INFINITY, -INFINITY, -INFINITY};
+  float scores[FUZZY_BATCH_SIZE];
+  float sink = 0;
+  for (size_t idx = 0; idx < cell->unsettled_length;
+       idx += FUZZY_BATCH_SIZE) {
+    const size_t count = cell->unsettled_length - idx < FUZZY_BATCH_SIZE
+                             ? cell->unsettled_length - idx
+                             : FUZZY_BATCH_SIZE;
+    if ((err = fuzzy_rank_batch(scores, &cell->unsettled[idx],
+                                &cell->unsettled_bonuses[idx],
+                                &cell->unsettled_lengths[idx], count,
+                                cell->needle, cell->needle_length,
+                                thresholds)) != NULL) {
+      return err;
+    }
+    sink += scores[0];
+  }
+  bench_sink = sink;
+  return NULL;
+}
+
+static uint64_t bench_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// each kernel is run over the corpus at least this many times and for at
+// least this long, to smooth over timer resolution and cold caches
+#define BENCH_MIN_PASSES 3
+#define BENCH_MIN_NS (200 * 1000 * 1000)
+
+// time pass and print one line of results, tab separated
+static zsql_error *bench_measure(zsql_error *(*pass)(const bench_cell *),
+                                 const bench_cell *cell, const char *kernel,
+                                 size_t rows, double match_rate) {
+  zsql_error *err = NULL;
+  if (rows == 0) {
+    return NULL;
+  }
+
+  // warm up
+  if ((err = pass(cell)) != NULL) {
+    return err;
+  }
+
+  size_t passes = 0;
+  const unsigned long allocs = bench_allocs;
+  const uint64_t start = bench_now();
+  uint64_t elapsed;
+  do {
+    if ((err = pass(cell)) != NULL) {
+      return err;
+    }
+    ++passes;
+    elapsed = bench_now() - start;
+  } while (passes < BENCH_MIN_PASSES || elapsed < BENCH_MIN_NS);
+
+  const double ns_per_row = (double)elapsed / (double)(passes * rows);
+  printf("%s\t%zu\t%.3f\t%zu\t%.1f\t%.0f\t%.3f\n", kernel, cell->needle_length,
+         match_rate, rows, ns_per_row, 1e9 / ns_per_row,
+         (double)(bench_allocs - allocs) / (double)(passes * rows));
+  return NULL;
+}
+
+// run every kernel for one needle length and match rate
+static zsql_error *bench_cell_run(bench_corpus *corpus, size_t needle_length,
+                                  double match_rate) {
+  zsql_error *err = NULL;
+
+  int32_t needle[64];
+  uint8_t needle_bytes[64];
+  bench_needle(needle, needle_length);
+  for (size_t idx = 0; idx < needle_length; ++idx) {
+    needle_bytes[idx] = (uint8_t)needle[idx];
+  }
+  bench_splice(corpus, needle, needle_length, match_rate);
+
+  bench_cell cell = {.corpus = corpus,
+                     .needle = needle,
+                     .needle_bytes = needle_bytes,
+                     .needle_length = needle_length};
+  cell.unsettled = malloc(corpus->length * sizeof(*cell.unsettled));
+  cell.unsettled_bonuses =
+      malloc(corpus->length * sizeof(*cell.unsettled_bonuses));
+  cell.unsettled_lengths =
+      malloc(corpus->length * sizeof(*cell.unsettled_lengths));
+  if (cell.unsettled == NULL || cell.unsettled_bonuses == NULL ||
+      cell.unsettled_lengths == NULL) {
+    err = zsql_error_from_errno(NULL);
+    goto cleanup_unsettled;
+  }
+
+  // measure the match rate that splicing actually gave, overall and among
+  // ascii rows, and gather the rows left for ranking
+  size_t matched = 0;
+  size_t ascii = 0;
+  size_t ascii_matched = 0;
+  for (size_t row_idx = 0; row_idx < corpus->length; ++row_idx) {
+    const bench_row *row = &corpus->rows[row_idx];
+    ascii += row->ascii;
+
+    float score;
+    if (fuzzy_match(&score, row->runes, row->length, needle, needle_length)) {
+      cell.unsettled[cell.unsettled_length] = row->runes;
+      cell.unsettled_bonuses[cell.unsettled_length] = row->bonus;
+      cell.unsettled_lengths[cell.unsettled_length] = row->length;
+      ++cell.unsettled_length;
+    } else if (score == -INFINITY) {
+      continue;
+    }
+    ++matched;
+    ascii_matched += row->ascii;
+  }
+
+  const double rate = (double)matched / (double)corpus->length;
+  if ((err = bench_measure(bench_pass_match, &cell, "match", corpus->length,
+                           rate)) != NULL) {
+    goto cleanup_unsettled;
+  }
+  if ((err = bench_measure(bench_pass_match_ascii, &cell, "match_ascii", ascii,
+                           ascii == 0 ? 0 : (double)ascii_matched / ascii)) !=
+      NULL) {
+    goto cleanup_unsettled;
+  }
+  if ((err = bench_measure(bench_pass_search, &cell, "search", corpus->length,
+                           rate)) != NULL) {
+    goto cleanup_unsettled;
+  }
+  if ((err = bench_measure(bench_pass_rank_batch, &cell, "rank_batch",
+                           cell.unsettled_length, 1)) != NULL) {
+    goto cleanup_unsettled;
+  }
+
+cleanup_unsettled:
+  free(cell.unsettled_lengths);
+  free(cell.unsettled_bonuses);
+  free(cell.unsettled);
+  return err;
+}
+
+static const size_t bench_needle_lengths[] = {1, 3, 6, 12, 24};
+static const double bench_match_rates[] = {0, 0.01, 0.1, 0.5, 1};
+
+int main(int argc, char **argv) {
+  int status = 0;
+  zsql_error *err = NULL;
+  zsql_env_init(argc, argv);
+
+  size_t rows = 20000;
+  if (argc > 2 || (argc == 2 && sscanf(argv[1], "%zu", &rows) != 1)) {
+    fprintf(stderr, "usage: %s [rows]\n", argv[0]);
+    status = 2;
+    goto exit;
+  }
+
+  bench_corpus corpus;
+  if ((err = bench_corpus_init(&corpus, rows)) != NULL) {
+    goto exit;
+  }
+
+  size_t ascii = 0;
+  size_t long_rows = 0;
+  for (size_t idx = 0; idx < corpus.length; ++idx) {
+    ascii += corpus.rows[idx].ascii;
+    long_rows += corpus.rows[idx].length > 1024;
+  }
+  fprintf(stderr, "%zu rows, %zu ascii, %zu over 1024 codepoints\n",
+          corpus.length, ascii, long_rows);
+
+  printf("kernel\tneedle_length\tmatch_rate\trows\tns_per_row\trows_per_s\t"
+         "allocs_per_row\n");
+
+  bench_cell profile = {.corpus = &corpus};
+  if ((err = bench_measure(bench_pass_profile, &profile, "profile",
+                           corpus.length, 1)) != NULL) {
+    goto cleanup_corpus;
+  }
+
+  for (size_t length_idx = 0;
+       length_idx < ARRAY_LENGTH(bench_needle_lengths); ++length_idx) {
+    for (size_t rate_idx = 0; rate_idx < ARRAY_LENGTH(bench_match_rates);
+         ++rate_idx) {
+      if ((err = bench_cell_run(&corpus, bench_needle_lengths[length_idx],
+                                bench_match_rates[rate_idx])) != NULL) {
+        goto cleanup_corpus;
+      }
+    }
+  }
+
+cleanup_corpus:
+  bench_corpus_free(&corpus);
+exit:
+  if (err != NULL) {
+    zsql_error_print(err);
+    zsql_error_free(err);
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,21 @@
+AC_DEFUN([ZSQL_C_X86_SIMD],
+ [AC_MSG_CHECKING([for runtime-dispatched x86 simd support])
+  AC_CACHE_VAL([zsql_cv_x86_simd],
+   [AC_LINK_IFELSE(
+     [AC_LANG_PROGRAM([[#include <immintrin.h>
+__attribute__((target("avx2"))) static int avx2(void) {
+  __m256i v = _mm256_set1_epi32(1);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, v));
+}
+__attribute__((target("sse4.1"))) static int sse41(void) {
+  __m128 v = _mm_set1_ps(1.f);
+  return _mm_movemask_ps(_mm_blendv_ps(v, v, v));
+}]],
+       [[return __builtin_cpu_supports("avx2") ? avx2() : sse41();]])],
+     [zsql_cv_x86_simd=yes],
+     [zsql_cv_x86_simd=no])])
+  AC_MSG_RESULT([$zsql_cv_x86_simd])
+  AS_IF([test "x$zsql_cv_x86_simd" = 'xyes'],
+   [AC_DEFINE_UNQUOTED([HAVE_X86_SIMD], [1])
+    m4_ifnblank([$1], [$1], [[:]])],
+   [m4_ifnblank([$2], [$2], [[:]])])])
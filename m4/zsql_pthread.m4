@@ -0,0 +1,27 @@
+AC_DEFUN([ZSQL_PTHREAD],
+ [AC_MSG_CHECKING([for pthreads])
+  AC_CACHE_VAL([zsql_cv_pthread],
+   [zsql_cv_pthread=no
+    zsql_pthread_save_LIBS=$LIBS
+    for zsql_pthread_lib in '' -lpthread; do
+      AS_IF([test -n "$zsql_pthread_lib"],
+       [LIBS="$zsql_pthread_lib $zsql_pthread_save_LIBS"])
+      AC_LINK_IFELSE(
+        [AC_LANG_PROGRAM([[#include <pthread.h>
+static void *run(void *arg) { return arg; }]],
+          [[pthread_t thread;
+return pthread_create(&thread, NULL, run, NULL) != 0 ||
+       pthread_join(thread, NULL) != 0;]])],
+        [AS_IF([test -n "$zsql_pthread_lib"],
+          [zsql_cv_pthread=$zsql_pthread_lib],
+          [zsql_cv_pthread='none required'])
+         break])
+    done
+    LIBS=$zsql_pthread_save_LIBS])
+  AC_MSG_RESULT([$zsql_cv_pthread])
+  AS_IF([test "x$zsql_cv_pthread" != 'xno'],
+   [AS_IF([test "x$zsql_cv_pthread" != 'xnone required'],
+     [LIBS="$zsql_cv_pthread $LIBS"])
+    AC_DEFINE_UNQUOTED([HAVE_PTHREAD], [1])
+    m4_ifnblank([$1], [$1], [[:]])],
+   [m4_ifnblank([$2], [$2], [[:]])])])
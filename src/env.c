@@ -6,8 +6,13 @@ void zsql_env_init(int argc, char **argv) {
   ARGC = argc;
   ARGV = argv;
   DEBUGGING = getenv("ZSQL_DEBUG") != NULL;
+  STATS = DEBUGGING || getenv("ZSQL_STATS") != NULL;
+  const char *threads = getenv("ZSQL_THREADS");
+  THREADS = threads != NULL ? atoi(threads) : 0;
 }
 
 int ARGC = 1;
 char **ARGV = (char *[]){"<unknown>"};
 int DEBUGGING = 0;
+int STATS = 0;
+int THREADS = 0;
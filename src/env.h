@@ -6,5 +6,9 @@ extern void zsql_env_init(int argc, char **argv);
 extern int ARGC;
 extern char **ARGV;
 extern int DEBUGGING;
+extern int STATS;
+// how many threads may score a search, or 0 for one per core, and may check
+// dirs for a prune, or 0 for ZSQL_PRUNE_THREADS
+extern int THREADS;
 
 #endif
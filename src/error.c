@@ -18,20 +18,40 @@ zsql_error zsql_error_oom = {.next = NULL,
                              .msg = "not enough memory to allocate error"};
 
 zsql_error *zsql_error_from_errno(zsql_error *next) {
-  // fixme: not safe under threading
-  return zsql_error_from_text(strerror(errno), next);
+  const int errnum = errno;
+#if HAVE_STRERROR_R
+  // strerror may share its buffer between threads, so the message is formatted
+  // into one of our own
+  char msg[256];
+#if STRERROR_R_CHAR_P
+  return zsql_error_from_text(strerror_r(errnum, msg, sizeof(msg)), next);
+#else
+  if (strerror_r(errnum, msg, sizeof(msg)) != 0) {
+    snprintf(msg, sizeof(msg), "unknown error %d", errnum);
+  }
+  return zsql_error_from_text(msg, next);
+#endif
+#else
+  return zsql_error_from_text(strerror(errnum), next);
+#endif
 }
 zsql_error *zsql_error_from_sqlite(sqlite3 *conn, zsql_error *next) {
-  // fixme: not safe under threading
+  // the message only lasts until conn is next used, so conn is held while it's
+  // copied in case another thread is using it. a connection that failed to
+  // open may be NULL, which sqlite3_errmsg takes as out of memory
+  sqlite3_mutex *mutex = conn != NULL ? sqlite3_db_mutex(conn) : NULL;
+  sqlite3_mutex_enter(mutex);
   const char *msg = sqlite3_errmsg(conn);
 
   // fixme: this is an inelegant hack around sqlite finalize erroring
   // with the same message that any earlier steps also errored with
-  if (next != NULL && next->opaque == (uintptr_t)msg) {
-    return next;
+  zsql_error *err = next;
+  if (next == NULL || next->opaque != (uintptr_t)msg) {
+    err = zsql_error_from_text(msg, next);
   }
 
-  return zsql_error_from_text(msg, next);
+  sqlite3_mutex_leave(mutex);
+  return err;
 }
 zsql_error *zsql_error_from_text(const char *msg, zsql_error *next) {
   zsql_error *err = malloc(sizeof(*err));
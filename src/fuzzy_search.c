@@ -3,8 +3,13 @@
 #include <math.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <utf8proc.h>
 
+#if HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #include "error.h"
 
 #define SWAP(T, A, B)                                                          \
@@ -14,10 +19,108 @@
     B = SWAP;                                                                  \
   } while (0)
 
-// returns non-zero if ranking is needed
-static int fuzzy_match(float *score, const int32_t *haystack,
-                       size_t haystack_length, const int32_t *needle,
-                       size_t needle_length) {
+#if HAVE_X86_SIMD
+// the position of the first rune at or after haystack_idx, or haystack_length
+// if there's none. eight (or four) runes are compared at once, so matching
+// skips past unrelated stretches of the haystack without branching on each
+
+__attribute__((target("avx2"))) static size_t
+fuzzy_find_avx2(const int32_t *haystack, size_t haystack_idx,
+                size_t haystack_length, int32_t rune) {
+  const __m256i runes = _mm256_set1_epi32(rune);
+  for (; haystack_idx + 8 <= haystack_length; haystack_idx += 8) {
+    const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(
+        _mm256_loadu_si256((const __m256i *)(haystack + haystack_idx)),
+        runes)));
+    if (mask != 0) {
+      return haystack_idx + (size_t)__builtin_ctz((unsigned)mask);
+    }
+  }
+  for (; haystack_idx < haystack_length; ++haystack_idx) {
+    if (haystack[haystack_idx] == rune) {
+      break;
+    }
+  }
+  return haystack_idx;
+}
+
+__attribute__((target("sse4.1"))) static size_t
+fuzzy_find_sse41(const int32_t *haystack, size_t haystack_idx,
+                 size_t haystack_length, int32_t rune) {
+  const __m128i runes = _mm_set1_epi32(rune);
+  for (; haystack_idx + 4 <= haystack_length; haystack_idx += 4) {
+    const int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+        _mm_loadu_si128((const __m128i *)(haystack + haystack_idx)), runes)));
+    if (mask != 0) {
+      return haystack_idx + (size_t)__builtin_ctz((unsigned)mask);
+    }
+  }
+  for (; haystack_idx < haystack_length; ++haystack_idx) {
+    if (haystack[haystack_idx] == rune) {
+      break;
+    }
+  }
+  return haystack_idx;
+}
+#endif
+
+static size_t fuzzy_find(const int32_t *haystack, size_t haystack_idx,
+                         size_t haystack_length, int32_t rune) {
+  for (; haystack_idx < haystack_length; ++haystack_idx) {
+    if (haystack[haystack_idx] == rune) {
+      break;
+    }
+  }
+  return haystack_idx;
+}
+
+// finds runes for fuzzy_walk, with the widest kernel the cpu runs once
+// fuzzy_choose_kernels has run
+static size_t (*fuzzy_find_kernel)(const int32_t *, size_t, size_t,
+                                   int32_t) = fuzzy_find;
+
+// the rune at idx of haystack, which holds ascii bytes when ascii is non-zero
+// and utf-32 runes otherwise. functions taking ascii are always inlined with
+// it constant, which leaves each kind of haystack code of its own without a
+// branch on every rune
+static inline __attribute__((always_inline)) int32_t
+fuzzy_rune(const void *haystack, int ascii, size_t idx) {
+  return ascii ? ((const uint8_t *)haystack)[idx]
+               : ((const int32_t *)haystack)[idx];
+}
+
+// greedily take the first occurrence of each needle rune after the last,
+// noting where each was taken in first unless it's NULL. returns zero if the
+// whole needle wasn't found. an ascii haystack needs an ascii needle
+static inline __attribute__((always_inline)) int
+fuzzy_walk(size_t *first, const void *haystack, int ascii,
+           size_t haystack_length, const int32_t *needle,
+           size_t needle_length) {
+  size_t haystack_idx = 0;
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    if (ascii) {
+      const uint8_t *bytes = haystack;
+      const uint8_t *found = memchr(bytes + haystack_idx, needle[needle_idx],
+                                    haystack_length - haystack_idx);
+      haystack_idx = found != NULL ? (size_t)(found - bytes) : haystack_length;
+    } else {
+      haystack_idx = fuzzy_find_kernel(haystack, haystack_idx,
+                                       haystack_length, needle[needle_idx]);
+    }
+    if (haystack_idx >= haystack_length) {
+      return 0;
+    }
+    if (first != NULL) {
+      first[needle_idx] = haystack_idx;
+    }
+    ++haystack_idx;
+  }
+
+  return 1;
+}
+
+int fuzzy_match(float *score, const int32_t *haystack, size_t haystack_length,
+                const int32_t *needle, size_t needle_length) {
   if (needle_length == 0) {
     // zero length needle matches everything equally poorly
     *score = 0.0;
@@ -29,22 +132,72 @@ static int fuzzy_match(float *score, const int32_t *haystack,
     return 0;
   }
 
-  size_t needle_idx = 0;
-  for (size_t haystack_idx = 0; haystack_idx < haystack_length;
-       ++haystack_idx) {
-    if (haystack[haystack_idx] == needle[needle_idx]) {
-      ++needle_idx;
-      if (needle_idx >= needle_length) { // complete match
-        break;
-      }
+  if (!fuzzy_walk(NULL, haystack, 0, haystack_length, needle,
+                  needle_length)) {
+    // didn't match the entire needle; no match
+    *score = -INFINITY;
+    return 0;
+  }
+
+  if (needle_length == haystack_length) {
+    // matched and same lengths, perfect match
+    *score = 1e6f;
+    return 0;
+  }
+
+  return 1;
+}
+
+uint64_t fuzzy_signature(const int32_t *runes, size_t length) {
+  uint64_t signature = 0;
+
+  for (size_t idx = 0; idx < length; ++idx) {
+    const int32_t codepoint = runes[idx];
+    if (codepoint >= 'a' && codepoint <= 'z') {
+      signature |= UINT64_C(1) << (codepoint - 'a');
+    } else if (codepoint >= 'A' && codepoint <= 'Z') {
+      // share bits with lowercase, leaving room for everything else
+      signature |= UINT64_C(1) << (codepoint - 'A');
+    } else if (codepoint >= '0' && codepoint <= '9') {
+      signature |= UINT64_C(1) << (26 + codepoint - '0');
+    } else if (codepoint != '/') {
+      // every path has a slash, so it would never reject anything. all other
+      // codepoints share the remaining 28 bits
+      signature |= UINT64_C(1) << (36 + (uint32_t)codepoint % 28);
     }
   }
 
-  if (needle_idx < needle_length) {
-    // didn't match the entire needle; no match
+  return signature;
+}
+
+int fuzzy_match_ascii(float *score, const uint8_t *haystack,
+                      size_t haystack_length, const uint8_t *needle,
+                      size_t needle_length) {
+  if (needle_length == 0) {
+    // zero length needle matches everything equally poorly
+    *score = 0.0;
+    return 0;
+  }
+  if (needle_length > haystack_length) {
+    // needle larger than haystack
     *score = -INFINITY;
     return 0;
   }
+
+  // same greedy walk as fuzzy_match, leaning on memchr to do it a vector at a
+  // time
+  const uint8_t *cursor = haystack;
+  const uint8_t *const end = haystack + haystack_length;
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    cursor = memchr(cursor, needle[needle_idx], (size_t)(end - cursor));
+    if (cursor == NULL) {
+      // didn't match the entire needle; no match
+      *score = -INFINITY;
+      return 0;
+    }
+    ++cursor;
+  }
+
   if (needle_length == haystack_length) {
     // matched and same lengths, perfect match
     *score = 1e6f;
@@ -54,7 +207,24 @@ static int fuzzy_match(float *score, const int32_t *haystack,
   return 1;
 }
 
+// whether each ascii byte is a letter or digit, agreeing with
+// codepoint_is_word below for codepoints under 128
+static const uint8_t ascii_is_word[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x20
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 0x30
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, // 0x50
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, // 0x70
+};
+
 static inline int codepoint_is_word(int32_t codepoint, int previous) {
+  if (codepoint >= 0 && codepoint < 0x80) {
+    return ascii_is_word[codepoint];
+  }
+
   utf8proc_category_t utfcat = utf8proc_category(codepoint);
   if (utfcat == UTF8PROC_CATEGORY_MC) {
     return previous;
@@ -68,31 +238,65 @@ static const float BONUS_SLASH = 4500.f;
 static const float BONUS_BOUNDARY = 4000.f;
 static const float BONUS_PERIOD = 3000.f;
 
-static inline void compute_match_bonus(float *match_bonus,
-                                       const int32_t *string, size_t length) {
+// bonus classes as stored per codepoint by fuzzy_bonus
+enum {
+  BONUS_CLASS_NONE,
+  BONUS_CLASS_SLASH,
+  BONUS_CLASS_BOUNDARY,
+  BONUS_CLASS_PERIOD
+};
+
+static inline uint8_t bonus_class(int32_t prev_codepoint, int prev_was_word,
+                                  int is_word) {
+  if (prev_codepoint == '/') {
+    return BONUS_CLASS_SLASH;
+  } else if (prev_codepoint == '.') {
+    // This causes the codepoints after periods to have
+    // a lesser bonus than they would have per BONUS_BOUNDARY
+    return BONUS_CLASS_PERIOD;
+  } else if (prev_was_word != is_word) {
+    return BONUS_CLASS_BOUNDARY;
+  } else {
+    return BONUS_CLASS_NONE;
+  }
+}
+
+void fuzzy_bonus(uint8_t *bonus, const int32_t *haystack,
+                 size_t haystack_length) {
   int32_t prev_codepoint = 0;
   int prev_was_word = 0;
 
-  for (size_t idx = 0; idx < length; ++idx) {
-    int is_word = codepoint_is_word(string[idx], prev_was_word);
-
-    if (prev_codepoint == '/') {
-      match_bonus[idx] = BONUS_SLASH;
-    } else if (prev_codepoint == '.') {
-      // This causes the codepoints after periods to have
-      // a lesser bonus than they would have per BONUS_BOUNDARY
-      match_bonus[idx] = BONUS_PERIOD;
-    } else if (prev_was_word != is_word) {
-      match_bonus[idx] = BONUS_BOUNDARY;
-    } else {
-      match_bonus[idx] = 0.f;
-    }
+  for (size_t idx = 0; idx < haystack_length; ++idx) {
+    int is_word = codepoint_is_word(haystack[idx], prev_was_word);
+    bonus[idx] = bonus_class(prev_codepoint, prev_was_word, is_word);
+
+    prev_was_word = is_word;
+    prev_codepoint = haystack[idx];
+  }
+}
+
+void fuzzy_bonus_ascii(uint8_t *bonus, const uint8_t *haystack,
+                       size_t haystack_length) {
+  uint8_t prev_byte = 0;
+  int prev_was_word = 0;
+
+  for (size_t idx = 0; idx < haystack_length; ++idx) {
+    int is_word = ascii_is_word[haystack[idx]];
+    bonus[idx] = bonus_class(prev_byte, prev_was_word, is_word);
 
     prev_was_word = is_word;
-    prev_codepoint = string[idx];
+    prev_byte = haystack[idx];
   }
 }
 
+static inline float bonus_score(uint8_t bonus) {
+  const float bonus_scores[] = {[BONUS_CLASS_NONE] = 0.f,
+                                [BONUS_CLASS_SLASH] = BONUS_SLASH,
+                                [BONUS_CLASS_BOUNDARY] = BONUS_BOUNDARY,
+                                [BONUS_CLASS_PERIOD] = BONUS_PERIOD};
+  return bonus_scores[bonus];
+}
+
 static inline float f32_max(float a, float b) {
   if (a < b) {
     return b;
@@ -106,134 +310,1163 @@ static const float SCORE_GAP_LEADING = -50.f;
 static const float SCORE_GAP_TRAILING = -200.f;
 static const float BONUS_CONSECUTIVE = 5000.f;
 
-static inline void
-fuzzy_rank_row(const int32_t *haystack, const float *match_bonus,
-               size_t haystack_length, const int32_t *needle,
-               size_t needle_length, const float *prev_best_with_match,
-               const float *prev_best, float *restrict cur_best_with_match,
-               float *restrict cur_best, size_t needle_idx) {
+// rank the row of needle_idx from begin up to end, storing it from begin, so
+// that position haystack_idx of the previous row, stored from prev_begin, lives
+// at [haystack_idx - prev_begin]. a match from match_end on would leave no room
+// for the rest of the needle, so there the row only carries the gap along
+static inline __attribute__((always_inline)) void
+fuzzy_rank_row(const void *haystack, int ascii, const uint8_t *haystack_bonus,
+               const int32_t *needle, size_t needle_length,
+               const float *prev_best_with_match, const float *prev_best,
+               size_t prev_begin, float *restrict cur_best_with_match,
+               float *restrict cur_best, size_t begin, size_t match_end,
+               size_t end, size_t needle_idx) {
   const float gap_score =
       (needle_idx == needle_length - 1) ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
 
   float prev_score = -INFINITY;
-  for (size_t haystack_idx = 0; haystack_idx < haystack_length;
-       ++haystack_idx) {
-    if (needle[needle_idx] == haystack[haystack_idx]) {
+  size_t haystack_idx;
+  for (haystack_idx = begin; haystack_idx < match_end; ++haystack_idx) {
+    const size_t idx = haystack_idx - begin;
+    if (needle[needle_idx] == fuzzy_rune(haystack, ascii, haystack_idx)) {
+      const float match_bonus = bonus_score(haystack_bonus[haystack_idx]);
       float score = -INFINITY;
       if (needle_idx == 0) {
-        score = (haystack_idx * SCORE_GAP_LEADING) + match_bonus[haystack_idx];
+        score = (haystack_idx * SCORE_GAP_LEADING) + match_bonus;
       } else if (haystack_idx > 0) {
-        score =
-            f32_max(prev_best[haystack_idx - 1] + match_bonus[haystack_idx],
-                    prev_best_with_match[haystack_idx - 1] + BONUS_CONSECUTIVE);
+        const size_t prev_idx = haystack_idx - 1 - prev_begin;
+        score = f32_max(prev_best[prev_idx] + match_bonus,
+                        prev_best_with_match[prev_idx] + BONUS_CONSECUTIVE);
       }
 
-      cur_best_with_match[haystack_idx] = score;
-      cur_best[haystack_idx] = prev_score =
-          f32_max(score, prev_score + gap_score);
+      cur_best_with_match[idx] = score;
+      cur_best[idx] = prev_score = f32_max(score, prev_score + gap_score);
     } else {
-      cur_best_with_match[haystack_idx] = -INFINITY;
-      cur_best[haystack_idx] = prev_score = prev_score + gap_score;
+      cur_best_with_match[idx] = -INFINITY;
+      cur_best[idx] = prev_score = prev_score + gap_score;
     }
   }
+  for (; haystack_idx < end; ++haystack_idx) {
+    const size_t idx = haystack_idx - begin;
+    cur_best_with_match[idx] = -INFINITY;
+    cur_best[idx] = prev_score = prev_score + gap_score;
+  }
+}
+
+// the band of positions each needle rune can match at and still leave room
+// for the rest of the needle, from where the greedy walk of fuzzy_match takes
+// it to where the same walk back from the end does. returns zero if needle
+// doesn't match
+static inline __attribute__((always_inline)) int
+fuzzy_band(size_t *first, size_t *last, const void *haystack, int ascii,
+           size_t haystack_length, const int32_t *needle,
+           size_t needle_length) {
+  if (!fuzzy_walk(first, haystack, ascii, haystack_length, needle,
+                  needle_length)) {
+    return 0;
+  }
+
+  // the forward walk found every rune, so this walk can't run off the start
+  size_t haystack_idx = haystack_length;
+  for (size_t needle_idx = needle_length; needle_idx-- > 0;) {
+    do {
+      --haystack_idx;
+    } while (fuzzy_rune(haystack, ascii, haystack_idx) != needle[needle_idx]);
+    last[needle_idx] = haystack_idx;
+  }
+
+  return 1;
+}
+
+// the position past the last that the row of needle_idx is ranked up to. the
+// next row only reads it up to just before its own last match, and the last
+// row only needs its own last match, with the trailing gap after that being
+// the same for every match
+static inline size_t fuzzy_band_end(const size_t *last, size_t needle_length,
+                                    size_t needle_idx) {
+  return needle_idx + 1 < needle_length ? last[needle_idx + 1]
+                                        : last[needle_idx] + 1;
 }
 
 #ifdef HAVE_THREAD_LOCAL
 #define FUZZY_BUFFER_SIZE 1024
-static thread_local float fuzzy_buffers[5][FUZZY_BUFFER_SIZE];
+static thread_local float fuzzy_buffers[4][FUZZY_BUFFER_SIZE];
+static thread_local size_t fuzzy_bands[2][FUZZY_BUFFER_SIZE];
 #endif
 
-static zsql_error *fuzzy_rank(float *score, const int32_t *haystack,
-                              size_t haystack_length, const int32_t *needle,
-                              size_t needle_length) {
+// haystacks ranked on this thread, and rankings that outgrew the buffers above
+// and had to allocate their own. without thread-local storage, every thread
+// counts together
+#ifdef HAVE_THREAD_LOCAL
+static thread_local unsigned long fuzzy_ranked;
+static thread_local unsigned long fuzzy_spilled;
+#else
+static unsigned long fuzzy_ranked;
+static unsigned long fuzzy_spilled;
+#endif
+
+void fuzzy_stats(unsigned long *ranked, unsigned long *spilled) {
+  *ranked = fuzzy_ranked;
+  *spilled = fuzzy_spilled;
+  fuzzy_ranked = 0;
+  fuzzy_spilled = 0;
+}
+
+// the most a single needle rune can add to a score by matching
+static inline float fuzzy_bonus_max(void) {
+  return f32_max(BONUS_CONSECUTIVE,
+                 f32_max(BONUS_SLASH, f32_max(BONUS_BOUNDARY, BONUS_PERIOD)));
+}
+
+// the last position of a row charges a gap for every position after the row's
+// match, including those the remaining runes will take. each of those can
+// instead add at most this much, which bounds the final score from any row.
+// this leans on the inner and trailing gaps being the same
+static inline float fuzzy_remaining_max(void) {
+  return fuzzy_bonus_max() - SCORE_GAP_INNER;
+}
+
+float fuzzy_bound(size_t haystack_length, size_t needle_length) {
+  // a match at positions p0 < ... < pn-1 scores its bonuses, plus the leading
+  // gap for each of the p0 positions before it and the inner or trailing gap
+  // for every other position it skips. leading gaps cost the least, so the
+  // gaps cost at least as much as skipping every position up front, which
+  // leaves the first rune a boundary bonus at best and the rest a consecutive
+  // bonus
+  const float first_bonus_max =
+      f32_max(BONUS_SLASH, f32_max(BONUS_BOUNDARY, BONUS_PERIOD));
+  return (haystack_length - needle_length) * SCORE_GAP_LEADING +
+         first_bonus_max + (needle_length - 1) * fuzzy_bonus_max();
+}
+
+// the longest needle ranked by fuzzy_rank_fused, and the longest for which
+// that beats ranking a batch side by side, as measured on real paths
+#define FUZZY_FUSED_MAX 8
+#define FUZZY_FUSED_BATCH_MAX 4
+
+// rank needle against haystack in a single pass, a position of the haystack
+// at a time, stepping every row of the ranking over it from the last to the
+// first so that each row still sees the one before it as it was a position
+// ago. the cells are the same as fuzzy_rank_row's, so the score is too, and a
+// needle that doesn't match leaves it -INFINITY. this is always inlined with a
+// constant needle_length, giving each length a kernel of its own with its rows
+// unrolled and held in registers
+static inline __attribute__((always_inline)) float
+fuzzy_rank_fused(const void *haystack, int ascii, const uint8_t *haystack_bonus,
+                 size_t begin, size_t end, const int32_t *needle,
+                 size_t needle_length) {
+  int32_t runes[FUZZY_FUSED_MAX];
+  float best_with_match[FUZZY_FUSED_MAX];
+  float best[FUZZY_FUSED_MAX];
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    runes[needle_idx] = needle[needle_idx];
+    best_with_match[needle_idx] = -INFINITY;
+    best[needle_idx] = -INFINITY;
+  }
+
+  const float mismatch[2] = {-INFINITY, 0.f};
+  const float bonus_scores[] = {[BONUS_CLASS_NONE] = 0.f,
+                                [BONUS_CLASS_SLASH] = BONUS_SLASH,
+                                [BONUS_CLASS_BOUNDARY] = BONUS_BOUNDARY,
+                                [BONUS_CLASS_PERIOD] = BONUS_PERIOD};
+  for (size_t haystack_idx = begin; haystack_idx < end; ++haystack_idx) {
+    const int32_t rune = fuzzy_rune(haystack, ascii, haystack_idx);
+    const float match_bonus = bonus_scores[haystack_bonus[haystack_idx]];
+    // at -O2 the compiler keeps the rows in memory unless told to unroll them,
+    // for as many as FUZZY_FUSED_MAX
+#pragma GCC unroll 8
+    for (size_t needle_idx = needle_length; needle_idx-- > 0;) {
+      const float gap_score = (needle_idx == needle_length - 1)
+                                  ? SCORE_GAP_TRAILING
+                                  : SCORE_GAP_INNER;
+
+      // the row before holds -INFINITY until it first matches, so a match
+      // at the first position needs no check of its own. a mismatch adds
+      // -INFINITY rather than branching, as matches are too common to
+      // predict, and taking the max with it is the same as only taking the
+      // max on a match
+      const float score =
+          (needle_idx == 0
+               ? (haystack_idx * SCORE_GAP_LEADING) + match_bonus
+               : f32_max(best[needle_idx - 1] + match_bonus,
+                         best_with_match[needle_idx - 1] + BONUS_CONSECUTIVE)) +
+          mismatch[rune == runes[needle_idx]];
+      best_with_match[needle_idx] = score;
+      best[needle_idx] = f32_max(score, best[needle_idx] + gap_score);
+    }
+  }
+
+  return best[needle_length - 1];
+}
+
+// fuzzy_rank_fused for needles of 1 to FUZZY_FUSED_MAX runes, over just the
+// positions from the first match of the needle's first rune to the last match
+// of its last, as nothing before can match and everything after only adds the
+// trailing gap
+static inline __attribute__((always_inline)) float
+fuzzy_rank_short(const void *haystack, int ascii,
+                 const uint8_t *haystack_bonus, size_t haystack_length,
+                 const int32_t *needle, size_t needle_length) {
+  size_t begin;
+  size_t end = haystack_length;
+  if (!fuzzy_walk(&begin, haystack, ascii, haystack_length, needle, 1)) {
+    return -INFINITY;
+  }
+  do {
+    --end;
+  } while (end > begin &&
+           fuzzy_rune(haystack, ascii, end) != needle[needle_length - 1]);
+  ++end;
+
+  float score;
+  switch (needle_length) {
+  case 1:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 1);
+    break;
+  case 2:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 2);
+    break;
+  case 3:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 3);
+    break;
+  case 4:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 4);
+    break;
+  case 5:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 5);
+    break;
+  case 6:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 6);
+    break;
+  case 7:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, 7);
+    break;
+  default:
+    score = fuzzy_rank_fused(haystack, ascii, haystack_bonus, begin, end,
+                             needle, FUZZY_FUSED_MAX);
+    break;
+  }
+
+  // added a position at a time, as ranking the rest of the haystack would
+  for (; end < haystack_length; ++end) {
+    score += SCORE_GAP_TRAILING;
+  }
+  return score;
+}
+
+// rank needle against haystack a row at a time, each row covering only the
+// band of positions its rune can usefully match at. the cells outside the
+// bands can never be part of a whole match, so the score is the same as
+// ranking every cell, and long haystacks cost as much as their bands
+static inline __attribute__((always_inline)) zsql_error *
+fuzzy_rank_any(float *score, const void *haystack, int ascii,
+               const uint8_t *haystack_bonus, size_t haystack_length,
+               const int32_t *needle, size_t needle_length, float threshold) {
   zsql_error *err = NULL;
 
-  float *match_bonus;
-  float *prev_best_with_match;
-  float *prev_best;
-  float *cur_best_with_match;
-  float *cur_best;
+  // short needles are ranked in one pass, which is cheaper than finding
+  // their bands
+  if (needle_length <= FUZZY_FUSED_MAX) {
+    ++fuzzy_ranked;
+    *score = fuzzy_rank_short(haystack, ascii, haystack_bonus,
+                              haystack_length, needle, needle_length);
+    goto exit;
+  }
+
+  size_t *first;
+  size_t *last;
 
 #ifdef HAVE_THREAD_LOCAL
-  if (haystack_length <= FUZZY_BUFFER_SIZE) {
-    match_bonus = fuzzy_buffers[0];
-    prev_best_with_match = fuzzy_buffers[1];
-    prev_best = fuzzy_buffers[2];
-    cur_best_with_match = fuzzy_buffers[3];
-    cur_best = fuzzy_buffers[4];
+  if (needle_length <= FUZZY_BUFFER_SIZE) {
+    first = fuzzy_bands[0];
+    last = fuzzy_bands[1];
   } else {
 #endif
-    match_bonus = malloc(haystack_length * sizeof(*match_bonus));
-    if (match_bonus == NULL) {
+    ++fuzzy_spilled;
+    first = malloc(2 * needle_length * sizeof(*first));
+    if (first == NULL) {
       err = zsql_error_from_errno(err);
       goto exit;
     }
-    prev_best_with_match =
-        malloc(haystack_length * sizeof(*prev_best_with_match));
-    if (prev_best_with_match == NULL) {
-      err = zsql_error_from_errno(err);
-      goto cleanup_match_bonus;
+    last = first + needle_length;
+#ifdef HAVE_THREAD_LOCAL
+  }
+#endif
+
+  ++fuzzy_ranked;
+  if (!fuzzy_band(first, last, haystack, ascii, haystack_length, needle,
+                  needle_length)) {
+    *score = -INFINITY;
+    goto cleanup_bands;
+  }
+
+  size_t width = 0;
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    const size_t end = fuzzy_band_end(last, needle_length, needle_idx);
+    if (end - first[needle_idx] > width) {
+      width = end - first[needle_idx];
     }
-    prev_best = malloc(haystack_length * sizeof(*prev_best));
-    if (prev_best == NULL) {
+  }
+
+  float *rows = NULL;
+  float *prev_best_with_match;
+  float *prev_best;
+  float *cur_best_with_match;
+  float *cur_best;
+
+#ifdef HAVE_THREAD_LOCAL
+  if (width <= FUZZY_BUFFER_SIZE) {
+    prev_best_with_match = fuzzy_buffers[0];
+    prev_best = fuzzy_buffers[1];
+    cur_best_with_match = fuzzy_buffers[2];
+    cur_best = fuzzy_buffers[3];
+  } else {
+#endif
+    ++fuzzy_spilled;
+    // the rows are carved out of a single allocation
+    rows = malloc(4 * width * sizeof(*rows));
+    if (rows == NULL) {
       err = zsql_error_from_errno(err);
-      goto cleanup_prev_best_with_match;
+      goto cleanup_bands;
     }
-    cur_best_with_match =
-        malloc(haystack_length * sizeof(*cur_best_with_match));
-    if (cur_best_with_match == NULL) {
-      err = zsql_error_from_errno(err);
-      goto cleanup_prev_best;
+    prev_best_with_match = rows;
+    prev_best = prev_best_with_match + width;
+    cur_best_with_match = prev_best + width;
+    cur_best = cur_best_with_match + width;
+#ifdef HAVE_THREAD_LOCAL
+  }
+#endif
+
+  const float remaining_max = fuzzy_remaining_max();
+
+  size_t prev_begin = 0;
+  size_t needle_idx;
+  for (needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    const size_t begin = first[needle_idx];
+    const size_t end = fuzzy_band_end(last, needle_length, needle_idx);
+    fuzzy_rank_row(haystack, ascii, haystack_bonus, needle, needle_length,
+                   prev_best_with_match, prev_best, prev_begin,
+                   cur_best_with_match, cur_best, begin, last[needle_idx] + 1,
+                   end, needle_idx);
+
+    SWAP(float *, cur_best_with_match, prev_best_with_match);
+    SWAP(float *, cur_best, prev_best);
+    prev_begin = begin;
+
+    // the rest of the row would only add gaps, which are whole numbers well
+    // within a float's precision, so they can be added up front
+    const float gap_score = (needle_idx == needle_length - 1)
+                                ? SCORE_GAP_TRAILING
+                                : SCORE_GAP_INNER;
+    const float best =
+        prev_best[end - 1 - begin] + (haystack_length - end) * gap_score;
+    const size_t remaining = needle_length - 1 - needle_idx;
+    if (best + remaining * remaining_max < threshold) {
+      break;
     }
-    cur_best = malloc(haystack_length * sizeof(*cur_best));
-    if (cur_best == NULL) {
-      err = zsql_error_from_errno(err);
-      goto cleanup_cur_best_with_match;
+  }
+
+  if (needle_idx == needle_length) {
+    // the trailing gap is added a position at a time, as ranking the rest of
+    // the row would
+    const size_t end = last[needle_length - 1] + 1;
+    *score = prev_best[end - 1 - prev_begin];
+    for (size_t haystack_idx = end; haystack_idx < haystack_length;
+         ++haystack_idx) {
+      *score += SCORE_GAP_TRAILING;
     }
+  } else {
+    *score = -INFINITY;
+  }
+
+#ifdef HAVE_THREAD_LOCAL
+  if (width > FUZZY_BUFFER_SIZE) {
+#endif
+    free(rows);
+#ifdef HAVE_THREAD_LOCAL
+  }
+#endif
+cleanup_bands:
+#ifdef HAVE_THREAD_LOCAL
+  if (needle_length > FUZZY_BUFFER_SIZE) {
+#endif
+    free(first);
 #ifdef HAVE_THREAD_LOCAL
   }
 #endif
+exit:
+  return err;
+}
+
+static zsql_error *fuzzy_rank(float *score, const int32_t *haystack,
+                              const uint8_t *haystack_bonus,
+                              size_t haystack_length, const int32_t *needle,
+                              size_t needle_length, float threshold) {
+  return fuzzy_rank_any(score, haystack, 0, haystack_bonus, haystack_length,
+                        needle, needle_length, threshold);
+}
+
+// fuzzy_rank for a haystack of ascii bytes, ranked without widening them
+static zsql_error *fuzzy_rank_ascii(float *score, const uint8_t *haystack,
+                                    const uint8_t *haystack_bonus,
+                                    size_t haystack_length,
+                                    const int32_t *needle,
+                                    size_t needle_length, float threshold) {
+  return fuzzy_rank_any(score, haystack, 1, haystack_bonus, haystack_length,
+                        needle, needle_length, threshold);
+}
 
-  compute_match_bonus(match_bonus, haystack, haystack_length);
+#if HAVE_X86_SIMD
+// the batch kernels run the same recurrence as fuzzy_rank_row, with each lane
+// of a vector holding a different haystack. arrays are interleaved, so
+// position haystack_idx of lane l lives at [haystack_idx * FUZZY_BATCH_SIZE +
+// l]. f32_max(a, b) is exactly max_ps(b, a), which keeps scores bit-identical.
+// each vector of a batch carries its own dependency through prev_score, so
+// they are stepped together to overlap their latency
 
+__attribute__((target("avx2"))) static inline __m256 fuzzy_rank_step_avx2(
+    const int32_t *haystacks, const float *match_bonus,
+    const float *prev_best_with_match, const float *prev_best,
+    float *cur_best_with_match, float *cur_best, size_t offset,
+    size_t needle_idx, size_t haystack_idx, __m256i needle_rune,
+    __m256 gap_score, __m256 leading, __m256 prev_score) {
+  const __m256 negative_infinity = _mm256_set1_ps(-INFINITY);
+
+  const __m256 is_match = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+      needle_rune, _mm256_loadu_si256((const __m256i *)(haystacks + offset))));
+  const __m256 bonus = _mm256_loadu_ps(match_bonus + offset);
+
+  __m256 score = negative_infinity;
+  if (needle_idx == 0) {
+    score = _mm256_add_ps(leading, bonus);
+  } else if (haystack_idx > 0) {
+    const size_t prev_offset = offset - FUZZY_BATCH_SIZE;
+    score = _mm256_max_ps(
+        _mm256_add_ps(_mm256_loadu_ps(prev_best_with_match + prev_offset),
+                      _mm256_set1_ps(BONUS_CONSECUTIVE)),
+        _mm256_add_ps(_mm256_loadu_ps(prev_best + prev_offset), bonus));
+  }
+
+  // a mismatch leaves -INFINITY here, so taking the max with it gives the
+  // same result as only taking the max on a match
+  const __m256 best_with_match =
+      _mm256_blendv_ps(negative_infinity, score, is_match);
+  _mm256_storeu_ps(cur_best_with_match + offset, best_with_match);
+  prev_score =
+      _mm256_max_ps(_mm256_add_ps(prev_score, gap_score), best_with_match);
+  _mm256_storeu_ps(cur_best + offset, prev_score);
+
+  return prev_score;
+}
+
+// whether every lane of a batch is sure to fall below its threshold, with
+// remaining needle runes still to rank. last_offsets locates the last
+// position of each lane
+static inline int fuzzy_batch_hopeless(const float *best,
+                                       const size_t *last_offsets,
+                                       const float *thresholds, size_t count,
+                                       size_t remaining) {
+  const float remaining_max = remaining * fuzzy_remaining_max();
+  for (size_t lane = 0; lane < count; ++lane) {
+    if (best[last_offsets[lane]] + remaining_max >= thresholds[lane]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// FUZZY_BATCH_SIZE lanes are two avx2 vectors. returns the number of needle
+// runes ranked, which is short of needle_length if the batch gave up early
+__attribute__((target("avx2"))) static size_t fuzzy_rank_batch_avx2(
+    const int32_t *haystacks, const float *match_bonus, size_t max_length,
+    const int32_t *needle, size_t needle_length, float *prev_best_with_match,
+    float *prev_best, float *cur_best_with_match, float *cur_best,
+    const size_t *last_offsets, const float *thresholds, size_t count) {
   for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
-    fuzzy_rank_row(haystack, match_bonus, haystack_length, needle,
-                   needle_length, prev_best_with_match, prev_best,
-                   cur_best_with_match, cur_best, needle_idx);
+    const __m256i needle_rune = _mm256_set1_epi32(needle[needle_idx]);
+    const __m256 gap_score = _mm256_set1_ps(
+        (needle_idx == needle_length - 1) ? SCORE_GAP_TRAILING
+                                          : SCORE_GAP_INNER);
+
+    __m256 prev_score_low = _mm256_set1_ps(-INFINITY);
+    __m256 prev_score_high = prev_score_low;
+    for (size_t haystack_idx = 0; haystack_idx < max_length; ++haystack_idx) {
+      const __m256 leading =
+          _mm256_set1_ps(haystack_idx * SCORE_GAP_LEADING);
+      const size_t offset = haystack_idx * FUZZY_BATCH_SIZE;
+
+      prev_score_low = fuzzy_rank_step_avx2(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset, needle_idx, haystack_idx,
+          needle_rune, gap_score, leading, prev_score_low);
+      prev_score_high = fuzzy_rank_step_avx2(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset + 8, needle_idx, haystack_idx,
+          needle_rune, gap_score, leading, prev_score_high);
+    }
 
     SWAP(float *, cur_best_with_match, prev_best_with_match);
     SWAP(float *, cur_best, prev_best);
+
+    if (fuzzy_batch_hopeless(prev_best, last_offsets, thresholds, count,
+                             needle_length - 1 - needle_idx)) {
+      return needle_idx + 1;
+    }
   }
 
-  *score = prev_best[haystack_length - 1];
+  return needle_length;
+}
+
+__attribute__((target("sse4.1"))) static inline __m128 fuzzy_rank_step_sse41(
+    const int32_t *haystacks, const float *match_bonus,
+    const float *prev_best_with_match, const float *prev_best,
+    float *cur_best_with_match, float *cur_best, size_t offset,
+    size_t needle_idx, size_t haystack_idx, __m128i needle_rune,
+    __m128 gap_score, __m128 leading, __m128 prev_score) {
+  const __m128 negative_infinity = _mm_set1_ps(-INFINITY);
+
+  const __m128 is_match = _mm_castsi128_ps(_mm_cmpeq_epi32(
+      needle_rune, _mm_loadu_si128((const __m128i *)(haystacks + offset))));
+  const __m128 bonus = _mm_loadu_ps(match_bonus + offset);
+
+  __m128 score = negative_infinity;
+  if (needle_idx == 0) {
+    score = _mm_add_ps(leading, bonus);
+  } else if (haystack_idx > 0) {
+    const size_t prev_offset = offset - FUZZY_BATCH_SIZE;
+    const __m128 consecutive =
+        _mm_add_ps(_mm_loadu_ps(prev_best_with_match + prev_offset),
+                   _mm_set1_ps(BONUS_CONSECUTIVE));
+    const __m128 skipped =
+        _mm_add_ps(_mm_loadu_ps(prev_best + prev_offset), bonus);
+    score = _mm_max_ps(consecutive, skipped);
+  }
+
+  const __m128 best_with_match =
+      _mm_blendv_ps(negative_infinity, score, is_match);
+  _mm_storeu_ps(cur_best_with_match + offset, best_with_match);
+  prev_score = _mm_max_ps(_mm_add_ps(prev_score, gap_score), best_with_match);
+  _mm_storeu_ps(cur_best + offset, prev_score);
+
+  return prev_score;
+}
+
+// FUZZY_BATCH_SIZE lanes are four sse vectors
+__attribute__((target("sse4.1"))) static size_t fuzzy_rank_batch_sse41(
+    const int32_t *haystacks, const float *match_bonus, size_t max_length,
+    const int32_t *needle, size_t needle_length, float *prev_best_with_match,
+    float *prev_best, float *cur_best_with_match, float *cur_best,
+    const size_t *last_offsets, const float *thresholds, size_t count) {
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    const __m128i needle_rune = _mm_set1_epi32(needle[needle_idx]);
+    const __m128 gap_score =
+        _mm_set1_ps((needle_idx == needle_length - 1) ? SCORE_GAP_TRAILING
+                                                      : SCORE_GAP_INNER);
+
+    __m128 prev_score_0 = _mm_set1_ps(-INFINITY);
+    __m128 prev_score_1 = prev_score_0;
+    __m128 prev_score_2 = prev_score_0;
+    __m128 prev_score_3 = prev_score_0;
+    for (size_t haystack_idx = 0; haystack_idx < max_length; ++haystack_idx) {
+      const __m128 leading = _mm_set1_ps(haystack_idx * SCORE_GAP_LEADING);
+      const size_t offset = haystack_idx * FUZZY_BATCH_SIZE;
+
+      prev_score_0 = fuzzy_rank_step_sse41(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset, needle_idx, haystack_idx,
+          needle_rune, gap_score, leading, prev_score_0);
+      prev_score_1 = fuzzy_rank_step_sse41(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset + 4, needle_idx, haystack_idx,
+          needle_rune, gap_score, leading, prev_score_1);
+      prev_score_2 = fuzzy_rank_step_sse41(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset + 8, needle_idx, haystack_idx,
+          needle_rune, gap_score, leading, prev_score_2);
+      prev_score_3 = fuzzy_rank_step_sse41(
+          haystacks, match_bonus, prev_best_with_match, prev_best,
+          cur_best_with_match, cur_best, offset + 12, needle_idx,
+          haystack_idx, needle_rune, gap_score, leading, prev_score_3);
+    }
+
+    SWAP(float *, cur_best_with_match, prev_best_with_match);
+    SWAP(float *, cur_best, prev_best);
+
+    if (fuzzy_batch_hopeless(prev_best, last_offsets, thresholds, count,
+                             needle_length - 1 - needle_idx)) {
+      return needle_idx + 1;
+    }
+  }
 
+  return needle_length;
+}
+
+// transpose the 8x8 block of 32-bit values held in R0 through R7
+#define TRANSPOSE_AVX2(R0, R1, R2, R3, R4, R5, R6, R7)                        \
+  do {                                                                         \
+    const __m256i P0 = _mm256_unpacklo_epi32(R0, R1);                          \
+    const __m256i P1 = _mm256_unpackhi_epi32(R0, R1);                          \
+    const __m256i P2 = _mm256_unpacklo_epi32(R2, R3);                          \
+    const __m256i P3 = _mm256_unpackhi_epi32(R2, R3);                          \
+    const __m256i P4 = _mm256_unpacklo_epi32(R4, R5);                          \
+    const __m256i P5 = _mm256_unpackhi_epi32(R4, R5);                          \
+    const __m256i P6 = _mm256_unpacklo_epi32(R6, R7);                          \
+    const __m256i P7 = _mm256_unpackhi_epi32(R6, R7);                          \
+    const __m256i Q0 = _mm256_unpacklo_epi64(P0, P2);                          \
+    const __m256i Q1 = _mm256_unpackhi_epi64(P0, P2);                          \
+    const __m256i Q2 = _mm256_unpacklo_epi64(P1, P3);                          \
+    const __m256i Q3 = _mm256_unpackhi_epi64(P1, P3);                          \
+    const __m256i Q4 = _mm256_unpacklo_epi64(P4, P6);                          \
+    const __m256i Q5 = _mm256_unpackhi_epi64(P4, P6);                          \
+    const __m256i Q6 = _mm256_unpacklo_epi64(P5, P7);                          \
+    const __m256i Q7 = _mm256_unpackhi_epi64(P5, P7);                          \
+    R0 = _mm256_permute2x128_si256(Q0, Q4, 0x20);                              \
+    R1 = _mm256_permute2x128_si256(Q1, Q5, 0x20);                              \
+    R2 = _mm256_permute2x128_si256(Q2, Q6, 0x20);                              \
+    R3 = _mm256_permute2x128_si256(Q3, Q7, 0x20);                              \
+    R4 = _mm256_permute2x128_si256(Q0, Q4, 0x31);                              \
+    R5 = _mm256_permute2x128_si256(Q1, Q5, 0x31);                              \
+    R6 = _mm256_permute2x128_si256(Q2, Q6, 0x31);                              \
+    R7 = _mm256_permute2x128_si256(Q3, Q7, 0x31);                              \
+  } while (0)
+
+// interleave haystacks with transposes, a block of 8 positions by 8 lanes at
+// a time. sources are read directly wherever a lane has a whole block left,
+// and through a padded copy otherwise. ascii bytes are widened as they're
+// loaded, sign extended so that their padding of 0xff becomes -1 like the
+// runes'. buffers must have room for max_length rounded up to a multiple of 8
+__attribute__((target("avx2"))) static inline
+    __attribute__((always_inline)) void
+    fuzzy_interleave_avx2_any(int32_t *interleaved, float *match_bonus,
+                              const void *const *haystacks, int ascii,
+                              const uint8_t *const *haystack_bonuses,
+                              const size_t *haystack_lengths, size_t count,
+                              size_t max_length) {
+  const float bonus_table[8] = {[BONUS_CLASS_NONE] = 0.f,
+                                [BONUS_CLASS_SLASH] = BONUS_SLASH,
+                                [BONUS_CLASS_BOUNDARY] = BONUS_BOUNDARY,
+                                [BONUS_CLASS_PERIOD] = BONUS_PERIOD};
+  const __m256 bonus_scores = _mm256_loadu_ps(bonus_table);
+
+  int32_t absent_runes[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+  uint8_t absent_bytes[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+  uint8_t absent_bonus[8] = {0};
+  int32_t tail_runes[FUZZY_BATCH_SIZE][8];
+  uint8_t tail_bytes[FUZZY_BATCH_SIZE][8];
+  uint8_t tail_bonus[FUZZY_BATCH_SIZE][8];
+
+  for (size_t base = 0; base < max_length; base += 8) {
+    const void *runes[FUZZY_BATCH_SIZE];
+    const uint8_t *bonuses[FUZZY_BATCH_SIZE];
+
+    for (size_t lane = 0; lane < FUZZY_BATCH_SIZE; ++lane) {
+      size_t remaining = 0;
+      if (lane < count && haystack_lengths[lane] > base) {
+        remaining = haystack_lengths[lane] - base;
+      }
+
+      if (remaining >= 8) {
+        runes[lane] = ascii ? (const void *)((const uint8_t *)haystacks[lane] +
+                                             base)
+                            : (const int32_t *)haystacks[lane] + base;
+        bonuses[lane] = haystack_bonuses[lane] + base;
+      } else if (remaining > 0) {
+        for (size_t idx = 0; idx < 8; ++idx) {
+          if (ascii) {
+            tail_bytes[lane][idx] =
+                idx < remaining ? ((const uint8_t *)haystacks[lane])[base + idx]
+                                : 0xff;
+          } else {
+            tail_runes[lane][idx] =
+                idx < remaining ? ((const int32_t *)haystacks[lane])[base + idx]
+                                : -1;
+          }
+          tail_bonus[lane][idx] =
+              idx < remaining ? haystack_bonuses[lane][base + idx] : 0;
+        }
+        runes[lane] = ascii ? (const void *)tail_bytes[lane] : tail_runes[lane];
+        bonuses[lane] = tail_bonus[lane];
+      } else {
+        runes[lane] = ascii ? (const void *)absent_bytes : absent_runes;
+        bonuses[lane] = absent_bonus;
+      }
+    }
+
+    for (size_t group = 0; group < FUZZY_BATCH_SIZE; group += 8) {
+#define LOAD_RUNES(ROW)                                                        \
+  (ascii ? _mm256_cvtepi8_epi32(                                               \
+               _mm_loadl_epi64((const __m128i *)runes[group + ROW]))           \
+         : _mm256_loadu_si256((const __m256i *)runes[group + ROW]))
+#define LOAD_CLASSES(ROW)                                                      \
+  _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)bonuses[group + ROW]))
+#define STORE(COL, RUNES, CLASSES)                                             \
+  do {                                                                         \
+    const size_t offset = (base + COL) * FUZZY_BATCH_SIZE + group;             \
+    _mm256_storeu_si256((__m256i *)(interleaved + offset), RUNES);             \
+    _mm256_storeu_ps(match_bonus + offset,                                     \
+                     _mm256_permutevar8x32_ps(bonus_scores, CLASSES));         \
+  } while (0)
+
+      __m256i r0 = LOAD_RUNES(0), r1 = LOAD_RUNES(1), r2 = LOAD_RUNES(2),
+              r3 = LOAD_RUNES(3), r4 = LOAD_RUNES(4), r5 = LOAD_RUNES(5),
+              r6 = LOAD_RUNES(6), r7 = LOAD_RUNES(7);
+      TRANSPOSE_AVX2(r0, r1, r2, r3, r4, r5, r6, r7);
+
+      __m256i c0 = LOAD_CLASSES(0), c1 = LOAD_CLASSES(1),
+              c2 = LOAD_CLASSES(2), c3 = LOAD_CLASSES(3),
+              c4 = LOAD_CLASSES(4), c5 = LOAD_CLASSES(5),
+              c6 = LOAD_CLASSES(6), c7 = LOAD_CLASSES(7);
+      TRANSPOSE_AVX2(c0, c1, c2, c3, c4, c5, c6, c7);
+
+      STORE(0, r0, c0);
+      STORE(1, r1, c1);
+      STORE(2, r2, c2);
+      STORE(3, r3, c3);
+      STORE(4, r4, c4);
+      STORE(5, r5, c5);
+      STORE(6, r6, c6);
+      STORE(7, r7, c7);
+
+#undef LOAD_RUNES
+#undef LOAD_CLASSES
+#undef STORE
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void fuzzy_interleave_avx2(
+    int32_t *interleaved, float *match_bonus, const void *const *haystacks,
+    const uint8_t *const *haystack_bonuses, const size_t *haystack_lengths,
+    size_t count, size_t max_length) {
+  fuzzy_interleave_avx2_any(interleaved, match_bonus, haystacks, 0,
+                            haystack_bonuses, haystack_lengths, count,
+                            max_length);
+}
+
+__attribute__((target("avx2"))) static void fuzzy_interleave_ascii_avx2(
+    int32_t *interleaved, float *match_bonus, const void *const *haystacks,
+    const uint8_t *const *haystack_bonuses, const size_t *haystack_lengths,
+    size_t count, size_t max_length) {
+  fuzzy_interleave_avx2_any(interleaved, match_bonus, haystacks, 1,
+                            haystack_bonuses, haystack_lengths, count,
+                            max_length);
+}
+
+static inline __attribute__((always_inline)) void
+fuzzy_interleave_any(int32_t *interleaved, float *match_bonus,
+                     const void *const *haystacks, int ascii,
+                     const uint8_t *const *haystack_bonuses,
+                     const size_t *haystack_lengths, size_t count,
+                     size_t max_length) {
+  const float bonus_scores[] = {[BONUS_CLASS_NONE] = 0.f,
+                                [BONUS_CLASS_SLASH] = BONUS_SLASH,
+                                [BONUS_CLASS_BOUNDARY] = BONUS_BOUNDARY,
+                                [BONUS_CLASS_PERIOD] = BONUS_PERIOD};
+
+  for (size_t lane = 0; lane < FUZZY_BATCH_SIZE; ++lane) {
+    size_t length = 0;
+    if (lane < count) {
+      const void *haystack = haystacks[lane];
+      const uint8_t *haystack_bonus = haystack_bonuses[lane];
+      length = haystack_lengths[lane];
+      for (size_t idx = 0; idx < length; ++idx) {
+        interleaved[idx * FUZZY_BATCH_SIZE + lane] =
+            fuzzy_rune(haystack, ascii, idx);
+        match_bonus[idx * FUZZY_BATCH_SIZE + lane] =
+            bonus_scores[haystack_bonus[idx]];
+      }
+    }
+    for (size_t idx = length; idx < max_length; ++idx) {
+      interleaved[idx * FUZZY_BATCH_SIZE + lane] = -1;
+      match_bonus[idx * FUZZY_BATCH_SIZE + lane] = 0.f;
+    }
+  }
+}
+
+static void fuzzy_interleave(int32_t *interleaved, float *match_bonus,
+                             const void *const *haystacks,
+                             const uint8_t *const *haystack_bonuses,
+                             const size_t *haystack_lengths, size_t count,
+                             size_t max_length) {
+  fuzzy_interleave_any(interleaved, match_bonus, haystacks, 0,
+                       haystack_bonuses, haystack_lengths, count, max_length);
+}
+
+static void fuzzy_interleave_ascii(int32_t *interleaved, float *match_bonus,
+                                   const void *const *haystacks,
+                                   const uint8_t *const *haystack_bonuses,
+                                   const size_t *haystack_lengths,
+                                   size_t count, size_t max_length) {
+  fuzzy_interleave_any(interleaved, match_bonus, haystacks, 1,
+                       haystack_bonuses, haystack_lengths, count, max_length);
+}
+
+// the longest haystack ranked in a batch, which the batch buffers are sized
+// for when there are any
+#define FUZZY_BATCH_BUFFER_SIZE 256
 #ifdef HAVE_THREAD_LOCAL
-  if (haystack_length > FUZZY_BUFFER_SIZE) {
-#endif
-  cleanup_cur_best:
-    free(cur_best);
-  cleanup_cur_best_with_match:
-    free(cur_best_with_match);
-  cleanup_prev_best:
-    free(prev_best);
-  cleanup_prev_best_with_match:
-    free(prev_best_with_match);
-  cleanup_match_bonus:
+static thread_local int32_t
+    fuzzy_batch_haystacks[FUZZY_BATCH_BUFFER_SIZE * FUZZY_BATCH_SIZE];
+static thread_local float
+    fuzzy_batch_buffers[5][FUZZY_BATCH_BUFFER_SIZE * FUZZY_BATCH_SIZE];
+#endif
+
+// the kernels fuzzy_rank_simd runs, or NULL if the cpu runs none. ascii
+// haystacks are only widened as they're interleaved
+static void (*fuzzy_interleave_kernel)(int32_t *, float *, const void *const *,
+                                       const uint8_t *const *, const size_t *,
+                                       size_t, size_t);
+static void (*fuzzy_interleave_ascii_kernel)(int32_t *, float *,
+                                             const void *const *,
+                                             const uint8_t *const *,
+                                             const size_t *, size_t, size_t);
+static size_t (*fuzzy_rank_batch_kernel)(const int32_t *, const float *,
+                                         size_t, const int32_t *, size_t,
+                                         float *, float *, float *, float *,
+                                         const size_t *, const float *,
+                                         size_t);
+
+// pick the widest kernels the cpu runs, once before main rather than on every
+// row walked and batch ranked
+__attribute__((constructor)) static void fuzzy_choose_kernels(void) {
+  // constructors can run before the cpu has been probed for us
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    fuzzy_find_kernel = fuzzy_find_avx2;
+    fuzzy_interleave_kernel = fuzzy_interleave_avx2;
+    fuzzy_interleave_ascii_kernel = fuzzy_interleave_ascii_avx2;
+    fuzzy_rank_batch_kernel = fuzzy_rank_batch_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    fuzzy_find_kernel = fuzzy_find_sse41;
+    fuzzy_interleave_kernel = fuzzy_interleave;
+    fuzzy_interleave_ascii_kernel = fuzzy_interleave_ascii;
+    fuzzy_rank_batch_kernel = fuzzy_rank_batch_sse41;
+  }
+}
+
+// rank haystacks side by side, returning non-zero if the cpu has no suitable
+// kernel. haystacks are ascii bytes if ascii is non-zero and runes otherwise
+static int fuzzy_rank_simd(zsql_error **err, float *scores,
+                           const void *const *haystacks, int ascii,
+                           const uint8_t *const *haystack_bonuses,
+                           const size_t *haystack_lengths, size_t count,
+                           const int32_t *needle, size_t needle_length,
+                           const float *thresholds) {
+  if (fuzzy_rank_batch_kernel == NULL) {
+    return 1;
+  }
+
+  size_t max_length = 0;
+  for (size_t idx = 0; idx < count; ++idx) {
+    if (haystack_lengths[idx] > max_length) {
+      max_length = haystack_lengths[idx];
+    }
+  }
+
+  // haystacks are unused past max_length, but rounding up lets the avx2
+  // interleave always write whole blocks
+  const size_t padded_length = (max_length + 7) & ~(size_t)7;
+  const size_t buffer_length = padded_length * FUZZY_BATCH_SIZE;
+  int32_t *interleaved;
+  float *match_bonus;
+  float *prev_best_with_match;
+  float *prev_best;
+  float *cur_best_with_match;
+  float *cur_best;
+
+#ifdef HAVE_THREAD_LOCAL
+  if (padded_length <= FUZZY_BATCH_BUFFER_SIZE) {
+    interleaved = fuzzy_batch_haystacks;
+    match_bonus = fuzzy_batch_buffers[0];
+    prev_best_with_match = fuzzy_batch_buffers[1];
+    prev_best = fuzzy_batch_buffers[2];
+    cur_best_with_match = fuzzy_batch_buffers[3];
+    cur_best = fuzzy_batch_buffers[4];
+  } else {
+#endif
+    ++fuzzy_spilled;
+    interleaved = malloc(buffer_length * sizeof(*interleaved));
+    if (interleaved == NULL) {
+      *err = zsql_error_from_errno(*err);
+      goto exit;
+    }
+    // the float arrays are carved out of a single allocation
+    match_bonus = malloc(5 * buffer_length * sizeof(*match_bonus));
+    if (match_bonus == NULL) {
+      *err = zsql_error_from_errno(*err);
+      goto cleanup_interleaved;
+    }
+    prev_best_with_match = match_bonus + buffer_length;
+    prev_best = prev_best_with_match + buffer_length;
+    cur_best_with_match = prev_best + buffer_length;
+    cur_best = cur_best_with_match + buffer_length;
+#ifdef HAVE_THREAD_LOCAL
+  }
+#endif
+
+  fuzzy_ranked += count;
+  size_t last_offsets[FUZZY_BATCH_SIZE];
+  for (size_t lane = 0; lane < count; ++lane) {
+    last_offsets[lane] = (haystack_lengths[lane] - 1) * FUZZY_BATCH_SIZE + lane;
+  }
+
+  // unused lanes and positions past the end of a haystack hold -1, which no
+  // needle rune can equal. positions after the end never influence the ones
+  // before it, so each lane's score is unaffected
+  (ascii ? fuzzy_interleave_ascii_kernel : fuzzy_interleave_kernel)(
+      interleaved, match_bonus, haystacks, haystack_bonuses, haystack_lengths,
+      count, max_length);
+  const size_t ranked = fuzzy_rank_batch_kernel(
+      interleaved, match_bonus, max_length, needle, needle_length,
+      prev_best_with_match, prev_best, cur_best_with_match, cur_best,
+      last_offsets, thresholds, count);
+
+  // the kernels swap after every row, so the last row is in prev_best for an
+  // even number of rows and in cur_best otherwise
+  const float *last_best = (needle_length % 2 == 0) ? prev_best : cur_best;
+  for (size_t lane = 0; lane < count; ++lane) {
+    if (ranked < needle_length ||
+        last_best[last_offsets[lane]] < thresholds[lane]) {
+      scores[lane] = -INFINITY;
+    } else {
+      scores[lane] = last_best[last_offsets[lane]];
+    }
+  }
+
+#ifdef HAVE_THREAD_LOCAL
+  if (padded_length > FUZZY_BATCH_BUFFER_SIZE) {
+#endif
     free(match_bonus);
+  cleanup_interleaved:
+    free(interleaved);
 #ifdef HAVE_THREAD_LOCAL
   }
 #endif
 exit:
-  return err;
+  return 0;
 }
+#endif
 
 zsql_error *fuzzy_search(float *score, const int32_t *haystack,
-                         size_t haystack_length, const int32_t *needle,
-                         size_t needle_length) {
-  if (fuzzy_match(score, haystack, haystack_length, needle, needle_length) !=
+                         const uint8_t *haystack_bonus, size_t haystack_length,
+                         const int32_t *needle, size_t needle_length,
+                         float threshold) {
+  if (fuzzy_match(score, haystack, haystack_length, needle, needle_length) ==
       0) {
-    return fuzzy_rank(score, haystack, haystack_length, needle, needle_length);
+    return NULL;
+  }
+
+  if (fuzzy_bound(haystack_length, needle_length) < threshold) {
+    *score = -INFINITY;
+    return NULL;
+  }
+
+  return fuzzy_rank(score, haystack, haystack_bonus, haystack_length, needle,
+                    needle_length, threshold);
+}
+
+// rank haystack on its own, as ascii bytes if ascii is non-zero
+static zsql_error *fuzzy_rank_either(float *score, const void *haystack,
+                                     int ascii, const uint8_t *haystack_bonus,
+                                     size_t haystack_length,
+                                     const int32_t *needle,
+                                     size_t needle_length, float threshold) {
+  return ascii ? fuzzy_rank_ascii(score, haystack, haystack_bonus,
+                                  haystack_length, needle, needle_length,
+                                  threshold)
+               : fuzzy_rank(score, haystack, haystack_bonus, haystack_length,
+                            needle, needle_length, threshold);
+}
+
+// fuzzy_rank_batch for haystacks of ascii bytes if ascii is non-zero, and of
+// runes otherwise
+static zsql_error *fuzzy_rank_haystacks(float *scores,
+                                        const void *const *haystacks,
+                                        int ascii,
+                                        const uint8_t *const *haystack_bonuses,
+                                        const size_t *haystack_lengths,
+                                        size_t count, const int32_t *needle,
+                                        size_t needle_length,
+                                        const float *thresholds) {
+  zsql_error *err = NULL;
+
+#if HAVE_X86_SIMD
+  // short needles rank faster a haystack at a time, each of their rows held
+  // in a register by fuzzy_rank_fused
+  if (needle_length > FUZZY_FUSED_BATCH_MAX) {
+    // haystacks too long for the batch buffers are ranked alone, through their
+    // bands, rather than padding every lane out to their length
+    const void *batch_haystacks[FUZZY_BATCH_SIZE];
+    const uint8_t *batch_bonuses[FUZZY_BATCH_SIZE];
+    size_t batch_lengths[FUZZY_BATCH_SIZE];
+    float batch_thresholds[FUZZY_BATCH_SIZE];
+    size_t batch_indices[FUZZY_BATCH_SIZE];
+    size_t batch_count = 0;
+    for (size_t idx = 0; idx < count; ++idx) {
+      if (haystack_lengths[idx] > FUZZY_BATCH_BUFFER_SIZE) {
+        if ((err = fuzzy_rank_either(&scores[idx], haystacks[idx], ascii,
+                                     haystack_bonuses[idx],
+                                     haystack_lengths[idx], needle,
+                                     needle_length, thresholds[idx])) !=
+            NULL) {
+          return err;
+        }
+        continue;
+      }
+      batch_haystacks[batch_count] = haystacks[idx];
+      batch_bonuses[batch_count] = haystack_bonuses[idx];
+      batch_lengths[batch_count] = haystack_lengths[idx];
+      batch_thresholds[batch_count] = thresholds[idx];
+      batch_indices[batch_count++] = idx;
+    }
+
+    // a single haystack is cheaper to rank alone
+    float batch_scores[FUZZY_BATCH_SIZE];
+    if (batch_count > 1 &&
+        fuzzy_rank_simd(&err, batch_scores, batch_haystacks, ascii,
+                        batch_bonuses, batch_lengths, batch_count, needle,
+                        needle_length, batch_thresholds) == 0) {
+      for (size_t idx = 0; idx < batch_count; ++idx) {
+        scores[batch_indices[idx]] = batch_scores[idx];
+      }
+      return err;
+    }
+    for (size_t idx = 0; idx < batch_count; ++idx) {
+      if ((err = fuzzy_rank_either(
+               &scores[batch_indices[idx]], batch_haystacks[idx], ascii,
+               batch_bonuses[idx], batch_lengths[idx], needle, needle_length,
+               batch_thresholds[idx])) != NULL) {
+        break;
+      }
+    }
+    return err;
+  }
+#endif
+
+  for (size_t idx = 0; idx < count; ++idx) {
+    if ((err = fuzzy_rank_either(&scores[idx], haystacks[idx], ascii,
+                                 haystack_bonuses[idx], haystack_lengths[idx],
+                                 needle, needle_length, thresholds[idx])) !=
+        NULL) {
+      break;
+    }
+  }
+
+  return err;
+}
+
+zsql_error *fuzzy_rank_batch(float *scores, const int32_t *const *haystacks,
+                             const uint8_t *const *haystack_bonuses,
+                             const size_t *haystack_lengths, size_t count,
+                             const int32_t *needle, size_t needle_length,
+                             const float *thresholds) {
+  const void *any[FUZZY_BATCH_SIZE];
+  for (size_t idx = 0; idx < count; ++idx) {
+    any[idx] = haystacks[idx];
+  }
+  return fuzzy_rank_haystacks(scores, any, 0, haystack_bonuses,
+                              haystack_lengths, count, needle, needle_length,
+                              thresholds);
+}
+
+zsql_error *fuzzy_rank_batch_ascii(float *scores,
+                                   const uint8_t *const *haystacks,
+                                   const uint8_t *const *haystack_bonuses,
+                                   const size_t *haystack_lengths,
+                                   size_t count, const int32_t *needle,
+                                   size_t needle_length,
+                                   const float *thresholds) {
+  const void *any[FUZZY_BATCH_SIZE];
+  for (size_t idx = 0; idx < count; ++idx) {
+    any[idx] = haystacks[idx];
+  }
+  return fuzzy_rank_haystacks(scores, any, 1, haystack_bonuses,
+                              haystack_lengths, count, needle, needle_length,
+                              thresholds);
+}
+
+zsql_error *fuzzy_positions(size_t *positions, const int32_t *haystack,
+                            const uint8_t *haystack_bonus,
+                            size_t haystack_length, const int32_t *needle,
+                            size_t needle_length) {
+  zsql_error *err = NULL;
+
+  if (needle_length == 0) {
+    goto exit;
+  }
+  if (needle_length > haystack_length) {
+    err = zsql_error_from_text("needle doesn't match haystack", err);
+    goto exit;
+  }
+
+  // unlike fuzzy_rank, every row is kept whole to trace back through
+  const size_t cells = needle_length * haystack_length;
+  float *best_with_match = malloc(cells * sizeof(*best_with_match));
+  if (best_with_match == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  float *best = malloc(cells * sizeof(*best));
+  if (best == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_best_with_match;
+  }
+
+  for (size_t needle_idx = 0; needle_idx < needle_length; ++needle_idx) {
+    const size_t row = needle_idx * haystack_length;
+    const size_t prev_row = needle_idx > 0 ? row - haystack_length : row;
+    fuzzy_rank_row(haystack, 0, haystack_bonus, needle, needle_length,
+                   best_with_match + prev_row, best + prev_row, 0,
+                   best_with_match + row, best + row, 0, haystack_length,
+                   haystack_length, needle_idx);
+  }
+
+  if (best[cells - 1] == -INFINITY) {
+    err = zsql_error_from_text("needle doesn't match haystack", err);
+    goto cleanup_best;
   }
 
-  return NULL;
+  // retrace the choices fuzzy_rank_row made, breaking ties the same way
+  // f32_max does. with_match is set while the rune at needle_idx has to match
+  // at haystack_idx, as a consecutive match does
+  size_t needle_idx = needle_length - 1;
+  size_t haystack_idx = haystack_length - 1;
+  int with_match = 0;
+  for (;;) {
+    const size_t cell = needle_idx * haystack_length + haystack_idx;
+    if (!with_match) {
+      const float gap_score = (needle_idx == needle_length - 1)
+                                  ? SCORE_GAP_TRAILING
+                                  : SCORE_GAP_INNER;
+      if (haystack_idx > 0 &&
+          best_with_match[cell] < best[cell - 1] + gap_score) {
+        --haystack_idx;
+        continue;
+      }
+    }
+
+    positions[needle_idx] = haystack_idx;
+    if (needle_idx == 0) {
+      break;
+    }
+    const size_t prev_cell = cell - haystack_length - 1;
+    with_match = best[prev_cell] + bonus_score(haystack_bonus[haystack_idx]) <
+                 best_with_match[prev_cell] + BONUS_CONSECUTIVE;
+    --needle_idx;
+    --haystack_idx;
+  }
+
+cleanup_best:
+  free(best);
+cleanup_best_with_match:
+  free(best_with_match);
+exit:
+  return err;
 }
@@ -6,8 +6,73 @@
 
 #include "error.h"
 
+// summarize which codepoints appear in runes as a bitmask. a needle can only
+// match a haystack if every bit of the needle's signature is set in the
+// haystack's, so comparing signatures rejects most rows without ranking
+extern uint64_t fuzzy_signature(const int32_t *runes, size_t length);
+// classify each codepoint of haystack into bonus, one byte per codepoint. the
+// result only depends on haystack, so it can be computed once and stored
+extern void fuzzy_bonus(uint8_t *bonus, const int32_t *haystack,
+                        size_t haystack_length);
+// fuzzy_bonus for a haystack of ascii bytes, with the same results and no
+// unicode lookups
+extern void fuzzy_bonus_ascii(uint8_t *bonus, const uint8_t *haystack,
+                              size_t haystack_length);
+// score needle against haystack, giving up as soon as the score is sure to
+// fall below threshold and reporting it as -INFINITY. a threshold of -INFINITY
+// always gives the full score
 extern zsql_error *fuzzy_search(float *score, const int32_t *haystack,
+                                const uint8_t *haystack_bonus,
                                 size_t haystack_length, const int32_t *needle,
-                                size_t needle_length);
+                                size_t needle_length, float threshold);
+// an upper bound on the score of any haystack of haystack_length that
+// fuzzy_match leaves unsettled, from the bonus and gap constants alone. the
+// bound falls as haystacks grow, so short ones can be ranked first
+extern float fuzzy_bound(size_t haystack_length, size_t needle_length);
+
+// settle the score of haystack where that's possible without ranking,
+// returning non-zero if it still needs fuzzy_rank_batch
+extern int fuzzy_match(float *score, const int32_t *haystack,
+                       size_t haystack_length, const int32_t *needle,
+                       size_t needle_length);
+// fuzzy_match for an ascii haystack and needle, compared byte for byte
+extern int fuzzy_match_ascii(float *score, const uint8_t *haystack,
+                             size_t haystack_length, const uint8_t *needle,
+                             size_t needle_length);
+
+#define FUZZY_BATCH_SIZE 16
+// rank up to FUZZY_BATCH_SIZE haystacks that fuzzy_match couldn't settle,
+// giving the same scores as fuzzy_search with each haystack's threshold. on
+// x86 cpus with sse4.1 or avx2 the haystacks are ranked side by side, one per
+// vector lane, giving up once every one of them falls short. long haystacks
+// are ranked alone, over just the positions each needle rune could match at,
+// and so are haystacks for needles of a few runes, in a single pass each
+extern zsql_error *fuzzy_rank_batch(float *scores,
+                                    const int32_t *const *haystacks,
+                                    const uint8_t *const *haystack_bonuses,
+                                    const size_t *haystack_lengths,
+                                    size_t count, const int32_t *needle,
+                                    size_t needle_length,
+                                    const float *thresholds);
+// fuzzy_rank_batch for haystacks of ascii bytes, ranked on the bytes
+// themselves. the needle must be ascii too
+extern zsql_error *fuzzy_rank_batch_ascii(
+    float *scores, const uint8_t *const *haystacks,
+    const uint8_t *const *haystack_bonuses, const size_t *haystack_lengths,
+    size_t count, const int32_t *needle, size_t needle_length,
+    const float *thresholds);
+// the position within haystack of each rune of needle in the match that
+// fuzzy_search scores, traced back through the same ranking. this keeps every
+// row of the ranking, so it's meant for the few haystacks actually shown
+extern zsql_error *fuzzy_positions(size_t *positions, const int32_t *haystack,
+                                   const uint8_t *haystack_bonus,
+                                   size_t haystack_length,
+                                   const int32_t *needle,
+                                   size_t needle_length);
+
+// how many haystacks have been ranked on this thread, and how many rankings
+// allocated buffers of their own for haystacks too long for the preallocated
+// ones, since the last call
+extern void fuzzy_stats(unsigned long *ranked, unsigned long *spilled);
 
 #endif
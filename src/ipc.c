@@ -0,0 +1,270 @@
+#include "ipc.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "error.h"
+
+// messages over a unix socket, each its length as a uint32_t followed by that
+// many bytes. both ends are the same program on the same machine, so the
+// length is in host byte order
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// longer than any message zsql sends, so a peer sending garbage can't make
+// the other end allocate without bound
+#define IPC_MESSAGE_MAX (UINT32_C(1) << 24)
+
+// how long either end waits on the other before giving up on it
+#define IPC_TIMEOUT_SECONDS 2
+
+static int ipc_address(const char *path, struct sockaddr_un *address) {
+  const size_t path_length = strlen(path);
+  if (path_length >= sizeof(address->sun_path)) {
+    return 1;
+  }
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  memcpy(address->sun_path, path, path_length + 1);
+  return 0;
+}
+
+static int ipc_timeout(int fd) {
+  const struct timeval timeout = {.tv_sec = IPC_TIMEOUT_SECONDS, .tv_usec = 0};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) !=
+      0) {
+    return 1;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) !=
+      0) {
+    return 1;
+  }
+  return 0;
+}
+
+// connect to a server listening at path, returning -1 if there's none. a
+// server that can't be reached for any reason is treated as not running
+int ipc_connect(const char *path) {
+  struct sockaddr_un address;
+  if (ipc_address(path, &address) != 0) {
+    return -1;
+  }
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // the timeout covers connecting too, which otherwise waits for as long as a
+  // stalled server leaves its backlog full
+  if (ipc_timeout(fd) != 0 ||
+      connect(fd, (const struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// listen at path, replacing any socket left behind by a server that's gone
+zsql_error *ipc_listen(const char *path, int *fd) {
+  zsql_error *err = NULL;
+
+  struct sockaddr_un address;
+  if (ipc_address(path, &address) != 0) {
+    err = zsql_error_from_text("socket path too long", err);
+    goto exit;
+  }
+
+  const int running = ipc_connect(path);
+  if (running >= 0) {
+    close(running);
+    err = zsql_error_from_text("server already running", err);
+    goto exit;
+  }
+  if (unlink(path) != 0 && errno != ENOENT) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+
+  *fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (*fd < 0) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+
+  // only this user may connect
+  const mode_t mask = umask(0077);
+  const int status =
+      bind(*fd, (const struct sockaddr *)&address, sizeof(address));
+  umask(mask);
+  if (status != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+
+  if (listen(*fd, 16) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_path;
+  }
+
+  if (0) { // error path only
+  cleanup_path:
+    unlink(path);
+  cleanup_fd:
+    close(*fd);
+  }
+exit:
+  return err;
+}
+
+// accept a connection, leaving fd -1 if none came within timeout_ms or a
+// signal interrupted the wait
+zsql_error *ipc_accept(int listener, int timeout_ms, int *fd) {
+  *fd = -1;
+
+  struct pollfd listener_poll = {.fd = listener, .events = POLLIN};
+  const int ready = poll(&listener_poll, 1, timeout_ms);
+  if (ready < 0) {
+    if (errno == EINTR) {
+      return NULL;
+    }
+    return zsql_error_from_errno(NULL);
+  } else if (ready == 0) {
+    return NULL;
+  }
+
+  *fd = accept(listener, NULL, NULL);
+  if (*fd < 0) {
+    if (errno == EINTR || errno == ECONNABORTED) {
+      return NULL;
+    }
+    return zsql_error_from_errno(NULL);
+  }
+
+  if (ipc_timeout(*fd) != 0) {
+    zsql_error *err = zsql_error_from_errno(NULL);
+    close(*fd);
+    *fd = -1;
+    return err;
+  }
+  return NULL;
+}
+
+static zsql_error *ipc_write(int fd, const uint8_t *bytes, size_t length) {
+  while (length > 0) {
+    const ssize_t written = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return zsql_error_from_errno(NULL);
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+  return NULL;
+}
+
+// read length bytes, or as many as the peer sends before closing. a peer that
+// times out before sending anything is taken as having closed
+static zsql_error *ipc_read(int fd, uint8_t *bytes, size_t length,
+                            size_t *read_length) {
+  *read_length = 0;
+  while (*read_length < length) {
+    const ssize_t got =
+        recv(fd, bytes + *read_length, length - *read_length, 0);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                 *read_length == 0) {
+        break;
+      }
+      return zsql_error_from_errno(NULL);
+    } else if (got == 0) {
+      break;
+    }
+    *read_length += (size_t)got;
+  }
+  return NULL;
+}
+
+zsql_error *ipc_send(int fd, const void *msg, size_t length) {
+  zsql_error *err = NULL;
+
+  if (length > IPC_MESSAGE_MAX) {
+    err = zsql_error_from_text("message too long", err);
+    goto exit;
+  }
+
+  const uint32_t header = (uint32_t)length;
+  if ((err = ipc_write(fd, (const uint8_t *)&header, sizeof(header))) !=
+      NULL) {
+    goto exit;
+  }
+  if ((err = ipc_write(fd, msg, length)) != NULL) {
+    goto exit;
+  }
+
+exit:
+  return err;
+}
+
+// receive a message into msg, which is allocated one byte longer than length
+// so that it can always be read as a string. msg is left NULL if the peer
+// closed without sending anything, as when it was only checking for a server,
+// or sent nothing before timing out
+zsql_error *ipc_recv(int fd, uint8_t **msg, size_t *length) {
+  zsql_error *err = NULL;
+
+  *msg = NULL;
+  uint32_t header;
+  size_t read_length;
+  if ((err = ipc_read(fd, (uint8_t *)&header, sizeof(header),
+                      &read_length)) != NULL) {
+    goto exit;
+  }
+  if (read_length == 0) {
+    goto exit;
+  } else if (read_length < sizeof(header)) {
+    err = zsql_error_from_text("connection closed early", err);
+    goto exit;
+  }
+  if (header > IPC_MESSAGE_MAX) {
+    err = zsql_error_from_text("message too long", err);
+    goto exit;
+  }
+
+  *length = header;
+  *msg = malloc(*length + 1);
+  if (*msg == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  if ((err = ipc_read(fd, *msg, *length, &read_length)) != NULL) {
+    goto cleanup_msg;
+  }
+  if (read_length < *length) {
+    err = zsql_error_from_text("connection closed early", err);
+    goto cleanup_msg;
+  }
+  (*msg)[*length] = 0;
+
+  if (0) { // error path only
+  cleanup_msg:
+    free(*msg);
+    *msg = NULL;
+  }
+exit:
+  return err;
+}
@@ -0,0 +1,15 @@
+#ifndef ZSQL_IPC_H
+#define ZSQL_IPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+extern int ipc_connect(const char *path);
+extern zsql_error *ipc_listen(const char *path, int *fd);
+extern zsql_error *ipc_accept(int listener, int timeout_ms, int *fd);
+extern zsql_error *ipc_send(int fd, const void *msg, size_t length);
+extern zsql_error *ipc_recv(int fd, uint8_t **msg, size_t *length);
+
+#endif
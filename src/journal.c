@@ -0,0 +1,203 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+
+// visits waiting to be folded into the database, each a record of the time
+// as an int64_t, the dir's length as a uint32_t, then the dir, in host byte
+// order. a time of JOURNAL_FORGET forgets the dir instead, and is folded in
+// order with the visits around it. every record goes in with a single
+// O_APPEND write, so that appends never interleave.
+//
+// appenders hold a shared lock while writing, which never waits on other
+// appenders, only on whoever is folding the journal, who holds it exclusively
+// from reading it to clearing it. so no visit is ever appended between the
+// two and lost
+
+#define JOURNAL_HEADER_LENGTH (sizeof(int64_t) + sizeof(uint32_t))
+
+static int journal_flock(int fd, int operation) {
+  int status;
+  while ((status = flock(fd, operation)) != 0 && errno == EINTR) {
+  }
+  return status;
+}
+
+// append a visit to dir, or a forget of it, reporting how long the journal
+// has grown to
+zsql_error *journal_append(const char *path, const char *dir, size_t length,
+                           int64_t visited_at, size_t *journal_length) {
+  zsql_error *err = NULL;
+
+  if (length > UINT32_MAX) {
+    err = zsql_error_from_text("dir too long to journal", err);
+    goto exit;
+  }
+
+  const size_t record_length = JOURNAL_HEADER_LENGTH + length;
+  uint8_t *record = malloc(record_length);
+  if (record == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  const uint32_t length32 = (uint32_t)length;
+  memcpy(record, &visited_at, sizeof(visited_at));
+  memcpy(record + sizeof(visited_at), &length32, sizeof(length32));
+  memcpy(record + JOURNAL_HEADER_LENGTH, dir, length);
+
+  const int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_record;
+  }
+
+  if (journal_flock(fd, LOCK_SH) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+
+  ssize_t written;
+  while ((written = write(fd, record, record_length)) < 0 && errno == EINTR) {
+  }
+  if (written < 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  } else if ((size_t)written != record_length) {
+    err = zsql_error_from_text("short write to journal", err);
+    goto cleanup_fd;
+  }
+
+  struct stat journal_stat;
+  if (fstat(fd, &journal_stat) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+  *journal_length = (size_t)journal_stat.st_size;
+
+cleanup_fd:
+  // closing releases the lock
+  close(fd);
+cleanup_record:
+  free(record);
+exit:
+  return err;
+}
+
+// whether the journal has anything in it, checked without taking any lock
+int journal_pending(const char *path) {
+  struct stat journal_stat;
+  return stat(path, &journal_stat) == 0 && journal_stat.st_size > 0;
+}
+
+// lock the journal and read it in, leaving fd -1 if there's no journal
+zsql_error *journal_lock(const char *path, zsql_journal *journal) {
+  zsql_error *err = NULL;
+
+  journal->bytes = NULL;
+  journal->length = 0;
+  journal->offset = 0;
+  journal->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (journal->fd < 0) {
+    if (errno != ENOENT) {
+      err = zsql_error_from_errno(err);
+    }
+    goto exit;
+  }
+
+  if (journal_flock(journal->fd, LOCK_EX) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+
+  struct stat journal_stat;
+  if (fstat(journal->fd, &journal_stat) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+  if (journal_stat.st_size == 0) {
+    goto exit;
+  }
+
+  journal->length = (size_t)journal_stat.st_size;
+  journal->bytes = malloc(journal->length);
+  if (journal->bytes == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+
+  size_t offset = 0;
+  while (offset < journal->length) {
+    const ssize_t got =
+        pread(journal->fd, journal->bytes + offset, journal->length - offset,
+              (off_t)offset);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = zsql_error_from_errno(err);
+      goto cleanup_bytes;
+    } else if (got == 0) {
+      break;
+    }
+    offset += (size_t)got;
+  }
+  journal->length = offset;
+
+  if (0) { // error path only
+  cleanup_bytes:
+    free(journal->bytes);
+    journal->bytes = NULL;
+  cleanup_fd:
+    close(journal->fd);
+    journal->fd = -1;
+  }
+exit:
+  return err;
+}
+
+// the next record in the journal, returning 0 once there are none. a record
+// cut short, which only a failing disk could leave, ends the journal
+int journal_next(zsql_journal *journal, const char **dir, size_t *length,
+                 int64_t *visited_at) {
+  if (journal->length - journal->offset < JOURNAL_HEADER_LENGTH) {
+    return 0;
+  }
+
+  const uint8_t *record = journal->bytes + journal->offset;
+  uint32_t length32;
+  memcpy(visited_at, record, sizeof(*visited_at));
+  memcpy(&length32, record + sizeof(*visited_at), sizeof(length32));
+  if (journal->length - journal->offset - JOURNAL_HEADER_LENGTH < length32) {
+    return 0;
+  }
+
+  *dir = (const char *)record + JOURNAL_HEADER_LENGTH;
+  *length = length32;
+  journal->offset += JOURNAL_HEADER_LENGTH + length32;
+  return 1;
+}
+
+// empty the journal once everything read from it is safely elsewhere
+zsql_error *journal_clear(zsql_journal *journal) {
+  if (ftruncate(journal->fd, 0) != 0) {
+    return zsql_error_from_errno(NULL);
+  }
+  return NULL;
+}
+
+void journal_unlock(zsql_journal *journal) {
+  free(journal->bytes);
+  if (journal->fd >= 0) {
+    // closing releases the lock
+    close(journal->fd);
+  }
+}
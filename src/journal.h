@@ -0,0 +1,29 @@
+#ifndef ZSQL_JOURNAL_H
+#define ZSQL_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "error.h"
+
+// the time of a record that forgets its dir rather than visiting it
+#define JOURNAL_FORGET INT64_MIN
+
+typedef struct {
+  int fd;
+  uint8_t *bytes;
+  size_t length;
+  size_t offset;
+} zsql_journal;
+
+extern zsql_error *journal_append(const char *path, const char *dir,
+                                  size_t length, int64_t visited_at,
+                                  size_t *journal_length);
+extern int journal_pending(const char *path);
+extern zsql_error *journal_lock(const char *path, zsql_journal *journal);
+extern int journal_next(zsql_journal *journal, const char **dir,
+                        size_t *length, int64_t *visited_at);
+extern zsql_error *journal_clear(zsql_journal *journal);
+extern void journal_unlock(zsql_journal *journal);
+
+#endif
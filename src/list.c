@@ -0,0 +1,212 @@
+#include "list.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <utf8proc.h>
+
+#include "error.h"
+#include "fuzzy_search.h"
+#include "sqlh.h"
+#include "stats.h"
+#include "zsql.h"
+
+// the byte offset within dir of each rune of the query in its best match with
+// the dir with id, traced through the dir's profile in the query's index
+static zsql_error *zsql_match_offsets(const zsql_query *query, int64_t id,
+                                      const uint8_t *dir, size_t dir_length,
+                                      size_t *offsets) {
+  zsql_error *err = NULL;
+
+  if (query->length == 0) {
+    goto exit;
+  }
+
+  const zsql_index *index = query->index;
+  const size_t at = zsql_index_find(index, id);
+  if (at == index->length) {
+    err = zsql_error_from_text("match missing from index", err);
+    goto exit;
+  }
+
+  const int folded = (query->utf8proc_options & UTF8PROC_CASEFOLD) != 0;
+  const uint64_t *profile_offsets = index->profile_offsets + 2 * at + folded;
+  const uint8_t *profile = index->profiles + profile_offsets[0];
+  size_t width;
+  size_t length;
+  if (profile_parse(profile, (size_t)(profile_offsets[1] - profile_offsets[0]),
+                    &width, &length) != 0) {
+    err = zsql_error_from_text("malformed profile", err);
+    goto exit;
+  }
+
+  // copied out, as mapped profiles may not be aligned
+  int32_t *runes = malloc(length > 0 ? length * sizeof(*runes) : 1);
+  if (runes == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  if (width == PROFILE_WIDTH_ASCII) {
+    for (size_t idx = 0; idx < length; ++idx) {
+      runes[idx] = profile[idx];
+    }
+  } else if (length > 0) {
+    memcpy(runes, profile, length * sizeof(*runes));
+  }
+
+  if ((err = fuzzy_positions(offsets, runes, profile + length * width, length,
+                             query->runes, query->length)) != NULL) {
+    goto cleanup_runes;
+  }
+
+  // ascii profiles have a rune for each byte of dir. otherwise each rune comes
+  // from the codepoint of dir whose decomposition first reaches it, found by
+  // decomposing ever longer prefixes of dir
+  if (width == PROFILE_WIDTH_UTF32) {
+    utf8proc_option_t utf8proc_options = utf8proc_base_options;
+    if (folded) {
+      utf8proc_options |= UTF8PROC_CASEFOLD;
+    }
+
+    size_t match_idx = 0;
+    size_t dir_offset = 0;
+    while (match_idx < query->length && dir_offset < dir_length) {
+      int32_t codepoint;
+      const ssize_t step = utf8proc_iterate(
+          dir + dir_offset, (ssize_t)(dir_length - dir_offset), &codepoint);
+      if (step < 0) {
+        err = zsql_error_from_text(utf8proc_errmsg(step), err);
+        goto cleanup_runes;
+      }
+
+    retry_decompose:;
+      const ssize_t prefix_length = utf8proc_decompose(
+          dir, (ssize_t)(dir_offset + step), runes, (ssize_t)length,
+          utf8proc_options);
+      if (prefix_length < 0) {
+        err = zsql_error_from_text(utf8proc_errmsg(prefix_length), err);
+        goto cleanup_runes;
+      } else if ((size_t)prefix_length > length) {
+        length = prefix_length;
+        void *allocation = realloc(runes, length * sizeof(*runes));
+        if (allocation == NULL) {
+          err = zsql_error_from_errno(err);
+          goto cleanup_runes;
+        }
+        runes = allocation;
+        goto retry_decompose;
+      }
+
+      while (match_idx < query->length &&
+             offsets[match_idx] < (size_t)prefix_length) {
+        offsets[match_idx++] = dir_offset;
+      }
+      dir_offset += step;
+    }
+    if (match_idx < query->length) {
+      err = zsql_error_from_text("match outside of dir", err);
+      goto cleanup_runes;
+    }
+  }
+
+cleanup_runes:
+  free(runes);
+exit:
+  return err;
+}
+
+// print the row stmt is on as a record of its rank, its visits, the byte
+// offsets within its dir of the runes query matched, separated by commas, and
+// its dir. fields are separated by tabs, with the dir last as it may hold tabs
+// itself, and the record ends with terminator
+zsql_error *zsql_print_record(sqlite3_stmt *stmt, const zsql_query *query,
+                              char terminator) {
+  zsql_error *err = NULL;
+
+  const int64_t id = sqlite3_column_int64(stmt, 0);
+  const size_t dir_length = (size_t)sqlite3_column_bytes(stmt, 1);
+  const uint8_t *dir = sqlite3_column_blob(stmt, 1);
+  const double rank = sqlite3_column_double(stmt, 2);
+  const double visits = sqlite3_column_double(stmt, 3);
+
+  size_t *offsets =
+      malloc(query->length > 0 ? query->length * sizeof(*offsets) : 1);
+  if (offsets == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  if ((err = zsql_match_offsets(query, id, dir, dir_length, offsets)) !=
+      NULL) {
+    goto cleanup_offsets;
+  }
+
+  if (printf("%.4lf\t%.2lf\t", rank, visits) < 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_offsets;
+  }
+  for (size_t idx = 0; idx < query->length; ++idx) {
+    if (printf("%s%zu", idx > 0 ? "," : "", offsets[idx]) < 0) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_offsets;
+    }
+  }
+  if (putchar('\t') == EOF ||
+      fwrite(dir, 1, dir_length, stdout) != dir_length ||
+      putchar(terminator) == EOF) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_offsets;
+  }
+
+cleanup_offsets:
+  free(offsets);
+exit:
+  return err;
+}
+
+// print up to limit of the best matches for runes as records, best first,
+// scoring the dirs of index. like debugging, this always goes to the database
+zsql_error *zsql_list(sqlite3 *conn, const zsql_index *index,
+                      const int32_t *runes, size_t length,
+                      utf8proc_option_t utf8proc_options, int limit,
+                      char terminator) {
+  zsql_error *err = NULL;
+
+  zsql_query query = {.length = length,
+                      .runes = runes,
+                      .signature = fuzzy_signature(runes, length),
+                      .utf8proc_options = utf8proc_options,
+                      .index = index};
+  sqlite3_stmt *stmt;
+  if ((err = zsql_match(conn, &stmt, &query, limit)) != NULL) {
+    goto cleanup_query;
+  }
+
+  // match positions are only traced for the rows printed here
+  int status;
+  size_t printed = 0;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const uint64_t started = zsql_clock();
+    if ((err = zsql_print_record(stmt, &query, terminator)) != NULL) {
+      goto cleanup_stmt;
+    }
+    ++printed;
+    zsql_phase_end(ZSQL_PHASE_OUTPUT, started);
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  if (printed == 0) {
+    err = zsql_error_from_text("no matches", err);
+    goto cleanup_stmt;
+  }
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+cleanup_query:
+  free(query.scores);
+  return err;
+}
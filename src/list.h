@@ -0,0 +1,20 @@
+#ifndef ZSQL_LIST_H
+#define ZSQL_LIST_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utf8proc.h>
+
+#include "error.h"
+#include "zsql.h"
+
+extern zsql_error *zsql_print_record(sqlite3_stmt *stmt,
+                                     const zsql_query *query,
+                                     char terminator);
+extern zsql_error *zsql_list(sqlite3 *conn, const zsql_index *index,
+                             const int32_t *runes, size_t length,
+                             utf8proc_option_t utf8proc_options, int limit,
+                             char terminator);
+
+#endif
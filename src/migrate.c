@@ -10,6 +10,19 @@
   "CREATE INDEX index_by_visits_and_dir ON dirs(visits, dir)"
 #define index_by_visited_at                                                    \
   "CREATE INDEX index_by_visited_at ON dirs(visited_at)"
+#define index_by_signature                                                     \
+  "CREATE INDEX index_by_signature "                                           \
+  "ON dirs(signature, visited_at, visits, dir)"
+// visited_seq orders dirs by visited_at, staying the same across visits in the
+// same second, so ranking by it is ranking by visited_at. zsql_add takes the
+// next one from the most recent dir
+#define index_by_visited_seq                                                   \
+  "CREATE INDEX index_by_visited_seq ON dirs(visited_seq)"
+#define index_by_basename                                                      \
+  "CREATE INDEX index_by_basename ON components(basename)"
+// forgetting dirs decayed under one visit is the only query filtering on
+// visits, and needs nothing else from the index
+#define index_by_visits "CREATE INDEX index_by_visits ON dirs(visits)"
 #define trigger_on_insert_forget                                               \
   "CREATE TRIGGER trigger_on_insert_forget "                                   \
   "INSERT ON dirs "                                                            \
@@ -27,6 +40,89 @@
   "DELETE FROM dirs WHERE visits=0;"                                           \
   "END"
 
+// stored visits are scaled up by 1/aging.scale as of each visit, so aging
+// every dir at once only takes shrinking the scale, which zsql_add does once
+// aging.total reaches the limit. aging.total is the sum of stored visits, kept
+// current by triggers rather than summed on each visit. dirs that have
+// decayed under one visit are found through an index on visits
+#define trigger_on_insert_total                                                \
+  "CREATE TRIGGER trigger_on_insert_total "                                    \
+  "AFTER INSERT ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total+NEW.visits;"                                   \
+  "END"
+#define trigger_on_update_total                                                \
+  "CREATE TRIGGER trigger_on_update_total "                                    \
+  "AFTER UPDATE OF visits ON dirs "                                            \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total-OLD.visits+NEW.visits;"                        \
+  "END"
+#define trigger_on_delete_total                                                \
+  "CREATE TRIGGER trigger_on_delete_total "                                    \
+  "AFTER DELETE ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total-OLD.visits;"                                   \
+  "END"
+#define trigger_on_update_forget_scaled                                        \
+  "CREATE TRIGGER trigger_on_update_forget_scaled "                            \
+  "AFTER UPDATE OF scale ON aging "                                            \
+  "BEGIN "                                                                     \
+  "DELETE FROM dirs WHERE visits<1/(SELECT scale FROM aging);"                 \
+  "END"
+// aging.generation counts writes to dirs, so that a snapshot of them can tell
+// whether it's still current. these replace the triggers keeping aging.total,
+// and count updates to any column rather than only to visits
+#define trigger_on_insert_generation                                           \
+  "CREATE TRIGGER trigger_on_insert_generation "                               \
+  "AFTER INSERT ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total+NEW.visits,generation=generation+1;"           \
+  "END"
+#define trigger_on_update_generation                                           \
+  "CREATE TRIGGER trigger_on_update_generation "                               \
+  "AFTER UPDATE ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total-OLD.visits+NEW.visits,"                        \
+  "generation=generation+1;"                                                   \
+  "END"
+#define trigger_on_delete_generation                                           \
+  "CREATE TRIGGER trigger_on_delete_generation "                               \
+  "AFTER DELETE ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "UPDATE aging SET total=total-OLD.visits,generation=generation+1;"           \
+  "END"
+// dirs hold onto their last component, and components onto their parent, so
+// a component is pruned once neither a dir nor another component needs it.
+// pruning a component goes on to its parent, as connections enable
+// recursive_triggers
+#define trigger_on_delete_prune                                                \
+  "CREATE TRIGGER trigger_on_delete_prune "                                    \
+  "AFTER DELETE ON dirs "                                                      \
+  "BEGIN "                                                                     \
+  "DELETE FROM components WHERE id=OLD.component_id AND NOT EXISTS("           \
+  "SELECT 1 FROM components WHERE parent_id=OLD.component_id);"                \
+  "END"
+#define trigger_on_delete_prune_parent                                         \
+  "CREATE TRIGGER trigger_on_delete_prune_parent "                             \
+  "AFTER DELETE ON components "                                                \
+  "BEGIN "                                                                     \
+  "DELETE FROM components WHERE id=OLD.parent_id AND NOT EXISTS("              \
+  "SELECT 1 FROM components WHERE parent_id=OLD.parent_id)AND NOT EXISTS("     \
+  "SELECT 1 FROM dirs WHERE component_id=OLD.parent_id);"                      \
+  "END"
+// once the scale gets this small, fold it back into the stored visits. this
+// is the only write touching every row, and comes around every couple
+// thousand decays. the total is summed afresh, as adjusting it row by row
+// from values this large would leave nothing but rounding error
+#define trigger_on_update_rescale                                              \
+  "CREATE TRIGGER trigger_on_update_rescale "                                  \
+  "AFTER UPDATE OF scale ON aging "                                            \
+  "WHEN NEW.scale<1e-100 "                                                     \
+  "BEGIN "                                                                     \
+  "UPDATE dirs SET visits=visits*NEW.scale;"                                   \
+  "UPDATE aging SET total=(SELECT TOTAL(visits)FROM dirs),scale=1;"            \
+  "END"
+
 // each array is considered a database version
 // new arrays are automatically run if the database version is
 // below what the program specifies
@@ -62,9 +158,237 @@ static const char *const *const migrations[] = {
         "INSERT INTO dirs SELECT oid id,* FROM old_dirs", "DROP TABLE old_dirs",
 
         index_by_visits_and_dir, index_by_visited_at, trigger_on_insert_forget,
-        trigger_on_update_forget, NULL}};
+        trigger_on_update_forget, NULL},
+    (const char *const[]){
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "visits INT NOT NULL DEFAULT 1,"
+        "visited_at DATETIME NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB NOT NULL)",
+
+        "INSERT INTO dirs SELECT *,profile(dir,0),profile(dir,1) FROM old_dirs",
+        "DROP TABLE old_dirs",
+
+        index_by_visits_and_dir, index_by_visited_at, trigger_on_insert_forget,
+        trigger_on_update_forget, NULL},
+    (const char *const[]){
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "visits INT NOT NULL DEFAULT 1,"
+        "visited_at DATETIME NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB NOT NULL,"
+        "signature INT NOT NULL)",
+
+        "INSERT INTO dirs SELECT"
+        " *,signature(profile)|signature(folded_profile) FROM old_dirs",
+        "DROP TABLE old_dirs",
+
+        index_by_visits_and_dir, index_by_visited_at, trigger_on_insert_forget,
+        trigger_on_update_forget, NULL},
+    (const char *const[]){index_by_signature, NULL},
+    (const char *const[]){
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "visits INT NOT NULL DEFAULT 1,"
+        "visited_at DATETIME NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB NOT NULL,"
+        "signature INT NOT NULL)",
+
+        "INSERT INTO dirs SELECT"
+        " id,dir,visits,visited_at,profile(dir,0),profile(dir,1),signature"
+        " FROM old_dirs",
+        "DROP TABLE old_dirs",
+
+        index_by_visits_and_dir, index_by_visited_at, index_by_signature,
+        trigger_on_insert_forget, trigger_on_update_forget, NULL},
+    (const char *const[]){
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "visits REAL NOT NULL DEFAULT 1,"
+        "visited_at DATETIME NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB NOT NULL,"
+        "signature INT NOT NULL)",
+
+        "INSERT INTO dirs SELECT * FROM old_dirs", "DROP TABLE old_dirs",
+
+        "CREATE TABLE aging(total REAL NOT NULL,scale REAL NOT NULL)",
+        "INSERT INTO aging SELECT TOTAL(visits),1 FROM dirs",
+
+        index_by_visits_and_dir, index_by_visited_at, index_by_signature,
+        trigger_on_insert_total, trigger_on_update_total,
+        trigger_on_delete_total, trigger_on_update_forget_scaled,
+        trigger_on_update_rescale, NULL},
+    (const char *const[]){
+        // triggers on aging would follow dirs through the rename, so they're
+        // recreated along with the ones on dirs
+        "DROP TRIGGER trigger_on_update_forget_scaled",
+        "DROP TRIGGER trigger_on_update_rescale",
+
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "visits REAL NOT NULL DEFAULT 1,"
+        "visited_at DATETIME NOT NULL,"
+        "visited_seq INT NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB NOT NULL,"
+        "signature INT NOT NULL)",
+
+        "INSERT INTO dirs SELECT"
+        " id,dir,visits,visited_at,DENSE_RANK()OVER(ORDER BY visited_at),"
+        "profile,folded_profile,signature FROM old_dirs",
+        "DROP TABLE old_dirs",
+
+        index_by_visits_and_dir, index_by_visited_seq, index_by_signature,
+        trigger_on_insert_total, trigger_on_update_total,
+        trigger_on_delete_total, trigger_on_update_forget_scaled,
+        trigger_on_update_rescale, NULL},
+    // the journal mode can't change within a transaction, so this only marks
+    // the switch to write-ahead logging, which zsql_migrate makes beforehand
+    (const char *const[]){NULL},
+    (const char *const[]){
+        "ALTER TABLE aging ADD COLUMN generation INT NOT NULL DEFAULT 0",
+
+        "DROP TRIGGER trigger_on_insert_total",
+        "DROP TRIGGER trigger_on_update_total",
+        "DROP TRIGGER trigger_on_delete_total",
+
+        trigger_on_insert_generation, trigger_on_update_generation,
+        trigger_on_delete_generation, NULL},
+    (const char *const[]){
+        "DROP TRIGGER trigger_on_update_forget_scaled",
+        "DROP TRIGGER trigger_on_update_rescale",
+
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        // the columns a scan filters on come before the blobs, so that sqlite
+        // reaches them without walking past the dir and its profiles.
+        // visited_at is seconds since the epoch, and folded_profile is null
+        // when folding leaves the profile as it is, as it does for most dirs
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "visits REAL NOT NULL DEFAULT 1,"
+        "visited_seq INT NOT NULL,"
+        "signature INT NOT NULL,"
+        "visited_at INT NOT NULL,"
+        "dir BLOB NOT NULL UNIQUE,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB)",
+
+        "INSERT INTO dirs SELECT"
+        " id,visits,visited_seq,signature,"
+        "CAST(strftime('%s',visited_at)AS INT),dir,profile,"
+        "NULLIF(folded_profile,profile) FROM old_dirs",
+        "DROP TABLE old_dirs",
+
+        // index_by_signature and the dir in index_by_visits_and_dir were never
+        // read by any query, and each held another copy of every dir
+        index_by_visits, index_by_visited_seq, trigger_on_insert_generation,
+        trigger_on_update_generation, trigger_on_delete_generation,
+        trigger_on_update_forget_scaled, trigger_on_update_rescale, NULL},
+    (const char *const[]){
+        "DROP TRIGGER trigger_on_update_forget_scaled",
+        "DROP TRIGGER trigger_on_update_rescale",
+
+        "ALTER TABLE dirs RENAME TO old_dirs",
+
+        // a component is what comes before a dir's first slash, or a slash
+        // and the name after it, added onto its parent, 0 being none. its
+        // profile is as it is within any dir, following its parent, and
+        // dirs' profiles and signatures are put together from their
+        // components'
+        "CREATE TABLE components("
+        "id INTEGER PRIMARY KEY,"
+        "parent_id INT NOT NULL,"
+        "signature INT NOT NULL,"
+        "name BLOB NOT NULL,"
+        "profile BLOB NOT NULL,"
+        "folded_profile BLOB,"
+        "UNIQUE(parent_id,name))",
+
+        "CREATE TABLE dirs("
+        "id INTEGER PRIMARY KEY,"
+        "visits REAL NOT NULL DEFAULT 1,"
+        "visited_seq INT NOT NULL,"
+        "visited_at INT NOT NULL,"
+        "component_id INT NOT NULL UNIQUE)",
+
+        // every dir is cut where each of its components ends, numbering the
+        // distinct prefixes shortest first, which puts parents ahead of their
+        // children. components keep the numbers as ids. substr gives null
+        // rather than an empty blob for an empty dir
+        "CREATE TEMP TABLE prefixes("
+        "id INTEGER PRIMARY KEY,"
+        "prefix BLOB NOT NULL UNIQUE,"
+        "parent BLOB,"
+        "name BLOB NOT NULL)",
+
+        "INSERT INTO temp.prefixes(prefix,parent,name)"
+        "WITH RECURSIVE cuts(dir,first,begin,end)AS("
+        "SELECT dir,1,1,IFNULL(NULLIF(instr(dir,x'2f'),0),length(dir)+1)"
+        "FROM old_dirs UNION ALL "
+        "SELECT dir,0,end,IFNULL(NULLIF(instr(substr(dir,end+1),x'2f'),0)+end,"
+        "length(dir)+1)FROM cuts WHERE end<=length(dir))"
+        "SELECT IFNULL(substr(dir,1,end-1),x''),"
+        "CASE WHEN NOT first THEN IFNULL(substr(dir,1,begin-1),x'')END,"
+        "IFNULL(substr(dir,begin,end-begin),x'')"
+        "FROM cuts GROUP BY 1 ORDER BY end",
+
+        "INSERT INTO components SELECT"
+        " id,parent_id,signature(profile)|signature(IFNULL(folded_profile,"
+        "profile)),name,profile,folded_profile FROM("
+        "SELECT prefix.id,IFNULL(parent.id,0)parent_id,prefix.name,"
+        "profile(prefix.name,0,IFNULL(parent.name,x''))profile,"
+        "NULLIF(profile(prefix.name,1,IFNULL(parent.name,x'')),"
+        "profile(prefix.name,0,IFNULL(parent.name,x'')))folded_profile "
+        "FROM temp.prefixes prefix "
+        "LEFT JOIN temp.prefixes parent ON parent.prefix=prefix.parent)",
+
+        "INSERT INTO dirs SELECT"
+        " old_dirs.id,visits,visited_seq,visited_at,prefix.id "
+        "FROM old_dirs JOIN temp.prefixes prefix ON prefix.prefix=old_dirs.dir",
+
+        "DROP TABLE temp.prefixes",
+        "DROP TABLE old_dirs",
+
+        index_by_visits, index_by_visited_seq, trigger_on_insert_generation,
+        trigger_on_update_generation, trigger_on_delete_generation,
+        trigger_on_delete_prune, trigger_on_delete_prune_parent,
+        trigger_on_update_forget_scaled, trigger_on_update_rescale, NULL},
+    (const char *const[]){
+        // a component's basename is the runes of its folded profile after its
+        // slash, as utf-8, so that dirs ending in a needle are found as a
+        // range of the index on it
+        "ALTER TABLE components ADD COLUMN basename BLOB",
+        "UPDATE components SET basename=basename(IFNULL(folded_profile,"
+        "profile))",
+        index_by_basename, NULL}};
 static const int SCHEMA_VERSION = sizeof(migrations) / sizeof(*migrations);
 
+// databases below this version are still using a rollback journal
+static const int WAL_SCHEMA_VERSION = 10;
+
+// databases below this version hold dirs in an older, larger layout
+static const int COMPACT_SCHEMA_VERSION = 13;
+
 static zsql_error *current_schema_version(sqlite3 *conn, int *schema_version) {
   zsql_error *err = NULL;
 
@@ -112,6 +436,15 @@ zsql_error *zsql_migrate(sqlite3 *conn) {
     goto exit;
   }
 
+  // readers never wait on a writer with write-ahead logging, so searches don't
+  // stall behind adds. the mode sticks to the database once set
+  if (schema_version < WAL_SCHEMA_VERSION) {
+    if ((err = sqlh_exec_static(conn, "PRAGMA journal_mode=WAL")) != NULL) {
+      goto exit;
+    }
+  }
+
+  int migrated_from = SCHEMA_VERSION;
   if (schema_version < SCHEMA_VERSION) {
     if ((err = sqlh_exec_static(conn, "BEGIN EXCLUSIVE")) != NULL) {
       goto exit;
@@ -125,6 +458,7 @@ zsql_error *zsql_migrate(sqlite3 *conn) {
     }
 
     if (schema_version < SCHEMA_VERSION) {
+      migrated_from = schema_version;
       while (schema_version < SCHEMA_VERSION) {
         for (const char *const *sql = migrations[schema_version]; *sql != NULL;
              ++sql) {
@@ -146,6 +480,17 @@ zsql_error *zsql_migrate(sqlite3 *conn) {
     }
   }
 
+  // rebuilding dirs leaves the pages of the old layout free but still in the
+  // file. they're handed back once, outside the transaction, which a vacuum
+  // can't run within. a new database has none to hand back. the migration is
+  // committed by now, so a vacuum that fails only leaves the file larger
+  if (migrated_from > 0 && migrated_from < COMPACT_SCHEMA_VERSION) {
+    zsql_error *vacuum_err = sqlh_exec_static(conn, "VACUUM");
+    if (vacuum_err != NULL) {
+      zsql_error_free(vacuum_err);
+    }
+  }
+
   if (0) { // error path only
   rollback:
     // the error might have caused a rollback, so check if sqlite has autocommit
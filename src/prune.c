@@ -0,0 +1,320 @@
+#include "prune.h"
+
+#include <errno.h>
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "env.h"
+#include "error.h"
+#include "sqlh.h"
+#include "stats.h"
+#include "zsql.h"
+
+// prunes check dirs on this many threads, unless ZSQL_THREADS says otherwise.
+// they mostly wait on the filesystem rather than a core, so that dirs on slow
+// mounts are waited on together rather than one after another
+#define ZSQL_PRUNE_THREADS 32
+
+// every dir as of a prune, laid end to end, and whether each was found gone.
+// threads checking them each take the next one in turn
+typedef struct {
+  int64_t *ids;
+  int64_t *component_ids;
+  // where each dir begins, and one past the last
+  size_t *offsets;
+  uint8_t *gone;
+  size_t length;
+  size_t capacity;
+  char *dirs;
+  size_t dirs_capacity;
+  size_t next;
+#if HAVE_PTHREAD
+  pthread_mutex_t mutex;
+#endif
+} zsql_prune_list;
+
+static void zsql_prune_list_free(zsql_prune_list *list) {
+  free(list->dirs);
+  free(list->gone);
+  free(list->offsets);
+  free(list->component_ids);
+  free(list->ids);
+}
+
+static zsql_error *zsql_prune_list_push(zsql_prune_list *list, int64_t id,
+                                        int64_t component_id, const char *dir,
+                                        size_t length) {
+  if (list->length >= list->capacity) {
+    const size_t capacity = list->capacity == 0 ? 1024 : list->capacity * 2;
+    void *allocation;
+
+    if ((allocation = realloc(list->ids, capacity * sizeof(*list->ids))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    list->ids = allocation;
+    if ((allocation = realloc(list->component_ids,
+                              capacity * sizeof(*list->component_ids))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    list->component_ids = allocation;
+    if ((allocation = realloc(list->offsets,
+                              (capacity + 1) * sizeof(*list->offsets))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    list->offsets = allocation;
+    if ((allocation = realloc(list->gone, capacity * sizeof(*list->gone))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    list->gone = allocation;
+
+    if (list->capacity == 0) {
+      list->offsets[0] = 0;
+    }
+    list->capacity = capacity;
+  }
+
+  const size_t offset = list->offsets[list->length];
+  if (offset + length > list->dirs_capacity) {
+    size_t capacity =
+        list->dirs_capacity == 0 ? 64 * 1024 : list->dirs_capacity * 2;
+    while (offset + length > capacity) {
+      capacity *= 2;
+    }
+    void *allocation = realloc(list->dirs, capacity);
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    list->dirs = allocation;
+    list->dirs_capacity = capacity;
+  }
+
+  list->ids[list->length] = id;
+  list->component_ids[list->length] = component_id;
+  if (length > 0) {
+    memcpy(list->dirs + offset, dir, length);
+  }
+  list->gone[list->length] = 0;
+  list->offsets[++list->length] = offset + length;
+  return NULL;
+}
+
+// read every dir, putting each together from its components in one pass over
+// the tree rather than one walk up it for each
+static zsql_error *zsql_prune_list_read(sqlite3 *conn, zsql_prune_list *list) {
+  zsql_error *err = NULL;
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "WITH RECURSIVE paths(id,path)AS("
+           "SELECT id,name FROM components WHERE parent_id=0 UNION ALL "
+           "SELECT components.id,path||name FROM components "
+           "JOIN paths ON parent_id=paths.id)"
+           "SELECT dirs.id,component_id,path FROM dirs "
+           "JOIN paths ON paths.id=component_id ORDER BY dirs.id",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if ((err = zsql_prune_list_push(
+             list, sqlite3_column_int64(stmt, 0), sqlite3_column_int64(stmt, 1),
+             sqlite3_column_blob(stmt, 2),
+             (size_t)sqlite3_column_bytes(stmt, 2))) != NULL) {
+      goto cleanup_stmt;
+    }
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// check dirs until there are none left to take
+static void zsql_prune_list_check(zsql_prune_list *list) {
+  for (;;) {
+#if HAVE_PTHREAD
+    pthread_mutex_lock(&list->mutex);
+#endif
+    const size_t idx = list->next < list->length ? list->next++ : list->length;
+#if HAVE_PTHREAD
+    pthread_mutex_unlock(&list->mutex);
+#endif
+    if (idx >= list->length) {
+      break;
+    }
+    list->gone[idx] = (uint8_t)zsql_dir_gone(
+        list->dirs + list->offsets[idx],
+        list->offsets[idx + 1] - list->offsets[idx]);
+  }
+}
+
+#if HAVE_PTHREAD
+static void *zsql_prune_list_run(void *data) {
+  zsql_prune_list_check(data);
+  return NULL;
+}
+#endif
+
+// check every dir, on as many threads as can be started
+static zsql_error *zsql_prune_list_check_all(zsql_prune_list *list) {
+  zsql_error *err = NULL;
+
+  const uint64_t started = zsql_clock();
+#if HAVE_PTHREAD
+  size_t threads = THREADS > 0 ? (size_t)THREADS : ZSQL_PRUNE_THREADS;
+  if (threads > list->length) {
+    threads = list->length;
+  }
+  pthread_t *workers = malloc(threads > 0 ? threads * sizeof(*workers) : 1);
+  if (workers == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  const int status = pthread_mutex_init(&list->mutex, NULL);
+  if (status != 0) {
+    errno = status;
+    err = zsql_error_from_errno(err);
+    goto cleanup_workers;
+  }
+
+  // whatever threads can't be started leave more for the rest
+  size_t workers_length = 0;
+  while (workers_length + 1 < threads &&
+         pthread_create(&workers[workers_length], NULL, zsql_prune_list_run,
+                        list) == 0) {
+    ++workers_length;
+  }
+  zsql_prune_list_check(list);
+  for (size_t idx = 0; idx < workers_length; ++idx) {
+    pthread_join(workers[idx], NULL);
+  }
+  zsql_stats.threads += workers_length;
+
+  pthread_mutex_destroy(&list->mutex);
+cleanup_workers:
+  free(workers);
+exit:
+#else
+  zsql_prune_list_check(list);
+#endif
+  zsql_phase_end(ZSQL_PHASE_CHECK, started);
+  return err;
+}
+
+// forget every dir that no longer exists, all in one transaction, printing
+// each one forgotten. dirs are read and checked without holding any lock, and
+// each is only forgotten if it's still made of the components it was read as
+zsql_error *zsql_prune(sqlite3 *conn, char terminator) {
+  zsql_error *err = NULL;
+
+  zsql_prune_list list = {0};
+  if ((err = zsql_prune_list_read(conn, &list)) != NULL) {
+    goto cleanup_list;
+  }
+  if ((err = zsql_prune_list_check_all(&list)) != NULL) {
+    goto cleanup_list;
+  }
+
+  size_t gone = 0;
+  for (size_t idx = 0; idx < list.length; ++idx) {
+    gone += list.gone[idx];
+  }
+  zsql_stats.gone += gone;
+  if (gone == 0) {
+    goto cleanup_list;
+  }
+
+  // dirs found gone are forgotten with a single delete, which goes through
+  // the tables in order rather than seeking out each one. it touches pages all
+  // over them, so the cache is grown to keep from spilling them to the log
+  // and reading them back
+  if ((err = sqlh_exec_static(conn, "PRAGMA cache_size=-65536")) != NULL) {
+    goto cleanup_list;
+  }
+  if ((err = sqlh_exec_static(conn, "BEGIN IMMEDIATE")) != NULL) {
+    goto cleanup_list;
+  }
+  if ((err = sqlh_exec_static(conn, "CREATE TEMP TABLE gone("
+                                    "id INTEGER PRIMARY KEY,"
+                                    "component_id INT NOT NULL)")) != NULL) {
+    goto rollback;
+  }
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn, "INSERT INTO temp.gone(id,component_id)VALUES(?1,?2)",
+           &stmt)) != NULL) {
+    goto rollback;
+  }
+  for (size_t idx = 0; idx < list.length; ++idx) {
+    if (!list.gone[idx]) {
+      continue;
+    }
+    if (sqlite3_bind_int64(stmt, 1, list.ids[idx]) != SQLITE_OK ||
+        sqlite3_bind_int64(stmt, 2, list.component_ids[idx]) != SQLITE_OK ||
+        sqlite3_step(stmt) != SQLITE_DONE ||
+        sqlite3_reset(stmt) != SQLITE_OK) {
+      err = zsql_error_from_sqlite(conn, err);
+      break;
+    }
+  }
+  if ((err = sqlh_finalize(stmt, err)) != NULL) {
+    goto rollback;
+  }
+
+  if ((err = sqlh_exec_static(
+           conn, "DELETE FROM dirs WHERE(id,component_id)IN("
+                 "SELECT id,component_id FROM temp.gone)")) != NULL) {
+    goto rollback;
+  }
+  if ((err = sqlh_exec_static(conn, "DROP TABLE temp.gone")) != NULL) {
+    goto rollback;
+  }
+  if ((err = sqlh_exec_static(conn, "COMMIT")) != NULL) {
+    goto rollback;
+  }
+
+  const uint64_t started = zsql_clock();
+  for (size_t idx = 0; idx < list.length; ++idx) {
+    const size_t length = list.offsets[idx + 1] - list.offsets[idx];
+    if (list.gone[idx] &&
+        (fwrite(list.dirs + list.offsets[idx], 1, length, stdout) != length ||
+         putchar(terminator) == EOF)) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_list;
+    }
+  }
+  zsql_phase_end(ZSQL_PHASE_OUTPUT, started);
+
+  if (0) { // error path only
+  rollback:
+    // as in zsql_migrate, the error may have already rolled back
+    if (!sqlite3_get_autocommit(conn)) {
+      if (sqlh_exec_static(conn, "ROLLBACK") != NULL) {
+        // fixme: nothing sensible to do about a failed rollback
+      }
+    }
+  }
+cleanup_list:
+  zsql_prune_list_free(&list);
+  return err;
+}
@@ -0,0 +1,10 @@
+#ifndef ZSQL_PRUNE_H
+#define ZSQL_PRUNE_H
+
+#include <sqlite3.h>
+
+#include "error.h"
+
+extern zsql_error *zsql_prune(sqlite3 *conn, char terminator);
+
+#endif
@@ -0,0 +1,280 @@
+#include "server.h"
+
+#include <signal.h>
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <utf8proc.h>
+
+#include "env.h"
+#include "error.h"
+#include "ipc.h"
+#include "stats.h"
+#include "zsql.h"
+
+static volatile sig_atomic_t zsql_serving = 1;
+
+static void zsql_stop_serving(int signum) {
+  (void)signum;
+  zsql_serving = 0;
+}
+
+// carry out a request, replying with its result. errors from carrying it out
+// are returned, for the caller to reply with instead
+static zsql_error *zsql_serve_request(sqlite3 *conn, zsql_index *index,
+                                      const uint8_t *request,
+                                      size_t request_length, uint8_t **reply,
+                                      size_t *reply_length) {
+  zsql_error *err = NULL;
+
+  *reply = NULL;
+  *reply_length = 1;
+  if (request_length == 0) {
+    err = zsql_error_from_text("empty request", err);
+    goto exit;
+  }
+
+  // clients that found no server left their visits in the journal. they're
+  // folded in ahead of anything newer, and being the server's own writes, the
+  // index has to be told
+  int folded;
+  if ((err = zsql_fold_journal(conn, NULL, &folded)) != NULL) {
+    goto exit;
+  }
+  if (folded) {
+    index->stale = 1;
+  }
+
+  switch (request[0]) {
+  case ZSQL_REQUEST_ADD: {
+    const char *dir = (const char *)request + 1;
+    const size_t length = request_length - 1;
+    if ((err = zsql_add(conn, dir, length)) != NULL) {
+      goto exit;
+    }
+    if ((err = zsql_index_visit(conn, index, dir, length)) != NULL) {
+      // the visit went through, and the index just needs a reload
+      zsql_error_free(err);
+      err = NULL;
+      index->stale = 1;
+    }
+    break;
+  }
+  case ZSQL_REQUEST_SEARCH: {
+    int32_t options;
+    if (request_length < 1 + sizeof(options) ||
+        (request_length - 1 - sizeof(options)) % sizeof(int32_t) != 0) {
+      err = zsql_error_from_text("malformed search request", err);
+      goto exit;
+    }
+    memcpy(&options, request + 1, sizeof(options));
+
+    // copied out for alignment
+    const size_t length =
+        (request_length - 1 - sizeof(options)) / sizeof(int32_t);
+    int32_t *runes = malloc(length > 0 ? length * sizeof(*runes) : 1);
+    if (runes == NULL) {
+      err = zsql_error_from_errno(err);
+      goto exit;
+    }
+    if (length > 0) {
+      memcpy(runes, request + 1 + sizeof(options), length * sizeof(*runes));
+    }
+
+    int64_t id;
+    char *dir;
+    size_t dir_length;
+    if ((err = zsql_index_refresh(conn, index)) == NULL) {
+      err = zsql_find(conn, index, runes, length, (utf8proc_option_t)options,
+                      &id, &dir, &dir_length);
+    }
+    free(runes);
+    if (err != NULL) {
+      goto exit;
+    }
+
+    *reply_length = 1 + sizeof(id) + dir_length;
+    *reply = malloc(*reply_length);
+    if (*reply == NULL) {
+      err = zsql_error_from_errno(err);
+      free(dir);
+      goto exit;
+    }
+    memcpy(*reply + 1, &id, sizeof(id));
+    memcpy(*reply + 1 + sizeof(id), dir, dir_length);
+    free(dir);
+    break;
+  }
+  case ZSQL_REQUEST_DELETE: {
+    int64_t id;
+    if (request_length < 1 + sizeof(id)) {
+      err = zsql_error_from_text("malformed delete request", err);
+      goto exit;
+    }
+    memcpy(&id, request + 1, sizeof(id));
+    if ((err = zsql_delete(conn, id, (const char *)request + 1 + sizeof(id),
+                           request_length - 1 - sizeof(id))) != NULL) {
+      goto exit;
+    }
+    index->stale = 1;
+    break;
+  }
+  default:
+    err = zsql_error_from_text("unknown request", err);
+    goto exit;
+  }
+
+  if (*reply == NULL) {
+    *reply = malloc(*reply_length);
+    if (*reply == NULL) {
+      err = zsql_error_from_errno(err);
+      goto exit;
+    }
+  }
+  (*reply)[0] = ZSQL_REPLY_OK;
+
+exit:
+  return err;
+}
+
+// answer a client, which only ever sends the one request
+static zsql_error *zsql_serve_client(sqlite3 *conn, zsql_index *index,
+                                     int fd) {
+  zsql_error *err = NULL;
+
+  uint8_t *request;
+  size_t request_length;
+  if ((err = ipc_recv(fd, &request, &request_length)) != NULL) {
+    goto exit;
+  }
+  if (request == NULL) {
+    goto exit;
+  }
+
+  uint8_t *reply;
+  size_t reply_length;
+  zsql_error *request_err = zsql_serve_request(conn, index, request,
+                                               request_length, &reply,
+                                               &reply_length);
+  if (request_err != NULL) {
+    const size_t msg_length = strlen(request_err->msg);
+    reply_length = 1 + msg_length;
+    reply = malloc(reply_length);
+    if (reply == NULL) {
+      err = zsql_error_from_errno(request_err);
+      goto cleanup_request;
+    }
+    reply[0] = ZSQL_REPLY_ERROR;
+    memcpy(reply + 1, request_err->msg, msg_length);
+    zsql_error_free(request_err);
+  }
+
+  if ((err = ipc_send(fd, reply, reply_length)) != NULL) {
+    goto cleanup_reply;
+  }
+
+cleanup_reply:
+  free(reply);
+cleanup_request:
+  free(request);
+exit:
+  return err;
+}
+
+// how long without a client before the server checkpoints
+#define ZSQL_QUIET_MS 5000
+
+// keep the database open, and every dir's profile in memory, answering
+// clients until interrupted
+zsql_error *zsql_serve(void) {
+  zsql_error *err = NULL;
+
+  zsql_index index = {.stale = 1};
+  sqlite3 *conn;
+  if ((err = zsql_connect(&conn)) != NULL) {
+    goto exit;
+  }
+
+  int folded;
+  if ((err = zsql_fold_journal(conn, NULL, &folded)) != NULL) {
+    goto cleanup_sql;
+  }
+
+  if ((err = zsql_index_refresh(conn, &index)) != NULL) {
+    goto cleanup_sql;
+  }
+
+  char *path;
+  if ((err = zsql_data_path(socket_file, 1, &path)) != NULL) {
+    goto cleanup_sql;
+  }
+
+  int listener;
+  if ((err = ipc_listen(path, &listener)) != NULL) {
+    goto cleanup_path;
+  }
+
+  // no SA_RESTART, so that a signal breaks out of waiting for a client
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = zsql_stop_serving;
+  if (sigaction(SIGINT, &action, NULL) != 0 ||
+      sigaction(SIGTERM, &action, NULL) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_listener;
+  }
+  action.sa_handler = SIG_IGN;
+  if (sigaction(SIGPIPE, &action, NULL) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_listener;
+  }
+
+  int quiet = 1;
+  while (zsql_serving) {
+    int fd;
+    if ((err = ipc_accept(listener, ZSQL_QUIET_MS, &fd)) != NULL) {
+      goto cleanup_listener;
+    }
+
+    // the server's connection never closes, which is when sqlite would
+    // otherwise reset the log. so once clients go quiet, everything in it is
+    // copied back and it's truncated, waiting on any readers to do so
+    if (fd < 0) {
+      if (!quiet) {
+        if (sqlite3_wal_checkpoint_v2(conn, NULL, SQLITE_CHECKPOINT_TRUNCATE,
+                                      NULL, NULL) == SQLITE_OK) {
+          quiet = 1;
+        }
+      }
+      continue;
+    }
+    quiet = 0;
+
+    // a client going wrong is no reason to stop serving the rest
+    zsql_error *client_err = zsql_serve_client(conn, &index, fd);
+    if (client_err != NULL) {
+      zsql_error_print(client_err);
+      zsql_error_free(client_err);
+    }
+    close(fd);
+
+    if (STATS) {
+      zsql_print_stats();
+    }
+  }
+
+cleanup_listener:
+  close(listener);
+  unlink(path);
+cleanup_path:
+  free(path);
+cleanup_sql:
+  sqlite3_close(conn);
+  zsql_index_free(&index);
+exit:
+  return err;
+}
@@ -0,0 +1,21 @@
+#ifndef ZSQL_SERVER_H
+#define ZSQL_SERVER_H
+
+#include "error.h"
+
+// requests to a server are one of these bytes followed by its arguments, and
+// its reply is ZSQL_REPLY_OK followed by any result, or ZSQL_REPLY_ERROR
+// followed by what went wrong.
+//
+// adding takes the dir. searching takes the utf8proc options as an int32_t
+// then the runes, and results in the id as an int64_t then the dir. deleting
+// takes the id as an int64_t then the dir
+#define ZSQL_REQUEST_ADD 'a'
+#define ZSQL_REQUEST_SEARCH 's'
+#define ZSQL_REQUEST_DELETE 'd'
+#define ZSQL_REPLY_OK 'k'
+#define ZSQL_REPLY_ERROR 'e'
+
+extern zsql_error *zsql_serve(void);
+
+#endif
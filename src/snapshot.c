@@ -0,0 +1,374 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "stats.h"
+#include "zsql.h"
+
+static const char *const snapshot_file = "/zsql.snapshot";
+
+// searches without a server scan a snapshot of the index, mapped in from a
+// file beside the database, rather than reading every dir back out of it. the
+// snapshot is only a cache: one that's missing, malformed or behind
+// aging.generation is rebuilt from the database, and failing to write one only
+// means rebuilding it again next time.
+//
+// a header is followed by each column with room for capacity dirs, then the
+// profiles with room for profiles_capacity bytes, so that the snapshot can be
+// caught up with most visits in place, see snapshot_begin
+#define SNAPSHOT_MAGIC "zsqlsnap"
+#define SNAPSHOT_VERSION 1
+// written as is, so that a snapshot from a machine of the other byte order
+// reads back as another value
+#define SNAPSHOT_BYTE_ORDER UINT32_C(0x01020304)
+// room left for new dirs, and their profiles, beyond a quarter again as many
+// as a snapshot is written with
+#define SNAPSHOT_ROOM 1024
+#define SNAPSHOT_PROFILES_ROOM (64 * 1024)
+
+// the header is written after the columns, so that any process mapping the
+// snapshot that sees its generation also sees what it covers
+#if defined(__GNUC__)
+#define SNAPSHOT_BARRIER() __sync_synchronize()
+#else
+#define SNAPSHOT_BARRIER()
+#endif
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  // aging.generation as of the snapshot, or -1 while it's being caught up
+  int64_t generation;
+  uint64_t length;
+  uint64_t capacity;
+  uint64_t profiles_length;
+  uint64_t profiles_capacity;
+} snapshot_header;
+
+// where the columns of a snapshot with room for capacity dirs begin, in the
+// order they're laid out in, followed by where its profiles begin
+enum {
+  SNAPSHOT_IDS,
+  SNAPSHOT_VISITS,
+  SNAPSHOT_VISITED_SEQS,
+  SNAPSHOT_SIGNATURES,
+  SNAPSHOT_PROFILE_OFFSETS,
+  SNAPSHOT_PROFILES,
+  SNAPSHOT_SECTIONS
+};
+
+// the size of a snapshot with room for capacity dirs and profiles_capacity
+// bytes of profiles, with where each of its sections begins, or 0 if it's too
+// large to map
+static size_t snapshot_layout(uint64_t capacity, uint64_t profiles_capacity,
+                              size_t sections[SNAPSHOT_SECTIONS]) {
+  // every column holds eight bytes a dir, and the profile offsets two a dir
+  // and one more
+  const size_t room = SIZE_MAX - sizeof(snapshot_header);
+  if (capacity > (room / 8 - 1) / 6 ||
+      profiles_capacity > room - (6 * capacity + 1) * 8) {
+    return 0;
+  }
+
+  size_t offset = sizeof(snapshot_header);
+  for (int section = 0; section < SNAPSHOT_PROFILE_OFFSETS; ++section) {
+    sections[section] = offset;
+    offset += (size_t)capacity * 8;
+  }
+  sections[SNAPSHOT_PROFILE_OFFSETS] = offset;
+  offset += (2 * (size_t)capacity + 1) * 8;
+  sections[SNAPSHOT_PROFILES] = offset;
+  return offset + (size_t)profiles_capacity;
+}
+
+// point index's columns at a snapshot laid out as sections, mapped at map
+static void snapshot_columns(zsql_index *index, uint8_t *map,
+                             const size_t sections[SNAPSHOT_SECTIONS]) {
+  index->ids = (int64_t *)(void *)(map + sections[SNAPSHOT_IDS]);
+  index->visits = (double *)(void *)(map + sections[SNAPSHOT_VISITS]);
+  index->visited_seqs =
+      (int64_t *)(void *)(map + sections[SNAPSHOT_VISITED_SEQS]);
+  index->signatures =
+      (uint64_t *)(void *)(map + sections[SNAPSHOT_SIGNATURES]);
+  index->profile_offsets =
+      (uint64_t *)(void *)(map + sections[SNAPSHOT_PROFILE_OFFSETS]);
+  index->profiles = map + sections[SNAPSHOT_PROFILES];
+}
+
+// bring the mapped index's length up to date with its header, returning the
+// generation it's as of
+int64_t snapshot_sync(zsql_index *index) {
+  const volatile snapshot_header *header = index->map;
+  const int64_t generation = header->generation;
+  SNAPSHOT_BARRIER();
+  // a header this can't be trusted with is never as of any generation
+  if (header->length > index->capacity ||
+      header->profiles_length > index->profiles_capacity ||
+      header->length < index->length) {
+    return -1;
+  }
+  index->length = (size_t)header->length;
+  index->profiles_length = (size_t)header->profiles_length;
+  return generation;
+}
+
+// map the snapshot in as index, leaving index stale if there's none fit to be
+// used. index is mapped writable, to be caught up in place
+zsql_error *snapshot_map(zsql_index *index) {
+  zsql_error *err = NULL;
+
+  const uint64_t started = zsql_clock();
+  index->stale = 1;
+
+  char *path;
+  if ((err = zsql_data_path(snapshot_file, 0, &path)) != NULL) {
+    goto exit;
+  }
+
+  const int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    goto cleanup_path;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header) ||
+      (uintmax_t)st.st_size > SIZE_MAX) {
+    goto cleanup_fd;
+  }
+  const size_t map_length = (size_t)st.st_size;
+
+  void *map =
+      mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    goto cleanup_fd;
+  }
+
+  const snapshot_header *header = map;
+  size_t sections[SNAPSHOT_SECTIONS];
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->byte_order != SNAPSHOT_BYTE_ORDER ||
+      snapshot_layout(header->capacity, header->profiles_capacity,
+                           sections) != map_length) {
+    goto cleanup_map;
+  }
+
+  zsql_index mapped = {.capacity = (size_t)header->capacity,
+                       .profiles_capacity = (size_t)header->profiles_capacity,
+                       .map = map,
+                       .map_length = map_length};
+  snapshot_columns(&mapped, map, sections);
+  mapped.generation = snapshot_sync(&mapped);
+
+  // the offsets are checked rather than trusted, so that scoring never reads
+  // past the profiles
+  const uint64_t *offsets = mapped.profile_offsets;
+  for (size_t idx = 0; idx < 2 * mapped.length; ++idx) {
+    if (offsets[idx] > offsets[idx + 1]) {
+      goto cleanup_map;
+    }
+  }
+  if (offsets[2 * mapped.length] > mapped.profiles_length) {
+    goto cleanup_map;
+  }
+
+  *index = mapped;
+
+  if (0) { // error path only
+  cleanup_map:
+    munmap(map, map_length);
+  }
+cleanup_fd:
+  close(fd);
+cleanup_path:
+  free(path);
+  zsql_phase_end(ZSQL_PHASE_SNAPSHOT, started);
+exit:
+  return err;
+}
+
+static zsql_error *snapshot_put(int fd, size_t offset, const void *data,
+                                size_t length) {
+  const uint8_t *bytes = data;
+  while (length > 0) {
+    const ssize_t written = pwrite(fd, bytes, length, (off_t)offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      return zsql_error_from_errno(NULL);
+    }
+    if (written == 0) {
+      return zsql_error_from_text("short write to snapshot", NULL);
+    }
+    bytes += written;
+    offset += (size_t)written;
+    length -= (size_t)written;
+  }
+  return NULL;
+}
+
+// write index out as the snapshot, replacing any other. it's written aside
+// and renamed into place, so that it's never mapped half written
+zsql_error *snapshot_write(const zsql_index *index) {
+  zsql_error *err = NULL;
+
+  const uint64_t started = zsql_clock();
+
+  char *path;
+  if ((err = zsql_data_path(snapshot_file, 1, &path)) != NULL) {
+    goto exit;
+  }
+
+  static const char temp_suffix[] = ".XXXXXX";
+  const size_t path_length = strlen(path);
+  char *temp_path = malloc(path_length + sizeof(temp_suffix));
+  if (temp_path == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_path;
+  }
+  memcpy(temp_path, path, path_length);
+  memcpy(temp_path + path_length, temp_suffix, sizeof(temp_suffix));
+
+  const int fd = mkstemp(temp_path);
+  if (fd < 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_temp_path;
+  }
+
+  snapshot_header header = {
+      .version = SNAPSHOT_VERSION,
+      .byte_order = SNAPSHOT_BYTE_ORDER,
+      .generation = index->generation,
+      .length = index->length,
+      .capacity = index->length + index->length / 4 + SNAPSHOT_ROOM,
+      .profiles_length = index->profiles_length,
+      .profiles_capacity = index->profiles_length + index->profiles_length / 4 +
+                           SNAPSHOT_PROFILES_ROOM};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+  size_t sections[SNAPSHOT_SECTIONS];
+  const size_t map_length =
+      snapshot_layout(header.capacity, header.profiles_capacity, sections);
+  if (map_length == 0) {
+    err = zsql_error_from_text("snapshot is too large", err);
+    goto cleanup_fd;
+  }
+
+  // the room left is allocated up front, so that running out of disk while
+  // catching up in place fails here rather than faulting a mapping
+#if HAVE_POSIX_FALLOCATE
+  const int status = posix_fallocate(fd, 0, (off_t)map_length);
+  if (status != 0) {
+    errno = status;
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+#else
+  if (ftruncate(fd, (off_t)map_length) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+#endif
+
+  // the columns as long as there are dirs, leaving the rest of their room as
+  // zeros, then the header last
+  const size_t length = index->length;
+  const struct {
+    int section;
+    const void *data;
+    size_t length;
+  } columns[] = {
+      {SNAPSHOT_IDS, index->ids, length * sizeof(*index->ids)},
+      {SNAPSHOT_VISITS, index->visits, length * sizeof(*index->visits)},
+      {SNAPSHOT_VISITED_SEQS, index->visited_seqs,
+       length * sizeof(*index->visited_seqs)},
+      {SNAPSHOT_SIGNATURES, index->signatures,
+       length * sizeof(*index->signatures)},
+      {SNAPSHOT_PROFILE_OFFSETS, index->profile_offsets,
+       length > 0 ? (2 * length + 1) * sizeof(*index->profile_offsets) : 0},
+      {SNAPSHOT_PROFILES, index->profiles, index->profiles_length}};
+  for (size_t idx = 0; idx < sizeof(columns) / sizeof(*columns); ++idx) {
+    if (columns[idx].length > 0 &&
+        (err = snapshot_put(fd, sections[columns[idx].section],
+                                 columns[idx].data, columns[idx].length)) !=
+            NULL) {
+      goto cleanup_fd;
+    }
+  }
+  if ((err = snapshot_put(fd, 0, &header, sizeof(header))) != NULL) {
+    goto cleanup_fd;
+  }
+
+  if (rename(temp_path, path) != 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_fd;
+  }
+
+cleanup_fd:
+  close(fd);
+  if (err != NULL) {
+    unlink(temp_path);
+  }
+cleanup_temp_path:
+  free(temp_path);
+cleanup_path:
+  free(path);
+  zsql_phase_end(ZSQL_PHASE_SNAPSHOT, started);
+exit:
+  return err;
+}
+
+// begin catching the mapped index up with writes in the transaction the
+// caller holds, leaving it stale if the snapshot is already behind. until
+// snapshot_commit, the snapshot is marked as behind every generation, so
+// that one left half caught up is never used. the caller's write lock keeps
+// any other process from catching it up at the same time
+zsql_error *snapshot_begin(sqlite3 *conn, zsql_index *index) {
+  zsql_error *err = NULL;
+
+  if (index->stale || index->map == NULL) {
+    index->stale = 1;
+    goto exit;
+  }
+
+  double scale;
+  int64_t generation;
+  if ((err = zsql_index_read_aging(conn, &scale, &generation)) != NULL) {
+    goto exit;
+  }
+  if (snapshot_sync(index) != generation) {
+    index->stale = 1;
+    goto exit;
+  }
+
+  index->scale = scale;
+  ((snapshot_header *)index->map)->generation = -1;
+  SNAPSHOT_BARRIER();
+
+exit:
+  return err;
+}
+
+// finish catching the mapped index up, now that aging.generation has been
+// committed as generation
+void snapshot_commit(zsql_index *index, int64_t generation) {
+  snapshot_header *header = index->map;
+  header->length = index->length;
+  header->profiles_length = index->profiles_length;
+  SNAPSHOT_BARRIER();
+  header->generation = generation;
+  index->generation = generation;
+}
@@ -0,0 +1,16 @@
+#ifndef ZSQL_SNAPSHOT_H
+#define ZSQL_SNAPSHOT_H
+
+#include <sqlite3.h>
+#include <stdint.h>
+
+#include "error.h"
+#include "zsql.h"
+
+extern int64_t snapshot_sync(zsql_index *index);
+extern zsql_error *snapshot_map(zsql_index *index);
+extern zsql_error *snapshot_write(const zsql_index *index);
+extern zsql_error *snapshot_begin(sqlite3 *conn, zsql_index *index);
+extern void snapshot_commit(zsql_index *index, int64_t generation);
+
+#endif
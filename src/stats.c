@@ -0,0 +1,74 @@
+#include "stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "env.h"
+#include "fuzzy_search.h"
+
+static const char *const zsql_phase_names[ZSQL_PHASES] = {
+    "options", "mkdir",   "open",    "migrate", "fold",  "snapshot", "aging",
+    "locked",  "request", "prepare", "scan",    "score", "check",    "output"};
+
+#ifdef HAVE_THREAD_LOCAL
+thread_local zsql_counts zsql_stats;
+#else
+zsql_counts zsql_stats;
+#endif
+
+// add this thread's counts from fuzzy_stats to its own
+void zsql_stats_take_fuzzy(void) {
+  unsigned long ranked;
+  unsigned long spilled;
+  fuzzy_stats(&ranked, &spilled);
+  zsql_stats.ranked += ranked;
+  zsql_stats.spilled += spilled;
+}
+
+// nanoseconds on a monotonic clock, or always 0 without ZSQL_STATS, so that
+// timing costs next to nothing unless asked for
+uint64_t zsql_clock(void) {
+  if (!STATS) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// count the time since started, as given by zsql_clock, towards phase
+void zsql_phase_end(int phase, uint64_t started) {
+  zsql_stats.phase_ns[phase] += zsql_clock() - started;
+}
+
+// count the time since lap towards phase, and start the next lap
+void zsql_phase_lap(int phase, uint64_t *lap) {
+  const uint64_t now = zsql_clock();
+  zsql_stats.phase_ns[phase] += now - *lap;
+  *lap = now;
+}
+
+// one line per phase and counter, its name then its value, for scripts to
+// read. phases run on several threads add up the time of each
+void zsql_print_stats(void) {
+  zsql_stats_take_fuzzy();
+  for (size_t phase = 0; phase < ZSQL_PHASES; ++phase) {
+    fprintf(stderr, "%s_ms\t%.3f\n", zsql_phase_names[phase],
+            (double)zsql_stats.phase_ns[phase] / 1000000);
+  }
+  fprintf(stderr, "scanned\t%lu\n", zsql_stats.scanned);
+  fprintf(stderr, "rejected\t%lu\n", zsql_stats.rejected);
+  fprintf(stderr, "settled\t%lu\n", zsql_stats.settled);
+  fprintf(stderr, "pruned\t%lu\n", zsql_stats.pruned);
+  fprintf(stderr, "ranked\t%lu\n", zsql_stats.ranked);
+  fprintf(stderr, "spilled\t%lu\n", zsql_stats.spilled);
+  fprintf(stderr, "threads\t%lu\n", zsql_stats.threads);
+  fprintf(stderr, "lock_waits\t%lu\n", zsql_stats.lock_waits);
+  fprintf(stderr, "lock_retries\t%lu\n", zsql_stats.lock_retries);
+  fprintf(stderr, "decays\t%lu\n", zsql_stats.decays);
+  fprintf(stderr, "narrowed\t%lu\n", zsql_stats.narrowed);
+  fprintf(stderr, "seeded\t%lu\n", zsql_stats.seeded);
+  fprintf(stderr, "gone\t%lu\n", zsql_stats.gone);
+}
@@ -0,0 +1,69 @@
+#ifndef ZSQL_STATS_H
+#define ZSQL_STATS_H
+
+#include <stdint.h>
+
+// the phases of a run timed with ZSQL_STATS. a server's are summed over every
+// client it answers
+enum {
+  ZSQL_PHASE_OPTIONS,
+  ZSQL_PHASE_MKDIR,
+  ZSQL_PHASE_OPEN,
+  ZSQL_PHASE_MIGRATE,
+  ZSQL_PHASE_FOLD,
+  ZSQL_PHASE_SNAPSHOT,
+  ZSQL_PHASE_AGING,
+  ZSQL_PHASE_LOCKED,
+  ZSQL_PHASE_REQUEST,
+  ZSQL_PHASE_PREPARE,
+  ZSQL_PHASE_SCAN,
+  ZSQL_PHASE_SCORE,
+  ZSQL_PHASE_CHECK,
+  ZSQL_PHASE_OUTPUT,
+  ZSQL_PHASES
+};
+
+// what a run spent its time on and how much work it did, printed with
+// ZSQL_STATS
+typedef struct {
+  uint64_t phase_ns[ZSQL_PHASES];
+  // dirs considered while scoring, those their signature rejected, those
+  // fuzzy_match settled without ranking, and those given up on as unable to
+  // be the best
+  unsigned long scanned;
+  unsigned long rejected;
+  unsigned long settled;
+  unsigned long pruned;
+  // as counted by fuzzy_stats
+  unsigned long ranked;
+  unsigned long spilled;
+  // extra threads started to score or to check dirs for a prune
+  unsigned long threads;
+  // times another's lock had to be waited on, and the sleeps waiting took
+  unsigned long lock_waits;
+  unsigned long lock_retries;
+  unsigned long decays;
+  // searches in a stream that only scored what the one before matched
+  unsigned long narrowed;
+  // dirs found through their basename to bound a search before it scanned
+  unsigned long seeded;
+  // dirs found to no longer exist, by a search or a prune
+  unsigned long gone;
+} zsql_counts;
+
+// threads scoring in parallel count on their own, and are added to the thread
+// that started them once they're done. scoring is never split between threads
+// without thread-local storage
+#ifdef HAVE_THREAD_LOCAL
+extern thread_local zsql_counts zsql_stats;
+#else
+extern zsql_counts zsql_stats;
+#endif
+
+extern void zsql_stats_take_fuzzy(void);
+extern uint64_t zsql_clock(void);
+extern void zsql_phase_end(int phase, uint64_t started);
+extern void zsql_phase_lap(int phase, uint64_t *lap);
+extern void zsql_print_stats(void);
+
+#endif
@@ -0,0 +1,201 @@
+#include "stream.h"
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <utf8proc.h>
+
+#include "error.h"
+#include "fuzzy_search.h"
+#include "list.h"
+#include "sqlh.h"
+#include "stats.h"
+#include "zsql.h"
+
+// how many of the best matches a stream prints for each search, unless it's
+// listing records
+#define ZSQL_STREAM_LIMIT 10
+
+// whether needle is a subsequence of haystack, so that any dir haystack
+// matches, needle matches too
+static int zsql_runes_within(const int32_t *needle, size_t needle_length,
+                             const int32_t *haystack, size_t haystack_length) {
+  size_t needle_idx = 0;
+  for (size_t idx = 0; idx < haystack_length && needle_idx < needle_length;
+       ++idx) {
+    if (haystack[idx] == needle[needle_idx]) {
+      ++needle_idx;
+    }
+  }
+  return needle_idx == needle_length;
+}
+
+static int zsql_position_compare(const void *a, const void *b) {
+  const size_t a_position = *(const size_t *)a;
+  const size_t b_position = *(const size_t *)b;
+  return (a_position > b_position) - (a_position < b_position);
+}
+
+// answer searches read from stdin a line at a time, each split on blanks into
+// words as arguments would be, with their best matches each ended by
+// terminator and then a terminator alone. matches are dirs, or records of up
+// to list_limit of them if that isn't zero. a search that only adds to the one
+// before can only match dirs that one matched, so only those are scored again.
+// every search scores the dirs of index, read from the database once when the
+// stream begins, and never through a server
+zsql_error *zsql_stream(sqlite3 *conn, const zsql_index *index,
+                        zsql_case_sensitivity case_sensitivity, int list_limit,
+                        char terminator) {
+  zsql_error *err = NULL;
+
+  // the last search answered, and the positions within index of the dirs it
+  // matched, in order
+  int32_t *previous = NULL;
+  size_t previous_length = 0;
+  utf8proc_option_t previous_options = 0;
+  size_t *matched = NULL;
+  size_t matched_length = 0;
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  char **words = NULL;
+  size_t words_capacity = 0;
+  ssize_t line_length;
+  while ((line_length = getline(&line, &line_capacity, stdin)) >= 0) {
+    const uint64_t started = zsql_clock();
+
+    // words alternate with blanks, so there are never more than half as many
+    // as there are bytes
+    const size_t most_words = (size_t)line_length / 2 + 1;
+    if (most_words > words_capacity) {
+      void *allocation = realloc(words, most_words * sizeof(*words));
+      if (allocation == NULL) {
+        err = zsql_error_from_errno(err);
+        goto cleanup_line;
+      }
+      words = allocation;
+      words_capacity = most_words;
+    }
+
+    size_t words_length = 0;
+    for (char *ch = line;;) {
+      while (*ch == ' ' || *ch == '\t' || *ch == '\n' || *ch == '\r') {
+        ++ch;
+      }
+      if (*ch == 0) {
+        break;
+      }
+      words[words_length++] = ch;
+      while (*ch != 0 && *ch != ' ' && *ch != '\t' && *ch != '\n' &&
+             *ch != '\r') {
+        ++ch;
+      }
+      if (*ch != 0) {
+        *ch++ = 0;
+      }
+    }
+
+    int32_t *runes;
+    size_t runes_length;
+    utf8proc_option_t utf8proc_options;
+    if ((err = zsql_parse_search(words, words_length, case_sensitivity, &runes,
+                                 &runes_length, &utf8proc_options)) != NULL) {
+      goto cleanup_line;
+    }
+    zsql_phase_end(ZSQL_PHASE_OPTIONS, started);
+
+    const int narrowing =
+        previous != NULL && utf8proc_options == previous_options &&
+        zsql_runes_within(previous, previous_length, runes, runes_length);
+    zsql_stats.narrowed += narrowing;
+    zsql_query query = {.length = runes_length,
+                        .runes = runes,
+                        .signature = fuzzy_signature(runes, runes_length),
+                        .utf8proc_options = utf8proc_options,
+                        .index = index,
+                        .candidates = narrowing ? matched : NULL,
+                        .candidates_length = matched_length};
+
+    sqlite3_stmt *stmt;
+    if ((err = zsql_match(conn, &stmt, &query,
+                          list_limit > 0 ? list_limit : ZSQL_STREAM_LIMIT)) !=
+        NULL) {
+      goto cleanup_query;
+    }
+
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+      const uint64_t output_started = zsql_clock();
+      if (list_limit > 0) {
+        if ((err = zsql_print_record(stmt, &query, terminator)) != NULL) {
+          goto cleanup_stmt;
+        }
+      } else {
+        const size_t match_length = (size_t)sqlite3_column_bytes(stmt, 1);
+        const char *match = sqlite3_column_blob(stmt, 1);
+        if (fwrite(match, 1, match_length, stdout) != match_length ||
+            putchar(terminator) == EOF) {
+          err = zsql_error_from_errno(err);
+          goto cleanup_stmt;
+        }
+      }
+      zsql_phase_end(ZSQL_PHASE_OUTPUT, output_started);
+    }
+    if (status != SQLITE_DONE) {
+      err = zsql_error_from_sqlite(conn, err);
+      goto cleanup_stmt;
+    }
+
+    // what this search matched, for the next to narrow down
+
+    size_t *positions = malloc(
+        query.scores_length > 0 ? query.scores_length * sizeof(*positions)
+                                : 1);
+    if (positions == NULL) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_stmt;
+    }
+    for (size_t idx = 0; idx < query.scores_length; ++idx) {
+      positions[idx] = zsql_index_find(index, query.scores[idx].id);
+    }
+    qsort(positions, query.scores_length, sizeof(*positions),
+          zsql_position_compare);
+
+    free(matched);
+    matched = positions;
+    matched_length = query.scores_length;
+    free(previous);
+    previous = runes;
+    previous_length = runes_length;
+    previous_options = utf8proc_options;
+    runes = NULL;
+
+  cleanup_stmt:
+    err = sqlh_finalize(stmt, err);
+  cleanup_query:
+    free(query.scores);
+    free(runes);
+    if (err != NULL) {
+      goto cleanup_line;
+    }
+
+    if (putchar(terminator) == EOF || fflush(stdout) == EOF) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_line;
+    }
+  }
+  if (ferror(stdin)) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_line;
+  }
+
+cleanup_line:
+  free(words);
+  free(line);
+  free(matched);
+  free(previous);
+  return err;
+}
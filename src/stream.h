@@ -0,0 +1,13 @@
+#ifndef ZSQL_STREAM_H
+#define ZSQL_STREAM_H
+
+#include <sqlite3.h>
+
+#include "error.h"
+#include "zsql.h"
+
+extern zsql_error *zsql_stream(sqlite3 *conn, const zsql_index *index,
+                               zsql_case_sensitivity case_sensitivity,
+                               int list_limit, char terminator);
+
+#endif
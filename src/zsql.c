@@ -1,3 +1,6 @@
+#include "zsql.h"
+
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <math.h>
@@ -5,40 +8,253 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <utf8proc.h>
 
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include "env.h"
 #include "error.h"
 #include "fuzzy_search.h"
+#include "ipc.h"
+#include "journal.h"
+#include "list.h"
 #include "migrate.h"
+#include "prune.h"
+#include "server.h"
+#include "snapshot.h"
 #include "sqlh.h"
 #include "sqlite3.h"
+#include "stats.h"
+#include "stream.h"
 
-typedef struct {
-  const size_t length;
-  const int32_t *runes;
-  const utf8proc_option_t utf8proc_options;
-} zsql_query;
-
-#ifdef HAVE_THREAD_LOCAL
-#define MATCH_BUFFER_SIZE 1024
-static thread_local int32_t match_buffer[MATCH_BUFFER_SIZE];
-#endif
+// the delays of sqlite3_busy_timeout, adding up to the same 128ms
+static const int zsql_busy_delays[] = {1, 2, 5, 10, 15, 20, 25, 25, 25};
+
+static int zsql_busy(void *data, int count) {
+  (void)data;
+
+  if (count == 0) {
+    ++zsql_stats.lock_waits;
+  }
+  if ((size_t)count >= sizeof(zsql_busy_delays) / sizeof(*zsql_busy_delays)) {
+    return 0;
+  }
+  ++zsql_stats.lock_retries;
+  const uint64_t started = zsql_clock();
+  sqlite3_sleep(zsql_busy_delays[count]);
+  zsql_phase_end(ZSQL_PHASE_LOCKED, started);
+  return 1;
+}
+
+int profile_parse(const uint8_t *profile, size_t profile_length,
+                  size_t *width, size_t *runes_length) {
+  if (profile_length == 0) {
+    return 1;
+  }
+
+  *width = profile[profile_length - 1];
+  if (*width != PROFILE_WIDTH_ASCII && *width != PROFILE_WIDTH_UTF32) {
+    return 1;
+  }
+  if ((profile_length - 1) % (*width + 1) != 0) {
+    return 1;
+  }
+
+  *runes_length = (profile_length - 1) / (*width + 1);
+  return 0;
+}
+
+static int is_ascii(const uint8_t *bytes, size_t length) {
+  uint8_t high_bits = 0;
+  for (size_t idx = 0; idx < length; ++idx) {
+    high_bits |= bytes[idx];
+  }
+  return high_bits < 0x80;
+}
+
+static inline uint8_t ascii_fold(uint8_t byte) {
+  return byte >= 'A' && byte <= 'Z' ? byte + ('a' - 'A') : byte;
+}
+
+// the profile of dir, of dir_length bytes, into a new allocation
+static zsql_error *profile_new(const uint8_t *dir, size_t dir_length,
+                               int folded, uint8_t **profile,
+                               size_t *profile_length) {
+  zsql_error *err = NULL;
+
+  if (is_ascii(dir, dir_length)) {
+    // copy dir over byte for byte
+
+    *profile_length = dir_length * (PROFILE_WIDTH_ASCII + 1) + 1;
+    *profile = malloc(*profile_length);
+    if (*profile == NULL) {
+      err = zsql_error_from_errno(err);
+      goto exit;
+    }
+
+    for (size_t idx = 0; idx < dir_length; ++idx) {
+      (*profile)[idx] = folded ? ascii_fold(dir[idx]) : dir[idx];
+    }
+    fuzzy_bonus_ascii(*profile + dir_length, *profile, dir_length);
+    (*profile)[*profile_length - 1] = PROFILE_WIDTH_ASCII;
+  } else {
+    // convert dir to utf32, leaving room for the bonus classes after it
+
+    utf8proc_option_t utf8proc_options = utf8proc_base_options;
+    if (folded) {
+      utf8proc_options |= UTF8PROC_CASEFOLD;
+    }
+
+    size_t runes_length = dir_length * 2;
+    *profile = malloc(runes_length * (PROFILE_WIDTH_UTF32 + 1) + 1);
+    if (*profile == NULL) {
+      err = zsql_error_from_errno(err);
+      goto exit;
+    }
+
+  retry_decompose:;
+    ssize_t result =
+        utf8proc_decompose(dir, dir_length, (int32_t *)*profile, runes_length,
+                           utf8proc_options);
+    if (result < 0) {
+      err = zsql_error_from_text(utf8proc_errmsg(result), err);
+      goto cleanup_profile;
+    } else if ((size_t)result > runes_length) {
+      runes_length = result;
+      void *allocation =
+          realloc(*profile, runes_length * (PROFILE_WIDTH_UTF32 + 1) + 1);
+      if (allocation == NULL) {
+        err = zsql_error_from_errno(err);
+        goto cleanup_profile;
+      }
+      *profile = allocation;
+      goto retry_decompose;
+    } else {
+      runes_length = result;
+    }
+
+    fuzzy_bonus(*profile + runes_length * PROFILE_WIDTH_UTF32,
+                (int32_t *)*profile, runes_length);
+    *profile_length = runes_length * (PROFILE_WIDTH_UTF32 + 1) + 1;
+    (*profile)[*profile_length - 1] = PROFILE_WIDTH_UTF32;
+  }
+
+  if (0) { // error path only
+  cleanup_profile:
+    free(*profile);
+  }
+exit:
+  return err;
+}
+
+// the profile of the component of a dir that follows context, the component
+// before it. normalization never reaches back across the slash a component
+// begins with, so the component's runes are those of its own profile, while
+// the bonus class of its slash depends on what comes before. profiling the
+// two together and cutting context off gets both, and leaves the profile of a
+// dir made up of its components' profiles one after another
+static zsql_error *profile_new_component(const uint8_t *context,
+                                         size_t context_length,
+                                         const uint8_t *dir, size_t dir_length,
+                                         int folded, uint8_t **profile,
+                                         size_t *profile_length) {
+  zsql_error *err = NULL;
+
+  if (context_length == 0) {
+    err = profile_new(dir, dir_length, folded, profile, profile_length);
+    goto exit;
+  }
+
+  uint8_t *joined = malloc(context_length + dir_length);
+  if (joined == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  memcpy(joined, context, context_length);
+  memcpy(joined + context_length, dir, dir_length);
+
+  uint8_t *whole;
+  size_t whole_length;
+  if ((err = profile_new(joined, context_length + dir_length, folded, &whole,
+                         &whole_length)) != NULL) {
+    goto cleanup_joined;
+  }
+
+  // context on its own only gives how many of the runes are its
+  size_t context_runes_length = context_length;
+  if (!is_ascii(context, context_length)) {
+    uint8_t *context_profile;
+    size_t context_profile_length;
+    if ((err = profile_new(context, context_length, folded, &context_profile,
+                           &context_profile_length)) != NULL) {
+      goto cleanup_whole;
+    }
+    context_runes_length =
+        (context_profile_length - 1) / (PROFILE_WIDTH_UTF32 + 1);
+    free(context_profile);
+  }
+
+  const size_t whole_width = whole[whole_length - 1];
+  const size_t whole_runes_length = (whole_length - 1) / (whole_width + 1);
+  if (context_runes_length > whole_runes_length) {
+    err = zsql_error_from_text("component normalized into the one before it",
+                               err);
+    goto cleanup_whole;
+  }
+
+  // the runes of an ascii component are always single bytes, wherever it is
+  const size_t width =
+      is_ascii(dir, dir_length) ? PROFILE_WIDTH_ASCII : PROFILE_WIDTH_UTF32;
+  const size_t runes_length = whole_runes_length - context_runes_length;
+  *profile_length = runes_length * (width + 1) + 1;
+  *profile = malloc(*profile_length);
+  if (*profile == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_whole;
+  }
+
+  const uint8_t *runes = whole + context_runes_length * whole_width;
+  if (width == whole_width) {
+    memcpy(*profile, runes, runes_length * width);
+  } else {
+    for (size_t idx = 0; idx < runes_length; ++idx) {
+      int32_t rune;
+      memcpy(&rune, runes + idx * sizeof(rune), sizeof(rune));
+      (*profile)[idx] = (uint8_t)rune;
+    }
+  }
+  memcpy(*profile + runes_length * width,
+         whole + whole_runes_length * whole_width + context_runes_length,
+         runes_length);
+  (*profile)[*profile_length - 1] = (uint8_t)width;
+
+cleanup_whole:
+  free(whole);
+cleanup_joined:
+  free(joined);
+exit:
+  return err;
+}
 
-static void match_impl(sqlite3_context *context, int argc,
-                       sqlite3_value **argv) {
+// profile(dir, folded) or profile(component, folded, context)
+static void profile_impl(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
   // invariants
 
-  if (argc != 2) {
+  if (argc != 2 && argc != 3) {
     sqlite3_result_error(context,
-                         "wrong number of arguments to function match()", -1);
+                         "wrong number of arguments to function profile()", -1);
     goto exit;
   }
   if (sqlite3_value_type(argv[0]) != SQLITE_BLOB ||
-      !sqlite3_value_frombind(argv[1])) {
-    sqlite3_result_error(context, "incorrect arguments to function match()",
+      (argc == 3 && sqlite3_value_type(argv[2]) != SQLITE_BLOB)) {
+    sqlite3_result_error(context, "incorrect arguments to function profile()",
                          -1);
     goto exit;
   }
@@ -46,449 +262,3296 @@ static void match_impl(sqlite3_context *context, int argc,
   // get parameters
 
   const size_t dir_length = (size_t)sqlite3_value_bytes(argv[0]);
-  const char *dir = sqlite3_value_blob(argv[0]);
+  const uint8_t *dir = sqlite3_value_blob(argv[0]);
+  const int folded = sqlite3_value_int(argv[1]);
+  const size_t before_length =
+      argc == 3 ? (size_t)sqlite3_value_bytes(argv[2]) : 0;
+  const uint8_t *before = argc == 3 ? sqlite3_value_blob(argv[2]) : NULL;
+
+  uint8_t *profile;
+  size_t profile_length;
+  zsql_error *err = profile_new_component(before, before_length, dir,
+                                          dir_length, folded, &profile,
+                                          &profile_length);
+  if (err != NULL) {
+    sqlite3_result_error(context, err->msg, -1);
+    zsql_error_free(err);
+    goto exit;
+  }
 
-  const zsql_query *query = sqlite3_value_pointer(argv[1], "");
+  // return to sqlite, which takes ownership of profile
 
-  // convert dir to utf32
+  sqlite3_result_blob64(context, profile, profile_length, free);
 
-  size_t dir_utf32_length = dir_length * 2;
-  int32_t *dir_utf32;
-#ifdef HAVE_THREAD_LOCAL
-  if (dir_utf32_length <= MATCH_BUFFER_SIZE) {
-    dir_utf32 = match_buffer;
-  } else {
-#endif
-    dir_utf32 = malloc(dir_utf32_length * sizeof(*dir_utf32));
-    if (dir_utf32 == NULL) {
-      sqlite3_result_error_nomem(context);
-      goto exit;
-    }
-#ifdef HAVE_THREAD_LOCAL
+exit:;
+}
+
+static void signature_impl(sqlite3_context *context, int argc,
+                           sqlite3_value **argv) {
+  // invariants
+
+  if (argc != 1) {
+    sqlite3_result_error(
+        context, "wrong number of arguments to function signature()", -1);
+    goto exit;
+  }
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+    sqlite3_result_error(context, "incorrect arguments to function signature()",
+                         -1);
+    goto exit;
   }
-#endif
 
-retry_decompose:;
-  ssize_t result =
-      utf8proc_decompose((uint8_t *)dir, dir_length, dir_utf32,
-                         dir_utf32_length, query->utf8proc_options);
-  if (result < 0) {
-    sqlite3_result_error(context, utf8proc_errmsg(result), -1);
-    goto cleanup_dir_utf32;
-  } else if ((size_t)result > dir_utf32_length) {
-    dir_utf32_length = result;
-    void *allocation;
-#ifdef HAVE_THREAD_LOCAL
-    if (dir_utf32 == match_buffer) {
-      allocation = malloc(dir_utf32_length * sizeof(*dir_utf32));
-      if (allocation == NULL) {
-        sqlite3_result_error_nomem(context);
-        goto exit;
+  // get parameters
+
+  const size_t profile_length = (size_t)sqlite3_value_bytes(argv[0]);
+  const uint8_t *profile = sqlite3_value_blob(argv[0]);
+  size_t width;
+  size_t runes_length;
+  if (profile_parse(profile, profile_length, &width, &runes_length) != 0) {
+    sqlite3_result_error(context, "malformed profile in function signature()",
+                         -1);
+    goto exit;
+  }
+
+  // summarize the runes a chunk at a time, copying them out for alignment
+
+  uint64_t signature = 0;
+  int32_t chunk[64];
+  for (size_t offset = 0; offset < runes_length;) {
+    size_t chunk_length = runes_length - offset;
+    if (chunk_length > sizeof(chunk) / sizeof(*chunk)) {
+      chunk_length = sizeof(chunk) / sizeof(*chunk);
+    }
+
+    if (width == PROFILE_WIDTH_ASCII) {
+      for (size_t idx = 0; idx < chunk_length; ++idx) {
+        chunk[idx] = profile[offset + idx];
       }
     } else {
-#endif
-      allocation = realloc(dir_utf32, dir_utf32_length * sizeof(*dir_utf32));
-      if (allocation == NULL) {
-        sqlite3_result_error_nomem(context);
-        goto cleanup_dir_utf32;
-      }
-#ifdef HAVE_THREAD_LOCAL
+      memcpy(chunk, profile + offset * sizeof(*chunk),
+             chunk_length * sizeof(*chunk));
     }
-#endif
-    dir_utf32 = allocation;
-    goto retry_decompose;
-  } else {
-    dir_utf32_length = result;
+    signature |= fuzzy_signature(chunk, chunk_length);
+
+    offset += chunk_length;
   }
 
-  // score
+  // return to sqlite
 
-  float score;
-  zsql_error *err;
-  if ((err = fuzzy_search(&score, dir_utf32, dir_utf32_length, query->runes,
-                          query->length)) != NULL) {
-    // fixme: this error may have chained errors in ->next, always ignored here
-    sqlite3_result_error(context, err->msg, -1);
-    zsql_error_free(err);
-    goto cleanup_dir_utf32;
+  sqlite3_result_int64(context, (sqlite3_int64)signature);
+
+exit:;
+}
+
+// the runes of a component's profile after its slash, as utf-8. the utf-8 of a
+// run of runes starts with that of any of its prefixes, so a needle's is a
+// prefix of the basename of every component ending in something it begins
+static void basename_impl(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  // invariants
+
+  if (argc != 1) {
+    sqlite3_result_error(
+        context, "wrong number of arguments to function basename()", -1);
+    goto exit;
+  }
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+    sqlite3_result_error(context, "incorrect arguments to function basename()",
+                         -1);
+    goto exit;
   }
 
-  // return to sqlite
+  // get parameters
 
-  if (score > -INFINITY) {
-    sqlite3_result_double(context, (double)score);
-  } else {
-    sqlite3_result_null(context);
+  const size_t profile_length = (size_t)sqlite3_value_bytes(argv[0]);
+  const uint8_t *profile = sqlite3_value_blob(argv[0]);
+  size_t width;
+  size_t runes_length;
+  if (profile_parse(profile, profile_length, &width, &runes_length) != 0) {
+    sqlite3_result_error(context, "malformed profile in function basename()",
+                         -1);
+    goto exit;
   }
 
-cleanup_dir_utf32:
-#ifdef HAVE_THREAD_LOCAL
-  if (dir_utf32 != match_buffer) {
-#endif
-    free(dir_utf32);
-#ifdef HAVE_THREAD_LOCAL
+  // encode the runes, copying them out for alignment
+
+  uint8_t *basename = sqlite3_malloc64(runes_length * 4 + 1);
+  if (basename == NULL) {
+    sqlite3_result_error_nomem(context);
+    goto exit;
   }
-#endif
+  size_t basename_length = 0;
+  for (size_t idx = 0; idx < runes_length; ++idx) {
+    int32_t rune;
+    if (width == PROFILE_WIDTH_ASCII) {
+      rune = profile[idx];
+    } else {
+      memcpy(&rune, profile + idx * sizeof(rune), sizeof(rune));
+    }
+    if (idx == 0 && rune == '/') {
+      continue;
+    }
+    basename_length += (size_t)utf8proc_encode_char(
+        rune, (utf8proc_uint8_t *)basename + basename_length);
+  }
+
+  // return to sqlite
+
+  sqlite3_result_blob64(context, basename, basename_length, sqlite3_free);
+
 exit:;
 }
 
-static const char *const ensure_dir_error = "not a directory: ";
-static zsql_error *zsql_ensure_dir(const char *path) {
-  struct stat dir_stat;
-  if (stat(path, &dir_stat) != 0) {
-    if (mkdir(path, 0700) != 0) {
-      return zsql_error_from_errno(NULL);
-    }
-  } else if (!S_ISDIR(dir_stat.st_mode)) {
-    const size_t ensure_dir_error_length = strlen(ensure_dir_error);
-    const size_t path_length = strlen(path);
-    const size_t msg_length = ensure_dir_error_length + path_length + 1;
-    char *msg = malloc(msg_length);
-    if (msg == NULL) {
+static zsql_error *zsql_push_score(zsql_query *query, int64_t id,
+                                   float score, int64_t visited_seq,
+                                   double visits) {
+  if (query->scores_length >= query->scores_capacity) {
+    const size_t capacity =
+        query->scores_capacity == 0 ? 64 : query->scores_capacity * 2;
+    void *allocation =
+        realloc(query->scores, capacity * sizeof(*query->scores));
+    if (allocation == NULL) {
       return zsql_error_from_errno(NULL);
     }
-    size_t offset = 0;
+    query->scores = allocation;
+    query->scores_capacity = capacity;
+  }
 
-    memcpy(msg + offset, ensure_dir_error, ensure_dir_error_length);
-    offset += ensure_dir_error_length;
+  query->scores[query->scores_length++] =
+      (zsql_score){.id = id,
+                   .score = score,
+                   .recency = visited_seq,
+                   .visits = visits};
+  return NULL;
+}
 
-    memcpy(msg + offset, path, path_length);
-    offset += path_length;
+static int zsql_seq_compare_descending(const void *a, const void *b) {
+  const int64_t a_seq = *(const int64_t *)a;
+  const int64_t b_seq = *(const int64_t *)b;
+  return (a_seq < b_seq) - (a_seq > b_seq);
+}
 
-    msg[offset] = 0;
+// replace the visited_seq of every score with its dense rank, most recent
+// first, matching DENSE_RANK()OVER(ORDER BY visited_seq DESC) over the matches
+static zsql_error *zsql_rank_recency(zsql_query *query) {
+  zsql_error *err = NULL;
 
-    zsql_error *err = zsql_error_from_text(msg, NULL);
-    free(msg);
-    return err;
+  if (query->scores_length == 0) {
+    goto exit;
   }
 
-  return NULL;
+  int64_t *seqs = malloc(query->scores_length * sizeof(*seqs));
+  if (seqs == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+
+  // the distinct visited_seqs, most recent first
+
+  for (size_t idx = 0; idx < query->scores_length; ++idx) {
+    seqs[idx] = query->scores[idx].recency;
+  }
+  qsort(seqs, query->scores_length, sizeof(*seqs),
+        zsql_seq_compare_descending);
+
+  size_t seqs_length = 1;
+  for (size_t idx = 1; idx < query->scores_length; ++idx) {
+    if (seqs[idx] != seqs[seqs_length - 1]) {
+      seqs[seqs_length++] = seqs[idx];
+    }
+  }
+
+  // a score's rank is one past its position among them
+
+  for (size_t idx = 0; idx < query->scores_length; ++idx) {
+    const int64_t seq = query->scores[idx].recency;
+    size_t low = 0;
+    size_t high = seqs_length;
+    while (low < high) {
+      const size_t mid = low + (high - low) / 2;
+      if (seqs[mid] > seq) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    query->scores[idx].recency = (int64_t)low + 1;
+  }
+
+  free(seqs);
+exit:
+  return err;
 }
 
-// fixme: windows
-static const char *const env_primary = "XDG_DATA_HOME";
-static const char *const env_fallback = "HOME";
+// the rank zsql_rank gives a dir. recency is at least 1, so a recency of 1
+// bounds the rank from above and one of INFINITY from below
+static double zsql_final_rank(float score, double visits, double recency) {
+  return score - 250000. / (visits + 300) + 250000. / 301 + 500. / recency;
+}
 
-static const char *const fallback_suffix = "/.local/share";
+// whether a row of length, once ranked, could reach rank_floor with the best
+// possible recency
+static int zsql_could_reach(const zsql_query *query, size_t length,
+                            double visits, double rank_floor) {
+  return zsql_final_rank(fuzzy_bound(length, query->length), visits, 1) >=
+         rank_floor;
+}
 
-static const char *const cache_dir = "/zsql";
-static const char *const cache_file = "/zsql.db";
+// raise rank_floor to the least final rank a row with score is sure to have
+static void zsql_raise_floor(double *rank_floor, float score, double visits) {
+  if (score > -INFINITY &&
+      zsql_final_rank(score, visits, INFINITY) > *rank_floor) {
+    *rank_floor = zsql_final_rank(score, visits, INFINITY);
+  }
+}
 
-static zsql_error *zsql_open(sqlite3 **conn) {
+// profiles copied out of sqlite that fuzzy_match couldn't settle, waiting to
+// be ranked together. runes are width bytes each, ascii bytes for an ascii
+// batch and int32_t otherwise
+typedef struct {
+  size_t width;
+  size_t length;
+  int64_t ids[FUZZY_BATCH_SIZE];
+  float thresholds[FUZZY_BATCH_SIZE];
+  double visits[FUZZY_BATCH_SIZE];
+  int64_t visited_seqs[FUZZY_BATCH_SIZE];
+  size_t offsets[FUZZY_BATCH_SIZE];
+  size_t lengths[FUZZY_BATCH_SIZE];
+  uint8_t *runes;
+  uint8_t *bonuses;
+  size_t runes_length;
+  size_t runes_capacity;
+} zsql_batch;
+
+// rank a batch, raising rank_floor with the results unless it's NULL
+static zsql_error *zsql_rank_batch(zsql_batch *batch, zsql_query *query,
+                                   double *rank_floor) {
   zsql_error *err = NULL;
 
-  int using_fallback = 0;
-  const char *base = getenv(env_primary);
-  if (base == NULL) {
-    using_fallback = 1;
-    base = getenv(env_fallback);
-    if (base == NULL) {
-      err = zsql_error_from_errno(err);
+  const uint8_t *haystacks[FUZZY_BATCH_SIZE];
+  const uint8_t *haystack_bonuses[FUZZY_BATCH_SIZE];
+  for (size_t idx = 0; idx < batch->length; ++idx) {
+    haystacks[idx] = batch->runes + batch->offsets[idx] * batch->width;
+    haystack_bonuses[idx] = batch->bonuses + batch->offsets[idx];
+  }
+
+  float scores[FUZZY_BATCH_SIZE];
+  if (batch->width == PROFILE_WIDTH_ASCII) {
+    err = fuzzy_rank_batch_ascii(scores, haystacks, haystack_bonuses,
+                                 batch->lengths, batch->length, query->runes,
+                                 query->length, batch->thresholds);
+  } else {
+    const int32_t *runes[FUZZY_BATCH_SIZE];
+    for (size_t idx = 0; idx < batch->length; ++idx) {
+      runes[idx] = (const int32_t *)haystacks[idx];
+    }
+    err = fuzzy_rank_batch(scores, runes, haystack_bonuses, batch->lengths,
+                           batch->length, query->runes, query->length,
+                           batch->thresholds);
+  }
+  if (err != NULL) {
+    goto exit;
+  }
+
+  for (size_t idx = 0; idx < batch->length; ++idx) {
+    if ((err = zsql_push_score(query, batch->ids[idx], scores[idx],
+                               batch->visited_seqs[idx],
+                               batch->visits[idx])) != NULL) {
       goto exit;
     }
+    if (rank_floor != NULL) {
+      zsql_raise_floor(rank_floor, scores[idx], batch->visits[idx]);
+    }
   }
 
-  const size_t base_length = strlen(base);
-  const size_t fallback_suffix_length = strlen(fallback_suffix);
-  const size_t cache_dir_length = strlen(cache_dir);
-  const size_t cache_file_length = strlen(cache_file);
-  const size_t path_length = base_length +
-                             (using_fallback ? fallback_suffix_length : 0) +
-                             cache_dir_length + cache_file_length + 1;
-  char *path = malloc(path_length);
-  if (path == NULL) {
+  batch->length = 0;
+  batch->runes_length = 0;
+
+exit:
+  return err;
+}
+
+static zsql_error *zsql_batch_init(zsql_batch *batch, size_t width) {
+  zsql_error *err = NULL;
+
+  batch->width = width;
+  batch->length = 0;
+  batch->runes_length = 0;
+  batch->runes_capacity = 1024;
+  batch->runes = malloc(batch->runes_capacity * width);
+  if (batch->runes == NULL) {
     err = zsql_error_from_errno(err);
     goto exit;
   }
-  size_t offset = 0;
+  batch->bonuses = malloc(batch->runes_capacity * sizeof(*batch->bonuses));
+  if (batch->bonuses == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_runes;
+  }
 
-  memcpy(path + offset, base, base_length);
-  offset += base_length;
+  if (0) { // error path only
+  cleanup_runes:
+    free(batch->runes);
+  }
+exit:
+  return err;
+}
 
-  if (using_fallback) {
-    memcpy(path + offset, fallback_suffix, fallback_suffix_length);
+static void zsql_batch_free(zsql_batch *batch) {
+  free(batch->bonuses);
+  free(batch->runes);
+}
 
-    // forcing an unroll here if the compiler supports it. always generates
-    // better code, since iterating and checking the condition is pure overhead
-    // for the low number of times this will be true, and whether it's true
-    // can be statically determined
-#pragma unroll
-    for (size_t slash_idx = 1; slash_idx < fallback_suffix_length;
-         ++slash_idx) {
-      if (fallback_suffix[slash_idx] == '/') {
-        path[offset + slash_idx] = 0;
-        if ((err = zsql_ensure_dir(path)) != NULL) {
-          goto cleanup_path;
+// make room for length more runes at the end of batch
+static zsql_error *zsql_batch_reserve(zsql_batch *batch, size_t length) {
+  zsql_error *err = NULL;
+
+  if (batch->runes_length + length <= batch->runes_capacity) {
+    goto exit;
+  }
+  size_t capacity = batch->runes_capacity * 2;
+  while (batch->runes_length + length > capacity) {
+    capacity *= 2;
+  }
+
+  void *allocation = realloc(batch->runes, capacity * batch->width);
+  if (allocation == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  batch->runes = allocation;
+  allocation = realloc(batch->bonuses, capacity * sizeof(*batch->bonuses));
+  if (allocation == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  batch->bonuses = allocation;
+  batch->runes_capacity = capacity;
+
+exit:
+  return err;
+}
+
+// the state of scoring a query's candidates, fed to it a row at a time.
+//
+// when only the best match is wanted, the search is branch and bound against
+// rank_floor, the least final rank some ranked row is sure to have, starting
+// from the one the query was already sure of. a row whose bound can't reach it
+// is never ranked, and ranking gives up on a batch as soon as none of its rows
+// can. those rows are left with a score of -INFINITY, which leaves zsql_rank
+// the same winner as ranking every row
+typedef struct {
+  zsql_query *query;
+  int best_only;
+  // an ascii query, matched and ranked against ascii profiles without
+  // widening them
+  uint8_t *needle_ascii;
+  double rank_floor;
+  zsql_batch batch;
+  zsql_batch ascii_batch;
+} zsql_scorer;
+
+static zsql_error *zsql_scorer_init(zsql_scorer *scorer, zsql_query *query,
+                                    int best_only) {
+  zsql_error *err = NULL;
+
+  query->scores_length = 0;
+
+  scorer->query = query;
+  scorer->best_only = best_only;
+  scorer->needle_ascii = NULL;
+  scorer->rank_floor = query->rank_floor;
+
+  if (query->length > 0) {
+    int32_t high_runes = 0;
+    for (size_t idx = 0; idx < query->length; ++idx) {
+      high_runes |= query->runes[idx] & ~0x7f;
+    }
+    if (high_runes == 0) {
+      scorer->needle_ascii = malloc(query->length);
+      if (scorer->needle_ascii == NULL) {
+        err = zsql_error_from_errno(err);
+        goto exit;
+      }
+      for (size_t idx = 0; idx < query->length; ++idx) {
+        scorer->needle_ascii[idx] = (uint8_t)query->runes[idx];
+      }
+    }
+  }
+
+  if ((err = zsql_batch_init(&scorer->batch, sizeof(int32_t))) != NULL) {
+    goto cleanup_needle_ascii;
+  }
+  if ((err = zsql_batch_init(&scorer->ascii_batch, PROFILE_WIDTH_ASCII)) !=
+      NULL) {
+    goto cleanup_batch;
+  }
+
+  if (0) { // error path only
+  cleanup_batch:
+    zsql_batch_free(&scorer->batch);
+  cleanup_needle_ascii:
+    free(scorer->needle_ascii);
+  }
+exit:
+  return err;
+}
+
+static void zsql_scorer_free(zsql_scorer *scorer) {
+  zsql_batch_free(&scorer->ascii_batch);
+  zsql_batch_free(&scorer->batch);
+  free(scorer->needle_ascii);
+}
+
+static zsql_error *zsql_scorer_push(zsql_scorer *scorer, int64_t id,
+                                    const uint8_t *profile,
+                                    size_t profile_length, double visits,
+                                    int64_t visited_seq) {
+  zsql_error *err = NULL;
+
+  zsql_query *query = scorer->query;
+  const int best_only = scorer->best_only;
+
+  size_t width;
+  size_t length;
+  if (profile_parse(profile, profile_length, &width, &length) != 0) {
+    err = zsql_error_from_text("malformed profile", err);
+    goto exit;
+  }
+
+  // most rows are settled here, without ever being ranked
+  float score;
+  int unsettled;
+  int hopeless = 0;
+  const int ascii =
+      width == PROFILE_WIDTH_ASCII && scorer->needle_ascii != NULL;
+  zsql_batch *batch = ascii ? &scorer->ascii_batch : &scorer->batch;
+  if (ascii) {
+    unsettled = fuzzy_match_ascii(&score, profile, length, scorer->needle_ascii,
+                                  query->length);
+    hopeless = unsettled && best_only &&
+               !zsql_could_reach(query, length, visits, scorer->rank_floor);
+  }
+
+  // hopeless ascii rows are never even copied out
+  if (!ascii || (unsettled && !hopeless)) {
+    if ((err = zsql_batch_reserve(batch, length)) != NULL) {
+      goto exit;
+    }
+
+    // copy out the runes, since sqlite makes no promises about blob
+    // alignment or lifetime past the next step. ascii runes are only widened
+    // for an ascii profile that the query isn't ascii enough to rank as bytes
+    int32_t *runes = (int32_t *)batch->runes;
+    if (ascii) {
+      memcpy(batch->runes + batch->runes_length, profile, length);
+    } else if (width == PROFILE_WIDTH_ASCII) {
+      runes += batch->runes_length;
+      for (size_t idx = 0; idx < length; ++idx) {
+        runes[idx] = profile[idx];
+      }
+    } else if (length > 0) {
+      runes += batch->runes_length;
+      memcpy(runes, profile, length * sizeof(*runes));
+    }
+    if (length > 0) {
+      memcpy(batch->bonuses + batch->runes_length, profile + length * width,
+             length * sizeof(*batch->bonuses));
+    }
+
+    // runes of rows settled here are simply overwritten by the next row's
+    if (!ascii) {
+      unsettled =
+          fuzzy_match(&score, runes, length, query->runes, query->length);
+      hopeless = unsettled && best_only &&
+                 !zsql_could_reach(query, length, visits, scorer->rank_floor);
+    }
+  }
+
+  if (!unsettled || hopeless) {
+    // hopeless rows match, so they need a place among the scores for their
+    // recency even though they're never ranked
+    if (hopeless) {
+      ++zsql_stats.pruned;
+      score = -INFINITY;
+    } else {
+      ++zsql_stats.settled;
+    }
+    if (score > -INFINITY || hopeless) {
+      if ((err = zsql_push_score(query, id, score, visited_seq, visits)) !=
+          NULL) {
+        goto exit;
+      }
+    }
+    if (best_only) {
+      zsql_raise_floor(&scorer->rank_floor, score, visits);
+    }
+    goto exit;
+  }
+
+  batch->ids[batch->length] = id;
+  // the least score that could still reach rank_floor, less a unit of slack
+  // so that rounding never gives up on a row that ties it
+  batch->thresholds[batch->length] =
+      best_only ? (float)(scorer->rank_floor -
+                          zsql_final_rank(0.f, visits, 1) - 1.)
+                : -INFINITY;
+  batch->visits[batch->length] = visits;
+  batch->visited_seqs[batch->length] = visited_seq;
+  batch->offsets[batch->length] = batch->runes_length;
+  batch->lengths[batch->length] = length;
+  batch->runes_length += length;
+  ++batch->length;
+
+  if (batch->length == FUZZY_BATCH_SIZE) {
+    if ((err = zsql_rank_batch(batch, query,
+                               best_only ? &scorer->rank_floor : NULL)) !=
+        NULL) {
+      goto exit;
+    }
+  }
+
+exit:
+  return err;
+}
+
+// rank whatever is left batched
+static zsql_error *zsql_scorer_finish(zsql_scorer *scorer) {
+  zsql_error *err = NULL;
+
+  double *rank_floor = scorer->best_only ? &scorer->rank_floor : NULL;
+  if (scorer->batch.length > 0 &&
+      (err = zsql_rank_batch(&scorer->batch, scorer->query, rank_floor)) !=
+          NULL) {
+    goto exit;
+  }
+  if (scorer->ascii_batch.length > 0 &&
+      (err = zsql_rank_batch(&scorer->ascii_batch, scorer->query,
+                             rank_floor)) != NULL) {
+    goto exit;
+  }
+
+exit:
+  return err;
+}
+
+void zsql_index_free(zsql_index *index) {
+  if (index->map != NULL) {
+    munmap(index->map, index->map_length);
+    return;
+  }
+  free(index->profiles);
+  free(index->profile_offsets);
+  free(index->signatures);
+  free(index->visited_seqs);
+  free(index->visits);
+  free(index->ids);
+}
+
+zsql_error *zsql_index_read_aging(sqlite3 *conn, double *scale,
+                                  int64_t *generation) {
+  zsql_error *err = NULL;
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(conn, "SELECT scale,generation FROM aging",
+                                 &stmt)) != NULL) {
+    goto exit;
+  }
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  *scale = sqlite3_column_double(stmt, 0);
+  *generation = sqlite3_column_int64(stmt, 1);
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+static zsql_error *zsql_index_read_data_version(sqlite3 *conn,
+                                                int64_t *data_version) {
+  zsql_error *err = NULL;
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(conn, "PRAGMA data_version", &stmt)) !=
+      NULL) {
+    goto exit;
+  }
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  *data_version = sqlite3_column_int64(stmt, 0);
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// make room for one more dir, and for profiles_length bytes of profiles
+static zsql_error *zsql_index_grow(zsql_index *index, size_t profiles_length) {
+  if (index->length >= index->capacity) {
+    const size_t capacity = index->capacity == 0 ? 1024 : index->capacity * 2;
+    void *allocation;
+
+    if ((allocation = realloc(index->ids, capacity * sizeof(*index->ids))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->ids = allocation;
+    if ((allocation = realloc(index->visits,
+                              capacity * sizeof(*index->visits))) == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->visits = allocation;
+    if ((allocation = realloc(index->visited_seqs,
+                              capacity * sizeof(*index->visited_seqs))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->visited_seqs = allocation;
+    if ((allocation = realloc(index->signatures,
+                              capacity * sizeof(*index->signatures))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->signatures = allocation;
+    if ((allocation =
+             realloc(index->profile_offsets,
+                     (2 * capacity + 1) * sizeof(*index->profile_offsets))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->profile_offsets = allocation;
+
+    index->capacity = capacity;
+  }
+
+  if (profiles_length > index->profiles_capacity) {
+    size_t capacity = index->profiles_capacity == 0
+                          ? 64 * 1024
+                          : index->profiles_capacity * 2;
+    while (profiles_length > capacity) {
+      capacity *= 2;
+    }
+    void *allocation = realloc(index->profiles, capacity);
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    index->profiles = allocation;
+    index->profiles_capacity = capacity;
+  }
+
+  return NULL;
+}
+
+// append a dir, given its profile and folded profile
+static zsql_error *zsql_index_push(zsql_index *index, int64_t id, double visits,
+                                   int64_t visited_seq, uint64_t signature,
+                                   const uint8_t *const profiles[2],
+                                   const size_t lengths[2]) {
+  zsql_error *err = NULL;
+
+  const size_t profiles_length =
+      index->profiles_length + lengths[0] + lengths[1];
+  if (index->length >= index->capacity ||
+      profiles_length > index->profiles_capacity) {
+    if (index->map != NULL) {
+      err = zsql_error_from_text("snapshot is full", err);
+      goto exit;
+    }
+    if ((err = zsql_index_grow(index, profiles_length)) != NULL) {
+      goto exit;
+    }
+  }
+
+  const size_t idx = index->length;
+  index->ids[idx] = id;
+  index->visits[idx] = visits;
+  index->visited_seqs[idx] = visited_seq;
+  index->signatures[idx] = signature;
+
+  uint64_t *offsets = index->profile_offsets + 2 * idx;
+  offsets[0] = index->profiles_length;
+  for (int folded = 0; folded < 2; ++folded) {
+    if (lengths[folded] > 0) {
+      memcpy(index->profiles + index->profiles_length, profiles[folded],
+             lengths[folded]);
+    }
+    index->profiles_length += lengths[folded];
+    offsets[1 + folded] = index->profiles_length;
+  }
+
+  ++index->length;
+exit:
+  return err;
+}
+
+// the components of dirs, each adding a slash and a name to the path of its
+// parent, or for the first of a dir, what comes before its first slash. a
+// dir's profile is the profiles of its components one after another, so dirs
+// sharing a prefix share the components normalizing it, and putting a dir's
+// profile together takes no unicode processing at all
+typedef struct {
+  // ordered by id, which puts every parent ahead of its children
+  int64_t *ids;
+  // where each parent lies, or SIZE_MAX for the first component of a dir
+  size_t *parents;
+  // of the profile and folded profile together
+  uint64_t *signatures;
+  // laid out as in zsql_index
+  uint64_t *profile_offsets;
+  size_t length;
+  size_t capacity;
+  uint8_t *profiles;
+  size_t profiles_length;
+  size_t profiles_capacity;
+} zsql_tree;
+
+static void zsql_tree_free(zsql_tree *tree) {
+  free(tree->profiles);
+  free(tree->profile_offsets);
+  free(tree->signatures);
+  free(tree->parents);
+  free(tree->ids);
+}
+
+// make room for one more component, and for profiles_length bytes of profiles
+static zsql_error *zsql_tree_grow(zsql_tree *tree, size_t profiles_length) {
+  if (tree->length >= tree->capacity) {
+    const size_t capacity = tree->capacity == 0 ? 1024 : tree->capacity * 2;
+    void *allocation;
+
+    if ((allocation = realloc(tree->ids, capacity * sizeof(*tree->ids))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    tree->ids = allocation;
+    if ((allocation = realloc(tree->parents,
+                              capacity * sizeof(*tree->parents))) == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    tree->parents = allocation;
+    if ((allocation = realloc(tree->signatures,
+                              capacity * sizeof(*tree->signatures))) == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    tree->signatures = allocation;
+    if ((allocation =
+             realloc(tree->profile_offsets,
+                     (2 * capacity + 1) * sizeof(*tree->profile_offsets))) ==
+        NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    tree->profile_offsets = allocation;
+
+    tree->capacity = capacity;
+  }
+
+  if (profiles_length > tree->profiles_capacity) {
+    size_t capacity =
+        tree->profiles_capacity == 0 ? 64 * 1024 : tree->profiles_capacity * 2;
+    while (profiles_length > capacity) {
+      capacity *= 2;
+    }
+    void *allocation = realloc(tree->profiles, capacity);
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    tree->profiles = allocation;
+    tree->profiles_capacity = capacity;
+  }
+
+  return NULL;
+}
+
+// where the component with id lies in the tree, or its length if it isn't there
+static size_t zsql_tree_find(const zsql_tree *tree, int64_t id) {
+  size_t low = 0;
+  size_t high = tree->length;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (tree->ids[mid] < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low < tree->length && tree->ids[low] == id ? low : tree->length;
+}
+
+// load the components stmt steps through, selected as
+// id,parent_id,signature,profile,IFNULL(folded_profile,profile) and ordered by
+// id
+static zsql_error *zsql_tree_load(sqlite3 *conn, zsql_tree *tree,
+                                  sqlite3_stmt *stmt) {
+  zsql_error *err = NULL;
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const size_t lengths[2] = {(size_t)sqlite3_column_bytes(stmt, 3),
+                               (size_t)sqlite3_column_bytes(stmt, 4)};
+    const size_t profiles_length =
+        tree->profiles_length + lengths[0] + lengths[1];
+    if ((err = zsql_tree_grow(tree, profiles_length)) != NULL) {
+      goto exit;
+    }
+
+    const size_t idx = tree->length;
+    const int64_t parent_id = sqlite3_column_int64(stmt, 1);
+    tree->ids[idx] = sqlite3_column_int64(stmt, 0);
+    tree->parents[idx] = SIZE_MAX;
+    if (parent_id != 0 &&
+        (tree->parents[idx] = zsql_tree_find(tree, parent_id)) == idx) {
+      err = zsql_error_from_text("component missing its parent", err);
+      goto exit;
+    }
+    tree->signatures[idx] = (uint64_t)sqlite3_column_int64(stmt, 2);
+
+    uint64_t *offsets = tree->profile_offsets + 2 * idx;
+    offsets[0] = tree->profiles_length;
+    for (int folded = 0; folded < 2; ++folded) {
+      if (lengths[folded] > 0) {
+        memcpy(tree->profiles + tree->profiles_length,
+               sqlite3_column_blob(stmt, 3 + folded), lengths[folded]);
+      }
+      tree->profiles_length += lengths[folded];
+      offsets[1 + folded] = tree->profiles_length;
+    }
+
+    ++tree->length;
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto exit;
+  }
+
+exit:
+  return err;
+}
+
+// load every component of the dir whose last component has component_id
+static zsql_error *zsql_tree_load_dir(sqlite3 *conn, zsql_tree *tree,
+                                      int64_t component_id) {
+  zsql_error *err = NULL;
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "WITH RECURSIVE chain(id)AS(VALUES(?1)UNION ALL "
+           "SELECT parent_id FROM components JOIN chain USING(id)"
+           "WHERE parent_id<>0)"
+           "SELECT id,parent_id,signature,profile,"
+           "IFNULL(folded_profile,profile)FROM components "
+           "WHERE id IN chain ORDER BY id",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, component_id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  err = zsql_tree_load(conn, tree, stmt);
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// the signature of the dir whose last component lies at at
+static uint64_t zsql_tree_signature(const zsql_tree *tree, size_t at) {
+  uint64_t signature = 0;
+  for (; at != SIZE_MAX; at = tree->parents[at]) {
+    signature |= tree->signatures[at];
+  }
+  return signature;
+}
+
+// put together the profile of the dir whose last component lies at at, or its
+// folded profile, in buffer. the runes are as wide as the widest component's,
+// and filled in from the last component back
+static zsql_error *zsql_tree_profile(const zsql_tree *tree, size_t at,
+                                     int folded, uint8_t **buffer,
+                                     size_t *buffer_capacity,
+                                     size_t *profile_length) {
+  size_t runes_length = 0;
+  size_t width = PROFILE_WIDTH_ASCII;
+  for (size_t idx = at; idx != SIZE_MAX; idx = tree->parents[idx]) {
+    const uint64_t *offsets = tree->profile_offsets + 2 * idx + folded;
+    size_t component_width;
+    size_t component_runes_length;
+    if (profile_parse(tree->profiles + offsets[0],
+                      (size_t)(offsets[1] - offsets[0]), &component_width,
+                      &component_runes_length) != 0) {
+      return zsql_error_from_text("malformed profile", NULL);
+    }
+    runes_length += component_runes_length;
+    if (component_width > width) {
+      width = component_width;
+    }
+  }
+
+  *profile_length = runes_length * (width + 1) + 1;
+  if (*profile_length > *buffer_capacity) {
+    void *allocation = realloc(*buffer, *profile_length);
+    if (allocation == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    *buffer = allocation;
+    *buffer_capacity = *profile_length;
+  }
+
+  uint8_t *profile = *buffer;
+  size_t end = runes_length;
+  for (size_t idx = at; idx != SIZE_MAX; idx = tree->parents[idx]) {
+    const uint64_t *offsets = tree->profile_offsets + 2 * idx + folded;
+    const uint8_t *component = tree->profiles + offsets[0];
+    const size_t component_length = (size_t)(offsets[1] - offsets[0]);
+    const size_t component_width = component[component_length - 1];
+    const size_t length = (component_length - 1) / (component_width + 1);
+    const size_t begin = end - length;
+
+    if (component_width == width) {
+      memcpy(profile + begin * width, component, length * width);
+    } else {
+      for (size_t rune_idx = 0; rune_idx < length; ++rune_idx) {
+        const int32_t rune = component[rune_idx];
+        memcpy(profile + (begin + rune_idx) * width, &rune, sizeof(rune));
+      }
+    }
+    memcpy(profile + runes_length * width + begin,
+           component + length * component_width, length);
+    end = begin;
+  }
+  profile[*profile_length - 1] = (uint8_t)width;
+
+  return NULL;
+}
+
+// append the dir with id whose last component lies at at in tree, putting its
+// profiles together in buffers
+static zsql_error *zsql_index_push_tree(zsql_index *index, int64_t id,
+                                        double visits, int64_t visited_seq,
+                                        const zsql_tree *tree, size_t at,
+                                        uint8_t *buffers[2],
+                                        size_t buffer_capacities[2]) {
+  zsql_error *err = NULL;
+
+  size_t lengths[2];
+  for (int folded = 0; folded < 2; ++folded) {
+    if ((err = zsql_tree_profile(tree, at, folded, &buffers[folded],
+                                 &buffer_capacities[folded],
+                                 &lengths[folded])) != NULL) {
+      goto exit;
+    }
+  }
+
+  const uint8_t *const profiles[2] = {buffers[0], buffers[1]};
+  err = zsql_index_push(index, id, visits, visited_seq,
+                        zsql_tree_signature(tree, at), profiles, lengths);
+
+exit:
+  return err;
+}
+
+// where the dir with id lies in the index, or its length if it isn't there
+size_t zsql_index_find(const zsql_index *index, int64_t id) {
+  size_t low = 0;
+  size_t high = index->length;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (index->ids[mid] < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low < index->length && index->ids[low] == id ? low : index->length;
+}
+
+// the id of the component dir ends with, found by following its components
+// down from the first, or 0 if it was never added. with add, any it's missing
+// are added on the way, each profiled following the one before it
+static zsql_error *zsql_component_of(sqlite3 *conn, const char *dir,
+                                     size_t length, int add, int64_t *id) {
+  zsql_error *err = NULL;
+
+  *id = 0;
+
+  sqlite3_stmt *select_stmt;
+  if ((err = sqlh_prepare_static(
+           conn, "SELECT id FROM components WHERE parent_id=?1 AND name=?2",
+           &select_stmt)) != NULL) {
+    goto exit;
+  }
+
+  sqlite3_stmt *insert_stmt = NULL;
+  if (add && (err = sqlh_prepare_static(
+                  conn,
+                  "INSERT INTO components(parent_id,signature,name,profile,"
+                  "folded_profile,basename)"
+                  "VALUES(?1,signature(profile(?2,0,?3))|"
+                  "signature(profile(?2,1,?3)),?2,profile(?2,0,?3),"
+                  "NULLIF(profile(?2,1,?3),profile(?2,0,?3)),"
+                  "basename(profile(?2,1,?3)))",
+                  &insert_stmt)) != NULL) {
+    goto cleanup_select;
+  }
+
+  int64_t parent_id = 0;
+  size_t context_begin = 0;
+  size_t begin = 0;
+  for (int first = 1; first || begin < length; first = 0) {
+    // every component past the first starts at its slash
+    const char *slash = memchr(dir + begin + !first, '/',
+                               length - begin - !first);
+    const size_t end = slash != NULL ? (size_t)(slash - dir) : length;
+
+    if (sqlite3_bind_int64(select_stmt, 1, parent_id) != SQLITE_OK ||
+        sqlite3_bind_blob(select_stmt, 2, dir + begin, end - begin,
+                          SQLITE_STATIC) != SQLITE_OK) {
+      err = zsql_error_from_sqlite(conn, err);
+      goto cleanup_insert;
+    }
+    const int status = sqlite3_step(select_stmt);
+    if (status == SQLITE_ROW) {
+      parent_id = sqlite3_column_int64(select_stmt, 0);
+    } else if (status != SQLITE_DONE) {
+      err = zsql_error_from_sqlite(conn, err);
+      goto cleanup_insert;
+    } else if (!add) {
+      goto cleanup_insert;
+    } else {
+      if (sqlite3_bind_int64(insert_stmt, 1, parent_id) != SQLITE_OK ||
+          sqlite3_bind_blob(insert_stmt, 2, dir + begin, end - begin,
+                            SQLITE_STATIC) != SQLITE_OK ||
+          sqlite3_bind_blob(insert_stmt, 3, dir + context_begin,
+                            begin - context_begin,
+                            SQLITE_STATIC) != SQLITE_OK ||
+          sqlite3_step(insert_stmt) != SQLITE_DONE ||
+          sqlite3_reset(insert_stmt) != SQLITE_OK) {
+        err = zsql_error_from_sqlite(conn, err);
+        goto cleanup_insert;
+      }
+      parent_id = sqlite3_last_insert_rowid(conn);
+    }
+    if (sqlite3_reset(select_stmt) != SQLITE_OK) {
+      err = zsql_error_from_sqlite(conn, err);
+      goto cleanup_insert;
+    }
+
+    context_begin = begin;
+    begin = end;
+  }
+  *id = parent_id;
+
+cleanup_insert:
+  if (insert_stmt != NULL) {
+    err = sqlh_finalize(insert_stmt, err);
+  }
+cleanup_select:
+  err = sqlh_finalize(select_stmt, err);
+exit:
+  return err;
+}
+
+// prepare stmt to read back the dir with id ?1, a row for each of its
+// components from the first
+static zsql_error *zsql_prepare_dir(sqlite3 *conn, sqlite3_stmt **stmt) {
+  return sqlh_prepare_static(
+      conn,
+      "WITH RECURSIVE chain(id)AS("
+      "SELECT component_id FROM dirs WHERE id=?1 UNION ALL "
+      "SELECT parent_id FROM components JOIN chain USING(id)"
+      "WHERE parent_id<>0)"
+      "SELECT name FROM components WHERE id IN chain ORDER BY id",
+      stmt);
+}
+
+// the dir with id, read through stmt as prepared by zsql_prepare_dir, into a
+// new allocation. a dir that's gone leaves it NULL
+static zsql_error *zsql_read_dir(sqlite3 *conn, sqlite3_stmt *stmt, int64_t id,
+                                 char **dir, size_t *length) {
+  zsql_error *err = NULL;
+
+  *dir = NULL;
+  *length = 0;
+
+  if (sqlite3_bind_int64(stmt, 1, id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto exit;
+  }
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const size_t name_length = (size_t)sqlite3_column_bytes(stmt, 0);
+    // one past, so that an empty dir still gets an allocation
+    void *allocation = realloc(*dir, *length + name_length + 1);
+    if (allocation == NULL) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_dir;
+    }
+    *dir = allocation;
+    if (name_length > 0) {
+      memcpy(*dir + *length, sqlite3_column_blob(stmt, 0), name_length);
+    }
+    *length += name_length;
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_dir;
+  }
+
+  if (0) { // error path only
+  cleanup_dir:
+    free(*dir);
+    *dir = NULL;
+    *length = 0;
+  }
+  if (sqlite3_reset(stmt) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+  }
+exit:
+  return err;
+}
+
+// reload the index if it's stale or another connection has written since it
+// was loaded. a mapped index is reloaded onto the heap
+zsql_error *zsql_index_refresh(sqlite3 *conn, zsql_index *index) {
+  zsql_error *err = NULL;
+
+  // read first, so that a write landing during the load is caught next time
+  int64_t data_version = 0;
+  if ((err = zsql_index_read_data_version(conn, &data_version)) != NULL) {
+    goto exit;
+  }
+  if (!index->stale && data_version == index->data_version) {
+    goto exit;
+  }
+
+  if (index->map != NULL) {
+    zsql_index_free(index);
+    *index = (zsql_index){.stale = 1};
+  }
+  index->stale = 1;
+  index->length = 0;
+  index->profiles_length = 0;
+
+  // read all at once, so that the generation matches the dirs
+  if ((err = sqlh_exec_static(conn, "SAVEPOINT zsql_index_refresh")) != NULL) {
+    goto exit;
+  }
+
+  if ((err = zsql_index_read_aging(conn, &index->scale, &index->generation)) !=
+      NULL) {
+    goto release;
+  }
+
+  // every component is loaded first, and each dir's profiles put together
+  // from its own
+  zsql_tree tree = {0};
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "SELECT id,parent_id,signature,profile,"
+           "IFNULL(folded_profile,profile)FROM components ORDER BY id",
+           &stmt)) != NULL) {
+    goto release;
+  }
+  err = zsql_tree_load(conn, &tree, stmt);
+  if ((err = sqlh_finalize(stmt, err)) != NULL) {
+    goto cleanup_tree;
+  }
+
+  if ((err = sqlh_prepare_static(conn,
+                                 "SELECT id,visits,visited_seq,component_id "
+                                 "FROM dirs ORDER BY id",
+                                 &stmt)) != NULL) {
+    goto cleanup_tree;
+  }
+
+  uint8_t *buffers[2] = {NULL, NULL};
+  size_t buffer_capacities[2] = {0, 0};
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const size_t at = zsql_tree_find(&tree, sqlite3_column_int64(stmt, 3));
+    if (at == tree.length) {
+      err = zsql_error_from_text("dir missing its components", err);
+      goto cleanup_buffers;
+    }
+    if ((err = zsql_index_push_tree(
+             index, sqlite3_column_int64(stmt, 0),
+             sqlite3_column_double(stmt, 1), sqlite3_column_int64(stmt, 2),
+             &tree, at, buffers, buffer_capacities)) != NULL) {
+      goto cleanup_buffers;
+    }
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_buffers;
+  }
+
+  index->data_version = data_version;
+  index->stale = 0;
+
+cleanup_buffers:
+  free(buffers[1]);
+  free(buffers[0]);
+  err = sqlh_finalize(stmt, err);
+cleanup_tree:
+  zsql_tree_free(&tree);
+release:
+  // nothing was written, so the savepoint is released either way
+  if (err == NULL) {
+    err = sqlh_exec_static(conn, "RELEASE zsql_index_refresh");
+  } else if (sqlh_exec_static(conn, "RELEASE zsql_index_refresh") != NULL) {
+    // fixme: nothing sensible to do about a failed release
+  }
+exit:
+  return err;
+}
+
+// catch the index up with a visit to dir by this connection. a visit that aged
+// every dir, possibly forgetting some, leaves it stale
+zsql_error *zsql_index_visit(sqlite3 *conn, zsql_index *index,
+                             const char *dir, size_t length) {
+  zsql_error *err = NULL;
+
+  if (index->stale) {
+    goto exit;
+  }
+
+  double scale;
+  int64_t generation;
+  if ((err = zsql_index_read_aging(conn, &scale, &generation)) != NULL) {
+    goto exit;
+  }
+  if (scale != index->scale) {
+    index->stale = 1;
+    goto exit;
+  }
+
+  int64_t component_id;
+  if ((err = zsql_component_of(conn, dir, length, 0, &component_id)) != NULL) {
+    goto exit;
+  }
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn, "SELECT id,visits,visited_seq FROM dirs WHERE component_id=?1",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, component_id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  int status = sqlite3_step(stmt);
+  if (status == SQLITE_DONE) {
+    index->stale = 1;
+    goto cleanup_stmt;
+  } else if (status != SQLITE_ROW) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  // new dirs take an id past every other
+  const int64_t id = sqlite3_column_int64(stmt, 0);
+  const size_t idx = zsql_index_find(index, id);
+  if (idx < index->length) {
+    index->visits[idx] = sqlite3_column_double(stmt, 1);
+    index->visited_seqs[idx] = sqlite3_column_int64(stmt, 2);
+  } else if (index->length == 0 || index->ids[index->length - 1] < id) {
+    zsql_tree tree = {0};
+    uint8_t *buffers[2] = {NULL, NULL};
+    size_t buffer_capacities[2] = {0, 0};
+    size_t at;
+    if ((err = zsql_tree_load_dir(conn, &tree, component_id)) == NULL &&
+        (at = zsql_tree_find(&tree, component_id)) == tree.length) {
+      err = zsql_error_from_text("dir missing its components", err);
+    }
+    if (err == NULL) {
+      err = zsql_index_push_tree(index, id, sqlite3_column_double(stmt, 1),
+                                 sqlite3_column_int64(stmt, 2), &tree, at,
+                                 buffers, buffer_capacities);
+    }
+    free(buffers[1]);
+    free(buffers[0]);
+    zsql_tree_free(&tree);
+    if (err != NULL) {
+      index->stale = 1;
+      goto cleanup_stmt;
+    }
+  } else {
+    index->stale = 1;
+  }
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// score the entries of index from begin up to end, or the query's candidates
+// from begin up to end if it has any
+static zsql_error *zsql_score_index(const zsql_index *index,
+                                    zsql_scorer *scorer, size_t begin,
+                                    size_t end) {
+  zsql_error *err = NULL;
+
+  const zsql_query *query = scorer->query;
+  const int folded = (query->utf8proc_options & UTF8PROC_CASEFOLD) != 0;
+  uint64_t lap = zsql_clock();
+  size_t idx;
+  for (idx = begin; idx < end; ++idx) {
+    const size_t at =
+        query->candidates != NULL ? query->candidates[idx] : idx;
+    if ((index->signatures[at] & query->signature) != query->signature) {
+      ++zsql_stats.rejected;
+      continue;
+    }
+    zsql_phase_lap(ZSQL_PHASE_SCAN, &lap);
+    const uint64_t *offsets = index->profile_offsets + 2 * at + folded;
+    err = zsql_scorer_push(
+        scorer, index->ids[at], index->profiles + offsets[0],
+        (size_t)(offsets[1] - offsets[0]), index->visits[at] * index->scale,
+        index->visited_seqs[at]);
+    zsql_phase_lap(ZSQL_PHASE_SCORE, &lap);
+    if (err != NULL) {
+      break;
+    }
+  }
+  zsql_phase_lap(ZSQL_PHASE_SCAN, &lap);
+  zsql_stats.scanned += idx - begin;
+
+  return err;
+}
+
+// the ids of the rows of dirs lie from begin up to end
+static zsql_error *zsql_read_ids(sqlite3 *conn, int64_t *begin, int64_t *end) {
+  zsql_error *err = NULL;
+
+  // apart, each of MIN and MAX is a single seek on the primary key. together,
+  // sqlite scans the whole table for them
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(conn,
+                                 "SELECT IFNULL((SELECT MIN(id)FROM dirs),0),"
+                                 "IFNULL((SELECT MAX(id)FROM dirs)+1,0)",
+                                 &stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  *begin = sqlite3_column_int64(stmt, 0);
+  *end = sqlite3_column_int64(stmt, 1);
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// score the rows of dirs with ids from begin up to end, putting each one's
+// profile together from the components of the dirs in range, loaded once
+static zsql_error *zsql_score_rows(sqlite3 *conn, zsql_scorer *scorer,
+                                   int64_t begin, int64_t end) {
+  zsql_error *err = NULL;
+
+  const zsql_query *query = scorer->query;
+  const int folded = (query->utf8proc_options & UTF8PROC_CASEFOLD) != 0;
+  uint64_t lap = zsql_clock();
+  zsql_tree tree = {0};
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "WITH RECURSIVE chain(id)AS("
+           "SELECT component_id FROM dirs WHERE id>=?1 AND id<?2 UNION "
+           "SELECT parent_id FROM components JOIN chain USING(id)"
+           "WHERE parent_id<>0)"
+           "SELECT id,parent_id,signature,profile,"
+           "IFNULL(folded_profile,profile)FROM components "
+           "WHERE id IN chain ORDER BY id",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+  if (sqlite3_bind_int64(stmt, 1, begin) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, end) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+  } else {
+    err = zsql_tree_load(conn, &tree, stmt);
+  }
+  if ((err = sqlh_finalize(stmt, err)) != NULL) {
+    goto cleanup_tree;
+  }
+
+  if ((err = sqlh_prepare_static(
+           conn,
+           "SELECT id,visits*(SELECT scale FROM aging),visited_seq,"
+           "component_id FROM dirs WHERE id>=?1 AND id<?2",
+           &stmt)) != NULL) {
+    goto cleanup_tree;
+  }
+
+  uint8_t *buffer = NULL;
+  size_t buffer_capacity = 0;
+  if (sqlite3_bind_int64(stmt, 1, begin) != SQLITE_OK ||
+      sqlite3_bind_int64(stmt, 2, end) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    ++zsql_stats.scanned;
+    const size_t at = zsql_tree_find(&tree, sqlite3_column_int64(stmt, 3));
+    if (at == tree.length) {
+      err = zsql_error_from_text("dir missing its components", err);
+      goto cleanup_stmt;
+    }
+    if ((zsql_tree_signature(&tree, at) & query->signature) !=
+        query->signature) {
+      ++zsql_stats.rejected;
+      continue;
+    }
+    size_t profile_length;
+    if ((err = zsql_tree_profile(&tree, at, folded, &buffer, &buffer_capacity,
+                                 &profile_length)) != NULL) {
+      goto cleanup_stmt;
+    }
+    zsql_phase_lap(ZSQL_PHASE_SCAN, &lap);
+    err = zsql_scorer_push(scorer, sqlite3_column_int64(stmt, 0), buffer,
+                           profile_length, sqlite3_column_double(stmt, 1),
+                           sqlite3_column_int64(stmt, 2));
+    zsql_phase_lap(ZSQL_PHASE_SCORE, &lap);
+    if (err != NULL) {
+      goto cleanup_stmt;
+    }
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+cleanup_stmt:
+  free(buffer);
+  err = sqlh_finalize(stmt, err);
+cleanup_tree:
+  zsql_tree_free(&tree);
+  zsql_phase_lap(ZSQL_PHASE_SCAN, &lap);
+exit:
+  return err;
+}
+
+// score the candidate dirs from begin up to end, as entries of index when there
+// is one and otherwise as ids of rows in the database
+static zsql_error *zsql_score_range(sqlite3 *conn, const zsql_index *index,
+                                    zsql_query *query, int best_only,
+                                    int64_t begin, int64_t end) {
+  zsql_error *err = NULL;
+
+  zsql_scorer scorer;
+  if ((err = zsql_scorer_init(&scorer, query, best_only)) != NULL) {
+    goto exit;
+  }
+
+  if (index != NULL) {
+    err = zsql_score_index(index, &scorer, (size_t)begin, (size_t)end);
+  } else {
+    err = zsql_score_rows(conn, &scorer, begin, end);
+  }
+  if (err != NULL) {
+    goto cleanup_scorer;
+  }
+
+  const uint64_t started = zsql_clock();
+  if ((err = zsql_scorer_finish(&scorer)) != NULL) {
+    goto cleanup_scorer;
+  }
+  zsql_phase_end(ZSQL_PHASE_SCORE, started);
+
+cleanup_scorer:
+  zsql_scorer_free(&scorer);
+exit:
+  return err;
+}
+
+// workers keep their counts in thread-local storage, so scoring is only split
+// between threads when there's some
+#if HAVE_PTHREAD && defined(HAVE_THREAD_LOCAL)
+#define ZSQL_PARALLEL 1
+#else
+#define ZSQL_PARALLEL 0
+#endif
+
+#if ZSQL_PARALLEL
+// a search is split between threads once each would have at least this many
+// dirs to score. aging keeps databases that are only ever added to well under
+// it, so only imported histories are ever this large
+#define ZSQL_PARALLEL_DIRS 32768
+#define ZSQL_PARALLEL_MAX_THREADS 64
+
+// a share of a search, scored into a copy of the query of its own. without an
+// index, it reads its rows through a connection of its own to the database at
+// path, which may see writes committed since the searching connection began
+// reading. dirs are never given ids below those already taken, so each is still
+// scored at most once
+typedef struct {
+  pthread_t thread;
+  const zsql_index *index;
+  const char *path;
+  int64_t begin;
+  int64_t end;
+  int best_only;
+  zsql_query query;
+  zsql_counts stats;
+  zsql_error *err;
+} zsql_worker;
+
+static zsql_error *zsql_worker_score(zsql_worker *worker) {
+  zsql_error *err = NULL;
+
+  if (worker->index != NULL) {
+    err = zsql_score_range(NULL, worker->index, &worker->query,
+                           worker->best_only, worker->begin, worker->end);
+    goto exit;
+  }
+
+  const uint64_t started = zsql_clock();
+  sqlite3 *conn;
+  if (sqlite3_open_v2(worker->path, &conn,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_sql;
+  }
+  if (sqlite3_busy_handler(conn, zsql_busy, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_sql;
+  }
+  zsql_phase_end(ZSQL_PHASE_OPEN, started);
+
+  err = zsql_score_range(conn, NULL, &worker->query, worker->best_only,
+                         worker->begin, worker->end);
+
+cleanup_sql:
+  sqlite3_close(conn);
+exit:
+  return err;
+}
+
+// add a worker's counts to this thread's own
+static void zsql_stats_add(const zsql_counts *counts) {
+  for (size_t phase = 0; phase < ZSQL_PHASES; ++phase) {
+    zsql_stats.phase_ns[phase] += counts->phase_ns[phase];
+  }
+  zsql_stats.scanned += counts->scanned;
+  zsql_stats.rejected += counts->rejected;
+  zsql_stats.settled += counts->settled;
+  zsql_stats.pruned += counts->pruned;
+  zsql_stats.ranked += counts->ranked;
+  zsql_stats.spilled += counts->spilled;
+  zsql_stats.threads += counts->threads;
+  zsql_stats.lock_waits += counts->lock_waits;
+  zsql_stats.lock_retries += counts->lock_retries;
+  zsql_stats.decays += counts->decays;
+  zsql_stats.narrowed += counts->narrowed;
+  zsql_stats.seeded += counts->seeded;
+  zsql_stats.gone += counts->gone;
+}
+
+static void *zsql_worker_run(void *data) {
+  zsql_worker *worker = data;
+  worker->err = zsql_worker_score(worker);
+  zsql_stats_take_fuzzy();
+  worker->stats = zsql_stats;
+  return NULL;
+}
+
+// how many threads to split length dirs between, 1 meaning they're all scored
+// on this one
+static size_t zsql_parallel_threads(int64_t length) {
+  if (!sqlite3_threadsafe() || length < 2 * ZSQL_PARALLEL_DIRS) {
+    return 1;
+  }
+
+  long threads = THREADS > 0 ? THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > length / ZSQL_PARALLEL_DIRS) {
+    threads = (long)(length / ZSQL_PARALLEL_DIRS);
+  }
+  if (threads > ZSQL_PARALLEL_MAX_THREADS) {
+    threads = ZSQL_PARALLEL_MAX_THREADS;
+  }
+  return threads > 1 ? (size_t)threads : 1;
+}
+
+// score the dirs from begin up to end in even shares, one on this thread and
+// the rest on threads of their own, gathering every share's scores into query.
+// each share bounds its own search, since a final rank one of them is sure of
+// is a floor for all of them
+static zsql_error *zsql_score_parallel(sqlite3 *conn, const zsql_index *index,
+                                       zsql_query *query, int best_only,
+                                       size_t threads, int64_t begin,
+                                       int64_t end) {
+  zsql_error *err = NULL;
+
+  zsql_worker *workers = calloc(threads, sizeof(*workers));
+  if (workers == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+
+  const char *path = index == NULL ? sqlite3_db_filename(conn, "main") : NULL;
+  const int64_t share = (end - begin + (int64_t)threads - 1) / (int64_t)threads;
+  for (size_t idx = 0; idx < threads; ++idx) {
+    zsql_worker *worker = &workers[idx];
+    worker->index = index;
+    worker->path = path;
+    worker->begin = begin + share * (int64_t)idx;
+    worker->end = idx + 1 < threads ? worker->begin + share : end;
+    worker->best_only = best_only;
+    // the query's fields are const, so its copy is made in place
+    memcpy(&worker->query, query, sizeof(*query));
+    worker->query.scores = NULL;
+    worker->query.scores_length = 0;
+    worker->query.scores_capacity = 0;
+  }
+
+  // shares that can't have a thread of their own are scored on this one
+  size_t started = 1;
+  while (started < threads &&
+         pthread_create(&workers[started].thread, NULL, zsql_worker_run,
+                        &workers[started]) == 0) {
+    ++started;
+  }
+  for (size_t idx = 0; idx < threads; ++idx) {
+    if (idx == 0 || idx >= started) {
+      workers[idx].err = zsql_worker_score(&workers[idx]);
+    }
+  }
+  for (size_t idx = 1; idx < started; ++idx) {
+    pthread_join(workers[idx].thread, NULL);
+    zsql_stats_add(&workers[idx].stats);
+  }
+  zsql_stats.threads += started - 1;
+
+  // the first error is kept, and any others dropped
+
+  size_t scores_length = 0;
+  for (size_t idx = 0; idx < threads; ++idx) {
+    if (workers[idx].err != NULL) {
+      if (err == NULL) {
+        err = workers[idx].err;
+      } else {
+        zsql_error_free(workers[idx].err);
+      }
+    }
+    scores_length += workers[idx].query.scores_length;
+  }
+  if (err != NULL) {
+    goto cleanup_workers;
+  }
+
+  if (scores_length > query->scores_capacity) {
+    void *allocation =
+        realloc(query->scores, scores_length * sizeof(*query->scores));
+    if (allocation == NULL) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_workers;
+    }
+    query->scores = allocation;
+    query->scores_capacity = scores_length;
+  }
+  query->scores_length = 0;
+  for (size_t idx = 0; idx < threads; ++idx) {
+    const zsql_query *share_query = &workers[idx].query;
+    if (share_query->scores_length > 0) {
+      memcpy(query->scores + query->scores_length, share_query->scores,
+             share_query->scores_length * sizeof(*query->scores));
+      query->scores_length += share_query->scores_length;
+    }
+  }
+
+cleanup_workers:
+  for (size_t idx = 0; idx < threads; ++idx) {
+    free(workers[idx].query.scores);
+  }
+  free(workers);
+exit:
+  return err;
+}
+#endif
+
+// dirs found through their basename to seed a search's floor
+#define ZSQL_SEED_DIRS 64
+
+// more runes than folding any one rune of a needle ever makes
+#define ZSQL_FOLD_RUNES 32
+
+// seed the floor of a search for the best match with the final ranks of dirs
+// whose basename begins with the needle, looked up through the index on it.
+// those are about the best matches a needle can have, so the floor leaves a
+// scan few others to rank. the scan still passes every dir, since recency is
+// ranked among every match, and scores the seeded ones again, so it finds the
+// same winner it would alone
+static zsql_error *zsql_seed_floor(sqlite3 *conn, const zsql_index *index,
+                                   zsql_query *query) {
+  zsql_error *err = NULL;
+
+  const uint64_t started = zsql_clock();
+
+  // a basename has no slash past its first. the runes of an unfolded needle
+  // are folded to look it up, as folded profiles are, though they're still
+  // scored as they are. folding a rune can make several of it
+  const int unfolded = !(query->utf8proc_options & UTF8PROC_CASEFOLD);
+  size_t key_capacity = query->length * 4 + 1;
+  uint8_t *key = malloc(key_capacity);
+  if (key == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  size_t key_length = 0;
+  for (size_t idx = 0; idx < query->length; ++idx) {
+    const int32_t rune = query->runes[idx];
+    if (rune == '/') {
+      goto cleanup_key;
+    }
+
+    int32_t folded[ZSQL_FOLD_RUNES];
+    ssize_t folded_length = 1;
+    if (rune < 0x80) {
+      folded[0] = ascii_fold((uint8_t)rune);
+    } else if (unfolded) {
+      int boundclass = 0;
+      folded_length = utf8proc_decompose_char(
+          rune, folded, ZSQL_FOLD_RUNES,
+          utf8proc_base_options | UTF8PROC_CASEFOLD, &boundclass);
+      if (folded_length < 0 || folded_length > ZSQL_FOLD_RUNES) {
+        // left to the scan alone
+        goto cleanup_key;
+      }
+    } else {
+      folded[0] = rune;
+    }
+
+    if (key_capacity - key_length < (size_t)folded_length * 4 + 1) {
+      key_capacity = key_capacity * 2 + (size_t)folded_length * 4;
+      void *allocation = realloc(key, key_capacity);
+      if (allocation == NULL) {
+        err = zsql_error_from_errno(err);
+        goto cleanup_key;
+      }
+      key = allocation;
+    }
+    for (ssize_t folded_idx = 0; folded_idx < folded_length; ++folded_idx) {
+      key_length +=
+          (size_t)utf8proc_encode_char(folded[folded_idx], key + key_length);
+    }
+  }
+  // utf-8 never has this byte, so every basename beginning with the key sorts
+  // below the key followed by it
+  key[key_length] = 0xff;
+
+  // the first few in the index's order, which puts exact hits ahead of the
+  // rest without sorting them all
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "SELECT dirs.id FROM components JOIN dirs ON "
+           "component_id=components.id "
+           "WHERE basename>=?1 AND basename<?2 "
+           "ORDER BY basename LIMIT ?3",
+           &stmt)) != NULL) {
+    goto cleanup_key;
+  }
+
+  if (sqlite3_bind_blob(stmt, 1, key, key_length, SQLITE_STATIC) !=
+          SQLITE_OK ||
+      sqlite3_bind_blob(stmt, 2, key, key_length + 1, SQLITE_STATIC) !=
+          SQLITE_OK ||
+      sqlite3_bind_int(stmt, 3, ZSQL_SEED_DIRS) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  // dirs added since index was read aren't in it, and are left to the scan
+  size_t positions[ZSQL_SEED_DIRS];
+  size_t positions_length = 0;
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+    const size_t at = zsql_index_find(index, sqlite3_column_int64(stmt, 0));
+    if (at < index->length) {
+      positions[positions_length++] = at;
+    }
+  }
+  if (status != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  zsql_phase_end(ZSQL_PHASE_SCAN, started);
+
+  // the query's fields are const, so its copy is made in place
+  zsql_query seed;
+  memcpy(&seed, query, sizeof(seed));
+  seed.candidates = positions;
+  seed.candidates_length = positions_length;
+  seed.scores = NULL;
+  seed.scores_length = 0;
+  seed.scores_capacity = 0;
+  if ((err = zsql_score_range(NULL, index, &seed, 1, 0,
+                              (int64_t)positions_length)) != NULL) {
+    goto cleanup_scores;
+  }
+  for (size_t idx = 0; idx < seed.scores_length; ++idx) {
+    zsql_raise_floor(&query->rank_floor, seed.scores[idx].score,
+                     seed.scores[idx].visits);
+  }
+  zsql_stats.seeded += positions_length;
+
+cleanup_scores:
+  free(seed.scores);
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+cleanup_key:
+  free(key);
+exit:
+  return err;
+}
+
+// score every candidate dir, from index when there is one and otherwise
+// straight from the database, splitting large searches between threads. a
+// search of index for only the best match is first seeded by basename
+static zsql_error *zsql_score_all(sqlite3 *conn, const zsql_index *index,
+                                  zsql_query *query, int best_only) {
+  zsql_error *err = NULL;
+
+  query->scores_length = 0;
+
+  query->rank_floor = -INFINITY;
+  if (best_only && index != NULL && query->candidates == NULL &&
+      query->length > 0 &&
+      (err = zsql_seed_floor(conn, index, query)) != NULL) {
+    goto exit;
+  }
+
+  int64_t begin = 0;
+  int64_t end = 0;
+  if (index != NULL) {
+    end = (int64_t)(query->candidates != NULL ? query->candidates_length
+                                              : index->length);
+  } else if ((err = zsql_read_ids(conn, &begin, &end)) != NULL) {
+    goto exit;
+  }
+
+#if ZSQL_PARALLEL
+  const size_t threads = zsql_parallel_threads(end - begin);
+  if (threads > 1) {
+    err = zsql_score_parallel(conn, index, query, best_only, threads, begin,
+                              end);
+  } else {
+    err = zsql_score_range(conn, index, query, best_only, begin, end);
+  }
+#else
+  err = zsql_score_range(conn, index, query, best_only, begin, end);
+#endif
+  if (err != NULL) {
+    goto exit;
+  }
+
+  const uint64_t started = zsql_clock();
+  if ((err = zsql_rank_recency(query)) != NULL) {
+    goto exit;
+  }
+  zsql_phase_end(ZSQL_PHASE_SCORE, started);
+
+exit:
+  return err;
+}
+
+// zsql_rank(query) is an eponymous virtual table over the dirs matching query,
+// a zsql_query bound as a pointer. it scores them itself, keeping only as many
+// of the best as a LIMIT asks for, and hands them back already ordered by rank
+// so that sqlite never has to sort every match to find the best one
+typedef struct {
+  int64_t id;
+  double rank;
+  double visits;
+} zsql_ranked;
+
+typedef struct {
+  sqlite3_vtab base;
+  sqlite3 *conn;
+} zsql_rank_vtab;
+
+typedef struct {
+  sqlite3_vtab_cursor base;
+  zsql_ranked *ranked;
+  size_t ranked_length;
+  size_t idx;
+  // looks dirs up by id, prepared the first time one is read
+  sqlite3_stmt *dir_stmt;
+} zsql_rank_cursor;
+
+enum {
+  ZSQL_RANK_ID,
+  ZSQL_RANK_DIR,
+  ZSQL_RANK_RANK,
+  ZSQL_RANK_VISITS,
+  ZSQL_RANK_QUERY
+};
+
+// idxNum flag for a LIMIT passed along as the second argument to xFilter
+#define ZSQL_RANK_LIMITED 1
+
+// whether a ranks ahead of b, newer dirs losing ties
+static int zsql_ranked_ahead(const zsql_ranked *a, const zsql_ranked *b) {
+  return a->rank > b->rank || (a->rank == b->rank && a->id < b->id);
+}
+
+static int zsql_ranked_compare(const void *a, const void *b) {
+  return zsql_ranked_ahead(b, a) - zsql_ranked_ahead(a, b);
+}
+
+// restore the heap below idx, which keeps the row ranked last at its root
+static void zsql_ranked_sift(zsql_ranked *heap, size_t length, size_t idx) {
+  for (;;) {
+    size_t last = idx;
+    const size_t left = idx * 2 + 1;
+    const size_t right = left + 1;
+    if (left < length && zsql_ranked_ahead(&heap[last], &heap[left])) {
+      last = left;
+    }
+    if (right < length && zsql_ranked_ahead(&heap[last], &heap[right])) {
+      last = right;
+    }
+    if (last == idx) {
+      break;
+    }
+    const zsql_ranked swap = heap[idx];
+    heap[idx] = heap[last];
+    heap[last] = swap;
+    idx = last;
+  }
+}
+
+static int zsql_rank_fail(sqlite3_vtab *vtab, zsql_error *err) {
+  sqlite3_free(vtab->zErrMsg);
+  vtab->zErrMsg = sqlite3_mprintf("%s", err->msg);
+  zsql_error_free(err);
+  return SQLITE_ERROR;
+}
+
+static int zsql_rank_connect(sqlite3 *conn, void *aux, int argc,
+                             const char *const *argv, sqlite3_vtab **vtab,
+                             char **err_msg) {
+  (void)aux;
+  (void)argc;
+  (void)argv;
+  (void)err_msg;
+
+  int status = sqlite3_declare_vtab(
+      conn, "CREATE TABLE x(id INTEGER,dir BLOB,rank REAL,visits REAL,"
+            "query HIDDEN)");
+  if (status != SQLITE_OK) {
+    return status;
+  }
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
+  sqlite3_vtab_config(conn, SQLITE_VTAB_DIRECTONLY);
+#endif
+
+  zsql_rank_vtab *rank_vtab = sqlite3_malloc(sizeof(*rank_vtab));
+  if (rank_vtab == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(rank_vtab, 0, sizeof(*rank_vtab));
+  rank_vtab->conn = conn;
+
+  *vtab = &rank_vtab->base;
+  return SQLITE_OK;
+}
+
+static int zsql_rank_disconnect(sqlite3_vtab *vtab) {
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int zsql_rank_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+  (void)vtab;
+
+  int query_idx = -1;
+  int limit_idx = -1;
+  int offset = 0;
+  for (int idx = 0; idx < info->nConstraint; ++idx) {
+    const struct sqlite3_index_constraint *constraint = &info->aConstraint[idx];
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3038000
+    // sqlite only offers these when every other constraint is used up and
+    // there's nothing left for it to filter
+    if (constraint->op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+      if (constraint->usable) {
+        limit_idx = idx;
+      }
+      continue;
+    } else if (constraint->op == SQLITE_INDEX_CONSTRAINT_OFFSET) {
+      offset = 1;
+      continue;
+    }
+#endif
+    if (constraint->iColumn == ZSQL_RANK_QUERY && constraint->usable &&
+        constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      query_idx = idx;
+    }
+  }
+
+  // there's nothing to rank without a query
+  if (query_idx < 0) {
+    return SQLITE_CONSTRAINT;
+  }
+  info->aConstraintUsage[query_idx].argvIndex = 1;
+  info->aConstraintUsage[query_idx].omit = 1;
+
+  if (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == ZSQL_RANK_RANK &&
+      info->aOrderBy[0].desc) {
+    info->orderByConsumed = 1;
+  }
+
+  // only the best rows are kept, which is only right when they're all that
+  // is asked for
+  if (limit_idx >= 0 && !offset &&
+      (info->nOrderBy == 0 || info->orderByConsumed)) {
+    info->aConstraintUsage[limit_idx].argvIndex = 2;
+    info->idxNum |= ZSQL_RANK_LIMITED;
+  }
+
+  info->estimatedCost = 1e6;
+  return SQLITE_OK;
+}
+
+static int zsql_rank_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor) {
+  (void)vtab;
+
+  zsql_rank_cursor *rank_cursor = sqlite3_malloc(sizeof(*rank_cursor));
+  if (rank_cursor == NULL) {
+    return SQLITE_NOMEM;
+  }
+  memset(rank_cursor, 0, sizeof(*rank_cursor));
+
+  *cursor = &rank_cursor->base;
+  return SQLITE_OK;
+}
+
+static int zsql_rank_close(sqlite3_vtab_cursor *cursor) {
+  zsql_rank_cursor *rank_cursor = (zsql_rank_cursor *)cursor;
+  sqlite3_finalize(rank_cursor->dir_stmt);
+  free(rank_cursor->ranked);
+  sqlite3_free(rank_cursor);
+  return SQLITE_OK;
+}
+
+static int zsql_rank_filter(sqlite3_vtab_cursor *cursor, int idx_num,
+                            const char *idx_str, int argc,
+                            sqlite3_value **argv) {
+  (void)idx_str;
+  (void)argc;
+
+  zsql_rank_cursor *rank_cursor = (zsql_rank_cursor *)cursor;
+  sqlite3_vtab *vtab = cursor->pVtab;
+  const zsql_rank_vtab *rank_vtab = (zsql_rank_vtab *)vtab;
+
+  free(rank_cursor->ranked);
+  rank_cursor->ranked = NULL;
+  rank_cursor->ranked_length = 0;
+  rank_cursor->idx = 0;
+
+  zsql_query *query = sqlite3_value_pointer(argv[0], "");
+  if (query == NULL) {
+    return zsql_rank_fail(vtab, zsql_error_from_text("no query to rank", NULL));
+  }
+
+  // a negative limit is no limit at all
+  size_t limit = SIZE_MAX;
+  if (idx_num & ZSQL_RANK_LIMITED) {
+    const sqlite3_int64 value = sqlite3_value_int64(argv[1]);
+    if (value >= 0) {
+      limit = (size_t)value;
+    }
+  }
+
+  zsql_error *err;
+  if ((err = zsql_score_all(rank_vtab->conn, query->index, query,
+                            limit == 1)) != NULL) {
+    return zsql_rank_fail(vtab, err);
+  }
+
+  const uint64_t started = zsql_clock();
+  const size_t capacity =
+      limit < query->scores_length ? limit : query->scores_length;
+  if (capacity == 0) {
+    return SQLITE_OK;
+  }
+  zsql_ranked *ranked = malloc(capacity * sizeof(*ranked));
+  if (ranked == NULL) {
+    return zsql_rank_fail(vtab, zsql_error_from_errno(NULL));
+  }
+
+  // the best rows so far are kept in a heap, the worst of them at its root
+  // ready to be displaced
+
+  size_t ranked_length = 0;
+  for (size_t idx = 0; idx < query->scores_length; ++idx) {
+    const zsql_score *score = &query->scores[idx];
+    if (score->score == -INFINITY) {
+      continue;
+    }
+    const zsql_ranked row = {
+        .id = score->id,
+        .rank = zsql_final_rank(score->score, score->visits,
+                                (double)score->recency),
+        .visits = score->visits};
+
+    if (ranked_length < capacity) {
+      ranked[ranked_length++] = row;
+      if (ranked_length == capacity) {
+        for (size_t parent = capacity / 2; parent-- > 0;) {
+          zsql_ranked_sift(ranked, capacity, parent);
+        }
+      }
+    } else if (zsql_ranked_ahead(&row, &ranked[0])) {
+      ranked[0] = row;
+      zsql_ranked_sift(ranked, capacity, 0);
+    }
+  }
+
+  qsort(ranked, ranked_length, sizeof(*ranked), zsql_ranked_compare);
+
+  rank_cursor->ranked = ranked;
+  rank_cursor->ranked_length = ranked_length;
+  zsql_phase_end(ZSQL_PHASE_SCORE, started);
+  return SQLITE_OK;
+}
+
+static int zsql_rank_next(sqlite3_vtab_cursor *cursor) {
+  ((zsql_rank_cursor *)cursor)->idx += 1;
+  return SQLITE_OK;
+}
+
+static int zsql_rank_eof(sqlite3_vtab_cursor *cursor) {
+  const zsql_rank_cursor *rank_cursor = (zsql_rank_cursor *)cursor;
+  return rank_cursor->idx >= rank_cursor->ranked_length;
+}
+
+static int zsql_rank_column(sqlite3_vtab_cursor *cursor,
+                            sqlite3_context *context, int column) {
+  zsql_rank_cursor *rank_cursor = (zsql_rank_cursor *)cursor;
+  const zsql_ranked *row = &rank_cursor->ranked[rank_cursor->idx];
+
+  switch (column) {
+  case ZSQL_RANK_ID:
+    sqlite3_result_int64(context, row->id);
+    break;
+  case ZSQL_RANK_DIR: {
+    sqlite3 *conn = ((zsql_rank_vtab *)cursor->pVtab)->conn;
+    zsql_error *err = NULL;
+    if (rank_cursor->dir_stmt == NULL &&
+        (err = zsql_prepare_dir(conn, &rank_cursor->dir_stmt)) != NULL) {
+      return zsql_rank_fail(cursor->pVtab, err);
+    }
+
+    char *dir;
+    size_t length;
+    if ((err = zsql_read_dir(conn, rank_cursor->dir_stmt, row->id, &dir,
+                             &length)) != NULL) {
+      return zsql_rank_fail(cursor->pVtab, err);
+    }
+    if (dir != NULL) {
+      sqlite3_result_blob64(context, dir, length, free);
+    }
+    break;
+  }
+  case ZSQL_RANK_RANK:
+    sqlite3_result_double(context, row->rank);
+    break;
+  case ZSQL_RANK_VISITS:
+    sqlite3_result_double(context, row->visits);
+    break;
+  default:
+    sqlite3_result_null(context);
+    break;
+  }
+
+  return SQLITE_OK;
+}
+
+static int zsql_rank_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+  const zsql_rank_cursor *rank_cursor = (zsql_rank_cursor *)cursor;
+  *rowid = rank_cursor->ranked[rank_cursor->idx].id;
+  return SQLITE_OK;
+}
+
+// no xCreate, so the table is only ever eponymous
+static const sqlite3_module zsql_rank_module = {
+    .xConnect = zsql_rank_connect,
+    .xBestIndex = zsql_rank_best_index,
+    .xDisconnect = zsql_rank_disconnect,
+    .xOpen = zsql_rank_open,
+    .xClose = zsql_rank_close,
+    .xFilter = zsql_rank_filter,
+    .xNext = zsql_rank_next,
+    .xEof = zsql_rank_eof,
+    .xColumn = zsql_rank_column,
+    .xRowid = zsql_rank_rowid};
+
+static const char *const ensure_dir_error = "not a directory: ";
+static zsql_error *zsql_ensure_dir(const char *path) {
+  struct stat dir_stat;
+  if (stat(path, &dir_stat) != 0) {
+    if (mkdir(path, 0700) != 0) {
+      return zsql_error_from_errno(NULL);
+    }
+  } else if (!S_ISDIR(dir_stat.st_mode)) {
+    const size_t ensure_dir_error_length = strlen(ensure_dir_error);
+    const size_t path_length = strlen(path);
+    const size_t msg_length = ensure_dir_error_length + path_length + 1;
+    char *msg = malloc(msg_length);
+    if (msg == NULL) {
+      return zsql_error_from_errno(NULL);
+    }
+    size_t offset = 0;
+
+    memcpy(msg + offset, ensure_dir_error, ensure_dir_error_length);
+    offset += ensure_dir_error_length;
+
+    memcpy(msg + offset, path, path_length);
+    offset += path_length;
+
+    msg[offset] = 0;
+
+    zsql_error *err = zsql_error_from_text(msg, NULL);
+    free(msg);
+    return err;
+  }
+
+  return NULL;
+}
+
+// fixme: windows
+static const char *const env_primary = "XDG_DATA_HOME";
+static const char *const env_fallback = "HOME";
+
+static const char *const fallback_suffix = "/.local/share";
+
+static const char *const cache_dir = "/zsql";
+static const char *const cache_file = "/zsql.db";
+const char *const socket_file = "/zsql.sock";
+static const char *const journal_file = "/zsql.journal";
+
+// the path to file within the data dir, creating the dirs leading to it only
+// if create is set
+zsql_error *zsql_data_path(const char *file, int create, char **path) {
+  zsql_error *err = NULL;
+
+  const uint64_t started = zsql_clock();
+  int using_fallback = 0;
+  const char *base = getenv(env_primary);
+  if (base == NULL) {
+    using_fallback = 1;
+    base = getenv(env_fallback);
+    if (base == NULL) {
+      err = zsql_error_from_errno(err);
+      goto exit;
+    }
+  }
+
+  const size_t base_length = strlen(base);
+  const size_t fallback_suffix_length = strlen(fallback_suffix);
+  const size_t cache_dir_length = strlen(cache_dir);
+  const size_t file_length = strlen(file);
+  const size_t path_length = base_length +
+                             (using_fallback ? fallback_suffix_length : 0) +
+                             cache_dir_length + file_length + 1;
+  *path = malloc(path_length);
+  if (*path == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  size_t offset = 0;
+
+  memcpy(*path + offset, base, base_length);
+  offset += base_length;
+
+  if (using_fallback) {
+    memcpy(*path + offset, fallback_suffix, fallback_suffix_length);
+
+    // forcing an unroll here if the compiler supports it. always generates
+    // better code, since iterating and checking the condition is pure overhead
+    // for the low number of times this will be true, and whether it's true
+    // can be statically determined
+#pragma unroll
+    for (size_t slash_idx = 1; slash_idx < fallback_suffix_length;
+         ++slash_idx) {
+      if (create && fallback_suffix[slash_idx] == '/') {
+        (*path)[offset + slash_idx] = 0;
+        if ((err = zsql_ensure_dir(*path)) != NULL) {
+          goto cleanup_path;
+        }
+        (*path)[offset + slash_idx] = '/';
+      }
+    }
+
+    offset += fallback_suffix_length;
+  }
+
+  (*path)[offset] = 0;
+  if (create && (err = zsql_ensure_dir(*path)) != NULL) {
+    goto cleanup_path;
+  }
+
+  memcpy(*path + offset, cache_dir, cache_dir_length);
+  offset += cache_dir_length;
+
+  (*path)[offset] = 0;
+  if (create && (err = zsql_ensure_dir(*path)) != NULL) {
+    goto cleanup_path;
+  }
+
+  memcpy(*path + offset, file, file_length);
+  offset += file_length;
+
+  (*path)[offset] = 0;
+
+  if (0) { // error path only
+  cleanup_path:
+    free(*path);
+  }
+exit:
+  if (create) {
+    zsql_phase_end(ZSQL_PHASE_MKDIR, started);
+  }
+  return err;
+}
+
+// commits checkpoint the log passively, never waiting on readers, once it
+// holds this many pages, which is a couple hundred adds
+#define ZSQL_CHECKPOINT_PAGES 1024
+
+// open the database, with zsql_rank and the functions the schema uses
+static zsql_error *zsql_open(sqlite3 **conn) {
+  zsql_error *err = NULL;
+
+  char *path;
+  if ((err = zsql_data_path(cache_file, 1, &path)) != NULL) {
+    goto exit;
+  }
+
+  int retries = 0;
+retry_open:;
+  const uint64_t open_started = zsql_clock();
+  int status = sqlite3_open(path, conn);
+  zsql_phase_end(ZSQL_PHASE_OPEN, open_started);
+  if (status == SQLITE_BUSY && retries < 8) {
+    if (retries == 0) {
+      ++zsql_stats.lock_waits;
+    }
+    retries += 1;
+    ++zsql_stats.lock_retries;
+    const uint64_t sleep_started = zsql_clock();
+    sqlite3_sleep(16);
+    zsql_phase_end(ZSQL_PHASE_LOCKED, sleep_started);
+    goto retry_open;
+  } else if (status != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_path;
+  }
+
+  if (sqlite3_busy_handler(*conn, zsql_busy, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_wal_autocheckpoint(*conn, ZSQL_CHECKPOINT_PAGES) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  // deleting a component prunes its parent when nothing else needs it, which
+  // prunes the parent's parent in turn
+  if ((err = sqlh_exec_static(*conn, "PRAGMA recursive_triggers=ON")) !=
+      NULL) {
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_create_function(*conn, "profile", 2,
+                              SQLITE_UTF8 | SQLITE_DETERMINISTIC
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
+                                  | SQLITE_DIRECTONLY
+#endif
+                              ,
+                              NULL, profile_impl, NULL, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_create_function(*conn, "profile", 3,
+                              SQLITE_UTF8 | SQLITE_DETERMINISTIC
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
+                                  | SQLITE_DIRECTONLY
+#endif
+                              ,
+                              NULL, profile_impl, NULL, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_create_function(*conn, "signature", 1,
+                              SQLITE_UTF8 | SQLITE_DETERMINISTIC
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
+                                  | SQLITE_DIRECTONLY
+#endif
+                              ,
+                              NULL, signature_impl, NULL, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_create_function(*conn, "basename", 1,
+                              SQLITE_UTF8 | SQLITE_DETERMINISTIC
+#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
+                                  | SQLITE_DIRECTONLY
+#endif
+                              ,
+                              NULL, basename_impl, NULL, NULL) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (sqlite3_create_module(*conn, "zsql_rank", &zsql_rank_module, NULL) !=
+      SQLITE_OK) {
+    err = zsql_error_from_sqlite(*conn, err);
+    goto cleanup_sql;
+  }
+
+  if (0) { // error path only
+  cleanup_sql:
+    sqlite3_close(*conn);
+  }
+cleanup_path:
+  free(path);
+exit:
+  return err;
+}
+
+// record a visit to dir at visited_at, in seconds since the epoch, within a
+// transaction the caller holds
+static zsql_error *zsql_visit(sqlite3 *conn, const char *dir, size_t length,
+                              int64_t visited_at) {
+  zsql_error *err = NULL;
+
+  int64_t component_id;
+  if ((err = zsql_component_of(conn, dir, length, 1, &component_id)) != NULL) {
+    goto exit;
+  }
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn,
+           "INSERT INTO dirs(component_id,visits,visited_at,visited_seq)"
+           "VALUES(?1,1/(SELECT scale FROM aging),?2,"
+           "IFNULL((SELECT visited_seq+(visited_at<>?2)"
+           "FROM dirs ORDER BY visited_seq DESC LIMIT 1),1))"
+           "ON CONFLICT(component_id)DO UPDATE SET"
+           " visits=visits+excluded.visits"
+           ",visited_at=excluded.visited_at"
+           ",visited_seq=excluded.visited_seq",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, component_id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if (sqlite3_bind_int64(stmt, 2, visited_at) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if ((err = sqlh_finalize(stmt, err)) != NULL) {
+    goto exit;
+  }
+
+  // decay every dir once visits add up to the limit. this is a statement of
+  // its own, rather than a trigger, so that the triggers keeping aging.total
+  // fire for the rows it deletes
+  const uint64_t aging_started = zsql_clock();
+  if ((err = sqlh_exec_static(
+           conn, "UPDATE aging SET scale=scale*0.9 WHERE total*scale>=5000")) !=
+      NULL) {
+    goto exit;
+  }
+  zsql_stats.decays += (unsigned long)sqlite3_changes(conn);
+  zsql_phase_end(ZSQL_PHASE_AGING, aging_started);
+
+  if (0) { // error path only
+  cleanup_stmt:
+    err = sqlh_finalize(stmt, err);
+  }
+exit:
+  return err;
+}
+
+zsql_error *zsql_add(sqlite3 *conn, const char *dir, size_t length) {
+  zsql_error *err = NULL;
+
+  // the visit and any aging it causes are written together
+  if ((err = sqlh_exec_static(conn, "BEGIN IMMEDIATE")) != NULL) {
+    goto exit;
+  }
+
+  if ((err = zsql_visit(conn, dir, length, (int64_t)time(NULL))) != NULL) {
+    goto rollback;
+  }
+
+  if ((err = sqlh_exec_static(conn, "COMMIT")) != NULL) {
+    goto rollback;
+  }
+
+  if (0) { // error path only
+  rollback:
+    // as in zsql_migrate, the error may have already rolled back
+    if (!sqlite3_get_autocommit(conn)) {
+      if (sqlh_exec_static(conn, "ROLLBACK") != NULL) {
+        // fixme: nothing sensible to do about a failed rollback
+      }
+    }
+  }
+exit:
+  return err;
+}
+
+// forget the dir with id, so long as it's still dir, or whichever dir it is
+// given an id of 0. components no other dir needs go along with it, see
+// trigger_on_delete_prune
+zsql_error *zsql_delete(sqlite3 *conn, int64_t id, const char *dir,
+                        size_t length) {
+  zsql_error *err = NULL;
+
+  int64_t component_id;
+  if ((err = zsql_component_of(conn, dir, length, 0, &component_id)) != NULL) {
+    goto exit;
+  }
+
+  sqlite3_stmt *stmt;
+  if ((err = sqlh_prepare_static(
+           conn, "DELETE FROM dirs WHERE component_id=?2 AND ?1 IN(0,id)",
+           &stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_bind_int64(stmt, 1, id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if (sqlite3_bind_int64(stmt, 2, component_id) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if (sqlite3_step(stmt) != SQLITE_DONE) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+cleanup_stmt:
+  err = sqlh_finalize(stmt, err);
+exit:
+  return err;
+}
+
+// fold the journal into the database, all in one transaction, so that
+// searches see the visits waiting in it. the journal is only cleared once
+// they're committed, so a crash in between counts them twice rather than
+// losing them. a mapped index, if there is one, is caught up along with the
+// database, or left stale
+zsql_error *zsql_fold_journal(sqlite3 *conn, zsql_index *index,
+                              int *folded) {
+  zsql_error *err = NULL;
+
+  *folded = 0;
+  const uint64_t started = zsql_clock();
+
+  char *path;
+  if ((err = zsql_data_path(journal_file, 0, &path)) != NULL) {
+    goto exit;
+  }
+
+  // most of the time there's nothing to fold, and no need for a write lock
+  if (!journal_pending(path)) {
+    goto cleanup_path;
+  }
+
+  // the database is locked first, so that appends only wait on the fold
+  // itself and never on sqlite
+  if ((err = sqlh_exec_static(conn, "BEGIN IMMEDIATE")) != NULL) {
+    goto cleanup_path;
+  }
+
+  zsql_journal journal;
+  if ((err = journal_lock(path, &journal)) != NULL) {
+    goto rollback;
+  }
+
+  if (index != NULL && (err = snapshot_begin(conn, index)) != NULL) {
+    goto cleanup_journal;
+  }
+
+  const char *dir;
+  size_t length;
+  int64_t visited_at;
+  while (journal_next(&journal, &dir, &length, &visited_at)) {
+    // forgetting leaves the index to be rebuilt, as the server does
+    if (visited_at == JOURNAL_FORGET) {
+      if ((err = zsql_delete(conn, 0, dir, length)) != NULL) {
+        goto cleanup_journal;
+      }
+      *folded = 1;
+      if (index != NULL) {
+        index->stale = 1;
+      }
+      continue;
+    }
+
+    if ((err = zsql_visit(conn, dir, length, visited_at)) != NULL) {
+      goto cleanup_journal;
+    }
+    *folded = 1;
+
+    // the visit went through, and the index just needs a rebuild
+    zsql_error *index_err;
+    if (index != NULL &&
+        (index_err = zsql_index_visit(conn, index, dir, length)) != NULL) {
+      zsql_error_free(index_err);
+      index->stale = 1;
+    }
+  }
+
+  double scale;
+  int64_t generation = 0;
+  if (index != NULL && !index->stale &&
+      (err = zsql_index_read_aging(conn, &scale, &generation)) != NULL) {
+    goto cleanup_journal;
+  }
+
+  if ((err = sqlh_exec_static(conn, "COMMIT")) != NULL) {
+    goto cleanup_journal;
+  }
+  if (index != NULL && !index->stale) {
+    snapshot_commit(index, generation);
+  }
+
+  if (journal.fd >= 0 && (err = journal_clear(&journal)) != NULL) {
+    goto cleanup_journal;
+  }
+
+cleanup_journal:
+  journal_unlock(&journal);
+rollback:
+  // as in zsql_migrate, the error may have already rolled back
+  if (err != NULL && !sqlite3_get_autocommit(conn)) {
+    if (sqlh_exec_static(conn, "ROLLBACK") != NULL) {
+      // fixme: nothing sensible to do about a failed rollback
+    }
+  }
+cleanup_path:
+  free(path);
+  zsql_phase_end(ZSQL_PHASE_FOLD, started);
+exit:
+  return err;
+}
+
+// the best matches for query, as many as limit allows, a negative limit being
+// no limit at all. stepping stmt scores every candidate into query
+zsql_error *zsql_match(sqlite3 *conn, sqlite3_stmt **stmt, zsql_query *query,
+                       int limit) {
+  zsql_error *err = NULL;
+
+  // zsql_rank returns the matches in order, keeping only as many as the limit
+  // lets through. a limit of one finds the best without sorting the rest
+  const uint64_t started = zsql_clock();
+  if ((err = sqlh_prepare_static(conn,
+                                 "SELECT id,dir,rank,visits FROM zsql_rank(?1)"
+                                 "ORDER BY rank DESC LIMIT ?2",
+                                 stmt)) != NULL) {
+    goto exit;
+  }
+
+  if (sqlite3_bind_pointer(*stmt, 1, query, "", SQLITE_STATIC) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+
+  if (sqlite3_bind_int(*stmt, 2, limit) != SQLITE_OK) {
+    err = zsql_error_from_sqlite(conn, err);
+    goto cleanup_stmt;
+  }
+  zsql_phase_end(ZSQL_PHASE_PREPARE, started);
+
+  if (0) { // error path only
+  cleanup_stmt:
+    err = sqlh_finalize(*stmt, err);
+  }
+exit:
+  return err;
+}
+
+// whether dir is known to no longer exist. only a dir that's missing, or
+// that's no longer a directory, counts. anything else, from a relative dir to
+// a mount that can't be reached, is given the benefit of the doubt
+int zsql_dir_gone(const char *dir, size_t length) {
+  char path[PATH_MAX];
+  if (length == 0 || length >= sizeof(path) || dir[0] != '/' ||
+      memchr(dir, 0, length) != NULL) {
+    return 0;
+  }
+  memcpy(path, dir, length);
+  path[length] = 0;
+
+  struct stat dir_stat;
+  if (stat(path, &dir_stat) != 0) {
+    return errno == ENOENT || errno == ENOTDIR;
+  }
+  return !S_ISDIR(dir_stat.st_mode);
+}
+
+// queue dir to be forgotten along with the visits in the journal, so that
+// finding it gone never waits on the write lock
+static zsql_error *zsql_queue_forget(const char *dir, size_t length) {
+  zsql_error *err = NULL;
+
+  char *journal_path;
+  if ((err = zsql_data_path(journal_file, 1, &journal_path)) != NULL) {
+    goto exit;
+  }
+  size_t journal_length;
+  err = journal_append(journal_path, dir, length, JOURNAL_FORGET,
+                       &journal_length);
+  free(journal_path);
+
+exit:
+  return err;
+}
+
+// how many of the best matches a search checks for one that still exists
+#define ZSQL_FIND_CHECKED 8
+
+// the best match for runes that still exists, its dir copied out. dirs are
+// scored from index if it isn't NULL.
+//
+// only the best match is ranked to begin with, which lets scoring give up on
+// the rest early. if it's gone, the next best are ranked and checked in turn.
+// matches found gone are queued to be forgotten, see zsql_queue_forget
+zsql_error *zsql_find(sqlite3 *conn, const zsql_index *index,
+                      const int32_t *runes, size_t length,
+                      utf8proc_option_t utf8proc_options, int64_t *id,
+                      char **dir, size_t *dir_length) {
+  zsql_error *err = NULL;
+
+  zsql_query query = {.length = length,
+                      .runes = runes,
+                      .signature = fuzzy_signature(runes, length),
+                      .utf8proc_options = utf8proc_options,
+                      .index = index};
+  *dir = NULL;
+
+  // debugging lists every match, ranking them all from the start and
+  // carrying on past the best one rather than running the query again
+  int limit = DEBUGGING ? -1 : 1;
+  size_t checked = 0;
+  int64_t gone_id = 0;
+  for (;;) {
+    sqlite3_stmt *stmt;
+    if ((err = zsql_match(conn, &stmt, &query, limit)) != NULL) {
+      goto cleanup_dir;
+    }
+
+    int status;
+    while ((status = sqlite3_step(stmt)) == SQLITE_ROW) {
+      const int64_t match_id = sqlite3_column_int64(stmt, 0);
+      const size_t match_length = (size_t)sqlite3_column_bytes(stmt, 1);
+      const char *match = sqlite3_column_blob(stmt, 1);
+
+      if (DEBUGGING) {
+        const uint64_t started = zsql_clock();
+        const double rank = sqlite3_column_double(stmt, 2);
+        const double visits = sqlite3_column_double(stmt, 3);
+        fprintf(stderr, "%.4lf\t%.2lf\t%.*s\n", rank, visits,
+                (int)(match_length > INT_MAX ? INT_MAX : match_length), match);
+        zsql_phase_end(ZSQL_PHASE_OUTPUT, started);
+      }
+      if (*dir != NULL || checked >= ZSQL_FIND_CHECKED || match_id == gone_id) {
+        continue;
+      }
+
+      ++checked;
+      const uint64_t started = zsql_clock();
+      const int gone = zsql_dir_gone(match, match_length);
+      zsql_phase_end(ZSQL_PHASE_CHECK, started);
+      if (gone) {
+        ++zsql_stats.gone;
+        gone_id = match_id;
+        // the match is passed over either way
+        zsql_error *queue_err = zsql_queue_forget(match, match_length);
+        if (queue_err != NULL) {
+          zsql_error_free(queue_err);
         }
-        path[offset + slash_idx] = '/';
+        continue;
+      }
+
+      *dir = malloc(match_length + 1);
+      if (*dir == NULL) {
+        err = zsql_error_from_errno(err);
+        break;
+      }
+      if (match_length > 0) {
+        memcpy(*dir, match, match_length);
       }
+      *dir_length = match_length;
+      *id = match_id;
+      if (!DEBUGGING) {
+        break;
+      }
+    }
+    if (err == NULL && status != SQLITE_ROW && status != SQLITE_DONE) {
+      err = zsql_error_from_sqlite(conn, err);
+    }
+    if ((err = sqlh_finalize(stmt, err)) != NULL) {
+      goto cleanup_dir;
+    }
+
+    if (*dir != NULL || limit != 1 || checked == 0) {
+      break;
     }
+    // the best one, found gone, is ranked again along with the rest
+    limit = ZSQL_FIND_CHECKED + 1;
+  }
+
+  if (*dir == NULL) {
+    err = zsql_error_from_text(checked > 0 ? "no matches still exist"
+                                           : "no matches",
+                               err);
+    goto cleanup_dir;
+  }
+
+  if (0) { // error path only
+  cleanup_dir:
+    free(*dir);
+    *dir = NULL;
+  }
+  free(query.scores);
+  return err;
+}
+
+// open and migrate the database
+zsql_error *zsql_connect(sqlite3 **conn) {
+  zsql_error *err = NULL;
+
+  if (sqlite3_initialize() != SQLITE_OK) {
+    err = zsql_error_from_text("failed to initialize sqlite", err);
+    goto exit;
+  }
+
+  if ((err = zsql_open(conn)) != NULL) {
+    goto exit;
+  }
+
+  const uint64_t started = zsql_clock();
+  if ((err = zsql_migrate(*conn)) != NULL) {
+    goto cleanup_sql;
+  }
+  zsql_phase_end(ZSQL_PHASE_MIGRATE, started);
+
+  if (0) { // error path only
+  cleanup_sql:
+    sqlite3_close(*conn);
+    *conn = NULL;
+  }
+exit:
+  return err;
+}
+
+// where requests go: to the server at socket_path if one is listening, and
+// otherwise straight to the database through conn, opened on first use.
+// searches through conn scan snapshot
+typedef struct {
+  char *socket_path;
+  sqlite3 *conn;
+  zsql_index snapshot;
+} zsql_client;
+
+// send a request to the server, leaving reply NULL if there's none listening.
+// a server that can't be sent the request or that times out before replying
+// is treated as not running too, so that a stalled one only ever delays the
+// fallback. a reply with an error is returned as one
+static zsql_error *zsql_client_request(zsql_client *client,
+                                       const uint8_t *request,
+                                       size_t request_length, uint8_t **reply,
+                                       size_t *reply_length) {
+  zsql_error *err = NULL;
+
+  *reply = NULL;
+  if (client->socket_path == NULL) {
+    goto exit;
+  }
+  const uint64_t started = zsql_clock();
+  const int fd = ipc_connect(client->socket_path);
+  if (fd < 0) {
+    goto exit;
+  }
+
+  zsql_error *send_err = ipc_send(fd, request, request_length);
+  if (send_err != NULL) {
+    zsql_error_free(send_err);
+    goto cleanup_fd;
+  }
+  if ((err = ipc_recv(fd, reply, reply_length)) != NULL) {
+    goto cleanup_fd;
+  }
+  if (*reply == NULL) {
+    goto cleanup_fd;
+  }
+
+  if (*reply_length == 0 || (*reply)[0] != ZSQL_REPLY_OK) {
+    err = zsql_error_from_text(*reply_length > 0 &&
+                                       (*reply)[0] == ZSQL_REPLY_ERROR
+                                   ? (const char *)*reply + 1
+                                   : "malformed reply from server",
+                               err);
+    free(*reply);
+    *reply = NULL;
+  }
+
+cleanup_fd:
+  close(fd);
+  zsql_phase_end(ZSQL_PHASE_REQUEST, started);
+exit:
+  return err;
+}
 
-    offset += fallback_suffix_length;
-  }
+// the database, with any journaled visits folded in. the snapshot is mapped
+// first, to be caught up with them
+static zsql_error *zsql_client_conn(zsql_client *client) {
+  zsql_error *err = NULL;
 
-  path[offset] = 0;
-  if ((err = zsql_ensure_dir(path)) != NULL) {
-    goto cleanup_path;
+  if (client->conn != NULL) {
+    goto exit;
+  }
+  if ((err = zsql_connect(&client->conn)) != NULL) {
+    goto exit;
   }
 
-  memcpy(path + offset, cache_dir, cache_dir_length);
-  offset += cache_dir_length;
+  if ((err = snapshot_map(&client->snapshot)) != NULL) {
+    goto exit;
+  }
 
-  path[offset] = 0;
-  if ((err = zsql_ensure_dir(path)) != NULL) {
-    goto cleanup_path;
+  int folded;
+  if ((err = zsql_fold_journal(client->conn, &client->snapshot, &folded)) !=
+      NULL) {
+    goto exit;
   }
 
-  memcpy(path + offset, cache_file, cache_file_length);
-  offset += cache_file_length;
+exit:
+  return err;
+}
 
-  path[offset] = 0;
+// once the journal grows this long, the add that grew it folds it in, so that
+// it stays quick to fold even if nothing searches for a while
+#define ZSQL_JOURNAL_COMPACT_LENGTH (64 * 1024)
 
-  int retries = 0;
-retry_open:;
-  int status = sqlite3_open(path, conn);
-  if (status == SQLITE_BUSY && retries < 8) {
-    retries += 1;
-    sqlite3_sleep(16);
-    goto retry_open;
-  } else if (status != SQLITE_OK) {
-    err = zsql_error_from_sqlite(*conn, err);
-    goto cleanup_path;
-  }
+static zsql_error *zsql_client_add(zsql_client *client, const char *dir,
+                                   size_t length) {
+  zsql_error *err = NULL;
 
-  if (sqlite3_busy_timeout(*conn, 128) != SQLITE_OK) {
-    err = zsql_error_from_sqlite(*conn, err);
-    goto cleanup_sql;
+  uint8_t *request = malloc(1 + length);
+  if (request == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  request[0] = ZSQL_REQUEST_ADD;
+  memcpy(request + 1, dir, length);
+
+  uint8_t *reply;
+  size_t reply_length;
+  if ((err = zsql_client_request(client, request, 1 + length, &reply,
+                                 &reply_length)) != NULL) {
+    goto cleanup_request;
+  }
+  if (reply != NULL) {
+    free(reply);
+    goto cleanup_request;
   }
 
-  if (sqlite3_create_function(*conn, "match", 2,
-                              SQLITE_UTF8 | SQLITE_DETERMINISTIC
-#if defined(SQLITE_VERSION_NUMBER) && SQLITE_VERSION_NUMBER >= 3031000
-                                  | SQLITE_DIRECTONLY
-#endif
-                              ,
-                              NULL, match_impl, NULL, NULL) != SQLITE_OK) {
-    err = zsql_error_from_sqlite(*conn, err);
-    goto cleanup_sql;
+  // without a server, visits go in the journal rather than waiting on
+  // sqlite's write lock
+
+  char *journal_path;
+  if ((err = zsql_data_path(journal_file, 1, &journal_path)) != NULL) {
+    goto cleanup_request;
+  }
+  size_t journal_length;
+  err = journal_append(journal_path, dir, length, (int64_t)time(NULL),
+                       &journal_length);
+  free(journal_path);
+  if (err != NULL) {
+    goto cleanup_request;
   }
 
-  if (0) { // error path only
-  cleanup_sql:
-    sqlite3_close(*conn);
+  if (journal_length >= ZSQL_JOURNAL_COMPACT_LENGTH) {
+    if ((err = zsql_client_conn(client)) != NULL) {
+      goto cleanup_request;
+    }
   }
-cleanup_path:
-  free(path);
+
+cleanup_request:
+  free(request);
 exit:
   return err;
 }
 
-static zsql_error *zsql_add(sqlite3 *conn, const char *dir, size_t length) {
+// bring the snapshot up to date for a search, rebuilding it from the database
+// unless it's as of the latest generation. the scale changes without dirs
+// being written, so it's always read afresh
+static zsql_error *zsql_client_snapshot(zsql_client *client) {
   zsql_error *err = NULL;
 
-  sqlite3_stmt *stmt;
-  if ((err = sqlh_prepare_static(
-           conn,
-           "INSERT INTO dirs(dir,visited_at)VALUES(?1,CURRENT_TIMESTAMP)"
-           "ON CONFLICT(dir)DO UPDATE SET"
-           " visits=visits+excluded.visits"
-           ",visited_at=excluded.visited_at",
-           &stmt)) != NULL) {
+  zsql_index *index = &client->snapshot;
+  double scale;
+  int64_t generation;
+  if ((err = zsql_index_read_aging(client->conn, &scale, &generation)) !=
+      NULL) {
+    goto exit;
+  }
+  if (!index->stale && index->map != NULL &&
+      snapshot_sync(index) == generation) {
+    index->scale = scale;
     goto exit;
   }
 
-  if (sqlite3_bind_blob(stmt, 1, dir, length * sizeof(*dir), SQLITE_STATIC) !=
-      SQLITE_OK) {
-    err = zsql_error_from_sqlite(conn, err);
-    goto cleanup_stmt;
+  const uint64_t started = zsql_clock();
+  index->stale = 1;
+  if ((err = zsql_index_refresh(client->conn, index)) != NULL) {
+    goto exit;
   }
+  zsql_phase_end(ZSQL_PHASE_SNAPSHOT, started);
 
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    err = zsql_error_from_sqlite(conn, err);
-    goto cleanup_stmt;
+  // searching goes ahead from the rebuilt index either way
+  zsql_error *write_err = snapshot_write(index);
+  if (write_err != NULL) {
+    zsql_error_free(write_err);
   }
 
-cleanup_stmt:
-  err = sqlh_finalize(stmt, err);
 exit:
   return err;
 }
 
-static zsql_error *zsql_match(sqlite3 *conn, sqlite3_stmt **stmt,
-                              zsql_query *query) {
+static zsql_error *zsql_client_find(zsql_client *client, const int32_t *runes,
+                                    size_t length,
+                                    utf8proc_option_t utf8proc_options,
+                                    int64_t *id, char **dir,
+                                    size_t *dir_length) {
   zsql_error *err = NULL;
 
-  if ((err = sqlh_prepare_static(
-           conn,
-           "SELECT id,dir,"
-           "m-250000./(visits+300)+250000./301+500./DENSE_RANK()OVER("
-           "ORDER BY visited_at DESC"
-           ")r,visits FROM("
-           "SELECT *,match(dir,?1)m FROM dirs LIMIT -1"
-           ")WHERE m IS NOT NULL ORDER BY r DESC",
-           stmt)) != NULL) {
+  const int32_t options = (int32_t)utf8proc_options;
+  const size_t request_length =
+      1 + sizeof(options) + length * sizeof(*runes);
+  uint8_t *request = malloc(request_length);
+  if (request == NULL) {
+    err = zsql_error_from_errno(err);
     goto exit;
   }
-
-  if (sqlite3_bind_pointer(*stmt, 1, query, "", SQLITE_STATIC) != SQLITE_OK) {
-    err = zsql_error_from_sqlite(conn, err);
-    goto cleanup_stmt;
+  request[0] = ZSQL_REQUEST_SEARCH;
+  memcpy(request + 1, &options, sizeof(options));
+  if (length > 0) {
+    memcpy(request + 1 + sizeof(options), runes, length * sizeof(*runes));
   }
 
-  int status = sqlite3_step(*stmt);
-  if (status == SQLITE_DONE) {
-    err = zsql_error_from_text("no matches", err);
-    goto cleanup_stmt;
-  } else if (status != SQLITE_ROW) {
-    err = zsql_error_from_sqlite(conn, err);
-    goto cleanup_stmt;
+  uint8_t *reply;
+  size_t reply_length;
+  if ((err = zsql_client_request(client, request, request_length, &reply,
+                                 &reply_length)) != NULL) {
+    goto cleanup_request;
+  }
+  if (reply != NULL) {
+    if (reply_length < 1 + sizeof(*id)) {
+      err = zsql_error_from_text("malformed reply from server", err);
+      free(reply);
+      goto cleanup_request;
+    }
+    memcpy(id, reply + 1, sizeof(*id));
+    // the dir is moved to the front, keeping the terminator ipc_recv adds
+    *dir_length = reply_length - 1 - sizeof(*id);
+    memmove(reply, reply + 1 + sizeof(*id), *dir_length + 1);
+    *dir = (char *)reply;
+    goto cleanup_request;
   }
 
-  if (DEBUGGING) {
-    for (; status == SQLITE_ROW; status = sqlite3_step(*stmt)) {
-      const size_t result_length = (size_t)sqlite3_column_bytes(*stmt, 1);
-      const char *result = sqlite3_column_blob(*stmt, 1);
-      const double rank = sqlite3_column_double(*stmt, 2);
-      const int64_t visits = sqlite3_column_int64(*stmt, 3);
+  if ((err = zsql_client_conn(client)) != NULL) {
+    goto cleanup_request;
+  }
+  if ((err = zsql_client_snapshot(client)) != NULL) {
+    goto cleanup_request;
+  }
+  if ((err = zsql_find(client->conn, &client->snapshot, runes, length,
+                       utf8proc_options, id, dir, dir_length)) != NULL) {
+    goto cleanup_request;
+  }
 
-      fprintf(stderr, "%.4lf\t%" PRId64 "\t%.*s\n", rank, visits,
-              (int)(result_length > INT_MAX ? INT_MAX : result_length), result);
-    }
+cleanup_request:
+  free(request);
+exit:
+  return err;
+}
 
-    if (status == SQLITE_DONE) {
-      status = sqlite3_reset(*stmt);
-      if (status != SQLITE_OK) {
-        err = zsql_error_from_sqlite(conn, err);
-        goto cleanup_stmt;
-      }
+static zsql_error *zsql_client_delete(zsql_client *client, int64_t id,
+                                      const char *dir, size_t length) {
+  zsql_error *err = NULL;
 
-      status = sqlite3_step(*stmt);
-      if (status == SQLITE_DONE) {
-        err = zsql_error_from_text("inconsistent state after debug", err);
-        goto cleanup_stmt;
-      } else if (status != SQLITE_ROW) {
-        err = zsql_error_from_sqlite(conn, err);
-        goto cleanup_stmt;
-      }
-    } else {
-      err = zsql_error_from_sqlite(conn, err);
-      goto cleanup_stmt;
-    }
+  const size_t request_length = 1 + sizeof(id) + length;
+  uint8_t *request = malloc(request_length);
+  if (request == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+  request[0] = ZSQL_REQUEST_DELETE;
+  memcpy(request + 1, &id, sizeof(id));
+  memcpy(request + 1 + sizeof(id), dir, length);
+
+  uint8_t *reply;
+  size_t reply_length;
+  if ((err = zsql_client_request(client, request, request_length, &reply,
+                                 &reply_length)) != NULL) {
+    goto cleanup_request;
+  }
+  if (reply != NULL) {
+    free(reply);
+    goto cleanup_request;
   }
 
-  if (0) { // error path only
-  cleanup_stmt:
-    err = sqlh_finalize(*stmt, err);
+  if ((err = zsql_client_conn(client)) != NULL) {
+    goto cleanup_request;
+  }
+  if ((err = zsql_delete(client->conn, id, dir, length)) != NULL) {
+    goto cleanup_request;
   }
+
+cleanup_request:
+  free(request);
 exit:
   return err;
 }
 
-static zsql_error *zsql_forget(sqlite3 *conn, const int32_t *runes,
+static zsql_error *zsql_forget(zsql_client *client, const int32_t *runes,
                                size_t length,
                                utf8proc_option_t utf8proc_options) {
   zsql_error *err = NULL;
 
-  zsql_query query = {
-      .length = length, .runes = runes, .utf8proc_options = utf8proc_options};
-  sqlite3_stmt *stmt;
-  if ((err = zsql_match(conn, &stmt, &query)) != NULL) {
+  int64_t id;
+  char *result;
+  size_t result_length;
+  if ((err = zsql_client_find(client, runes, length, utf8proc_options, &id,
+                              &result, &result_length)) != NULL) {
     goto exit;
   }
 
-  const int64_t id = sqlite3_column_int64(stmt, 0);
-  const size_t result_length = (size_t)sqlite3_column_bytes(stmt, 1);
-  const char *result = sqlite3_column_blob(stmt, 1);
-
   if (printf("Remove `%.*s'? [Yn] ",
              (int)(result_length > INT_MAX ? INT_MAX : result_length),
              result) < 0) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
   const int response = fgetc(stdin);
   if (response == EOF && !feof(stdin)) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
   const int should_remove =
       response != EOF && response != 'n' && response != 'N';
 
   if (should_remove) {
-    if ((err = sqlh_finalize(stmt, err)) != NULL) {
-      goto exit;
-    }
-    if ((err = sqlh_prepare_static(conn, "DELETE FROM dirs WHERE id=?1",
-                                   &stmt)) != NULL) {
-      goto exit;
-    }
-
-    if (sqlite3_bind_int64(stmt, 1, id) != SQLITE_OK) {
-      err = zsql_error_from_sqlite(conn, err);
-      goto cleanup_stmt;
-    }
-
-    int status = sqlite3_step(stmt);
-    if (status != SQLITE_DONE) {
-      err = zsql_error_from_sqlite(conn, err);
-      goto cleanup_stmt;
+    if ((err = zsql_client_delete(client, id, result, result_length)) !=
+        NULL) {
+      goto cleanup_result;
     }
   }
 
-cleanup_stmt:
-  err = sqlh_finalize(stmt, err);
+cleanup_result:
+  free(result);
 exit:
   return err;
 }
 
-static zsql_error *zsql_search(sqlite3 *conn, const int32_t *runes,
+static zsql_error *zsql_search(zsql_client *client, const int32_t *runes,
                                size_t length,
                                utf8proc_option_t utf8proc_options) {
   zsql_error *err = NULL;
 
-  zsql_query query = {
-      .length = length, .runes = runes, .utf8proc_options = utf8proc_options};
-  sqlite3_stmt *stmt;
-  if ((err = zsql_match(conn, &stmt, &query)) != NULL) {
+  int64_t id;
+  char *result;
+  size_t result_length;
+  if ((err = zsql_client_find(client, runes, length, utf8proc_options, &id,
+                              &result, &result_length)) != NULL) {
     goto exit;
   }
 
-  const size_t result_length = (size_t)sqlite3_column_bytes(stmt, 1);
-  const char *result = sqlite3_column_blob(stmt, 1);
-
+  const uint64_t started = zsql_clock();
 #if HAVE_FLOCKFILE && HAVE_FUNLOCKFILE && HAVE_PUTC_UNLOCKED
   flockfile(stdout);
 #if HAVE_FWRITE_UNLOCKED
   if (fwrite_unlocked(result, 1, result_length, stdout) != result_length) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
 #else
   for (size_t i = 0; i < result_length; ++i) {
     if (putc_unlocked(result[i], stdout) == EOF) {
       err = zsql_error_from_errno(err);
-      goto cleanup_stmt;
+      goto cleanup_result;
     }
   }
 #endif
   if (putc_unlocked('$', stdout) == EOF) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
   funlockfile(stdout);
 #else
   if (fwrite(result, 1, result_length, stdout) != result_length) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
   if (putc('$', stdout) == EOF) {
     err = zsql_error_from_errno(err);
-    goto cleanup_stmt;
+    goto cleanup_result;
   }
 #endif
 
-cleanup_stmt:
-  err = sqlh_finalize(stmt, err);
+cleanup_result:
+  free(result);
+  zsql_phase_end(ZSQL_PHASE_OUTPUT, started);
 exit:
   return err;
 }
@@ -496,14 +3559,12 @@ exit:
 typedef enum {
   ZSQL_BEHAVIOR_SEARCH,
   ZSQL_BEHAVIOR_ADD,
-  ZSQL_BEHAVIOR_FORGET
+  ZSQL_BEHAVIOR_FORGET,
+  ZSQL_BEHAVIOR_SERVE,
+  ZSQL_BEHAVIOR_STREAM,
+  ZSQL_BEHAVIOR_LIST,
+  ZSQL_BEHAVIOR_PRUNE
 } zsql_behavior;
-typedef enum {
-  ZSQL_CASE_SMART,
-  ZSQL_CASE_SENSITIVE,
-  ZSQL_CASE_IGNORE
-} zsql_case_sensitivity;
-
 // clang-format off
 static const char *script =
     "if test \"$ZSH_VERSION\";then "
@@ -522,10 +3583,15 @@ static const char *script =
         "esac;"
     "fi\n"
 
-    "__z_add()"
+    "__z_add(){ "
+        // a server takes visits without holding up the prompt. otherwise,
         // run async because we're behind sqlite, fully lockstep
-        "(command z -a \"$(pwd)\" &)"
-    "\n"
+        "if test -S \"$__z_socket\";then "
+            "command z -a \"$PWD\";"
+        "else "
+            "(command z -a \"$PWD\" &);"
+        "fi;"
+    "}\n"
 
     "__z_cd(){ "
         // when we get a match, we print an extra '$' character after
@@ -542,7 +3608,7 @@ static const char *script =
         // if any non-search action would be taken
         "while :;do "
             "case \"$1\" in "
-                "-*[afS]*)"
+                "-*[aflpsSx]*)"
                     "return 1;;"
                 "--)"
                     "return 0;;"
@@ -571,18 +3637,172 @@ static const char *script =
     "}";
 // clang-format on
 
+// the script, preceded by where to find a server
+static zsql_error *zsql_print_script(void) {
+  zsql_error *err = NULL;
+
+  char *socket_path;
+  if ((err = zsql_data_path(socket_file, 0, &socket_path)) != NULL) {
+    goto exit;
+  }
+
+  if (fputs("__z_socket='", stdout) == EOF) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_socket_path;
+  }
+  for (const char *ch = socket_path; *ch != 0; ++ch) {
+    if ((*ch == '\'' ? fputs("'\\''", stdout) : putchar(*ch)) == EOF) {
+      err = zsql_error_from_errno(err);
+      goto cleanup_socket_path;
+    }
+  }
+  if (printf("'\n%s", script) < 0) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_socket_path;
+  }
+
+cleanup_socket_path:
+  free(socket_path);
+exit:
+  return err;
+}
+
+// normalize the words of a search into runes, with the utf8proc options to
+// match them with. smart case ignores case unless a word has an upper case
+// letter
+zsql_error *zsql_parse_search(char *const *args, size_t args_length,
+                              zsql_case_sensitivity case_sensitivity,
+                              int32_t **runes, size_t *runes_length,
+                              utf8proc_option_t *utf8proc_options) {
+  zsql_error *err = NULL;
+
+  size_t *argl = malloc(args_length > 0 ? args_length * sizeof(*argl) : 1);
+  if (argl == NULL) {
+    err = zsql_error_from_errno(err);
+    goto exit;
+  }
+
+  size_t search_length = 0;
+  for (size_t arg_idx = 0; arg_idx < args_length; ++arg_idx) {
+    search_length += (argl[arg_idx] = strlen(args[arg_idx]));
+  }
+
+  // smart case
+
+  *utf8proc_options = utf8proc_base_options;
+  if (case_sensitivity == ZSQL_CASE_IGNORE) {
+    *utf8proc_options |= UTF8PROC_CASEFOLD;
+  } else if (case_sensitivity == ZSQL_CASE_SMART) {
+    int32_t codepoint;
+    for (size_t arg_idx = 0; arg_idx < args_length; ++arg_idx) {
+      size_t offset = 0;
+      while (offset < argl[arg_idx]) {
+        const uint8_t byte = (uint8_t)args[arg_idx][offset];
+        if (byte < 0x80) {
+          // ascii needs no decoding
+          if (byte >= 'A' && byte <= 'Z') {
+            case_sensitivity = ZSQL_CASE_SENSITIVE;
+            goto end_detectcase;
+          }
+          ++offset;
+          continue;
+        }
+
+        ssize_t status = utf8proc_iterate((uint8_t *)args[arg_idx] + offset,
+                                          argl[arg_idx] - offset, &codepoint);
+        if (status == UTF8PROC_ERROR_INVALIDUTF8) {
+          break;
+        } else if (status < 0) {
+          err = zsql_error_from_text(utf8proc_errmsg(status), err);
+          goto cleanup_argl;
+        } else {
+          offset += status;
+          if (utf8proc_isupper(codepoint)) {
+            case_sensitivity = ZSQL_CASE_SENSITIVE;
+            goto end_detectcase;
+          }
+        }
+      }
+    }
+    case_sensitivity = ZSQL_CASE_IGNORE;
+    *utf8proc_options |= UTF8PROC_CASEFOLD;
+  end_detectcase:;
+  }
+
+  // pessimistically allocate more space than is needed to avoid
+  // reallocating later except in pathological cases
+  search_length = search_length > 0 ? search_length * 2 : 1;
+  *runes = malloc(search_length * sizeof(**runes));
+  if (*runes == NULL) {
+    err = zsql_error_from_errno(err);
+    goto cleanup_argl;
+  }
+
+  *runes_length = 0;
+  for (size_t arg_idx = 0; arg_idx < args_length; ++arg_idx) {
+    const uint8_t *arg = (const uint8_t *)args[arg_idx];
+    if (is_ascii(arg, argl[arg_idx])) {
+      // normalizing ascii only folds case, and fits in the space already
+      // allocated, as that's twice the bytes of every argument
+      for (size_t idx = 0; idx < argl[arg_idx]; ++idx) {
+        (*runes)[(*runes_length)++] =
+            *utf8proc_options & UTF8PROC_CASEFOLD ? ascii_fold(arg[idx])
+                                                  : arg[idx];
+      }
+      continue;
+    }
+
+  retry_decompose:;
+    size_t remaining_length = search_length - *runes_length;
+    ssize_t status = utf8proc_decompose(
+        (uint8_t *)args[arg_idx], argl[arg_idx], *runes + *runes_length,
+        remaining_length, *utf8proc_options);
+    if (status < 0) {
+      err = zsql_error_from_text(utf8proc_errmsg(status), err);
+      goto cleanup_runes;
+    } else if ((size_t)status > remaining_length) {
+      search_length *= 2;
+      void *allocation = realloc(*runes, search_length * sizeof(**runes));
+      if (allocation == NULL) {
+        err = zsql_error_from_errno(err);
+        goto cleanup_runes;
+      }
+      *runes = allocation;
+      goto retry_decompose;
+    } else {
+      *runes_length += status;
+    }
+  }
+
+  if (0) { // error path only
+  cleanup_runes:
+    free(*runes);
+  }
+cleanup_argl:
+  free(argl);
+exit:
+  return err;
+}
+
 int main(int argc, char **argv) {
   zsql_env_init(argc, argv);
   zsql_error *err = NULL;
 
   // option parsing
 
+  const uint64_t started = zsql_clock();
+
   zsql_behavior behavior = ZSQL_BEHAVIOR_SEARCH;
   zsql_case_sensitivity case_sensitivity = ZSQL_CASE_SMART;
+  int list_limit = 0;
+  char terminator = '\n';
 
   int ch;
-  while ((ch = getopt(argc, argv, "acfiS")) >= 0) {
+  while ((ch = getopt(argc, argv, "0acfil:psSx")) >= 0) {
     switch (ch) {
+    case '0':
+      terminator = 0;
+      break;
     case 'a':
       behavior = ZSQL_BEHAVIOR_ADD;
       break;
@@ -595,16 +3815,62 @@ int main(int argc, char **argv) {
     case 'i':
       case_sensitivity = ZSQL_CASE_IGNORE;
       break;
-    case 'S':
-      if (printf("%s", script) < 0) {
-        err = zsql_error_from_errno(err);
+    case 'l': {
+      char *end;
+      errno = 0;
+      const long parsed = strtol(optarg, &end, 10);
+      if (errno != 0 || end == optarg || *end != 0 || parsed < 1 ||
+          parsed > INT_MAX) {
+        err = zsql_error_from_text("invalid list length", err);
+        goto exit;
       }
+      list_limit = (int)parsed;
+      break;
+    }
+    case 'p':
+      behavior = ZSQL_BEHAVIOR_STREAM;
+      break;
+    case 's':
+      behavior = ZSQL_BEHAVIOR_SERVE;
+      break;
+    case 'S':
+      err = zsql_print_script();
       goto exit;
+    case 'x':
+      behavior = ZSQL_BEHAVIOR_PRUNE;
+      break;
     case '?':
       return EXIT_FAILURE;
     }
   }
-  if (optind >= argc) {
+  if (list_limit > 0) {
+    if (behavior == ZSQL_BEHAVIOR_SEARCH) {
+      behavior = ZSQL_BEHAVIOR_LIST;
+    } else if (behavior != ZSQL_BEHAVIOR_STREAM) {
+      err = zsql_error_from_text(
+          "invalid list with add, forget, prune or serve", err);
+      goto exit;
+    }
+  }
+  if (behavior == ZSQL_BEHAVIOR_SERVE) {
+    if (optind < argc) {
+      err = zsql_error_from_text("invalid serve with args", err);
+      goto exit;
+    }
+    err = zsql_serve();
+    goto exit;
+  }
+  if (behavior == ZSQL_BEHAVIOR_STREAM) {
+    if (optind < argc) {
+      err = zsql_error_from_text("invalid stream with args", err);
+      goto exit;
+    }
+  } else if (behavior == ZSQL_BEHAVIOR_PRUNE) {
+    if (optind < argc) {
+      err = zsql_error_from_text("invalid prune with args", err);
+      goto exit;
+    }
+  } else if (optind >= argc) {
     err = zsql_error_from_text("no search specified", err);
     goto exit;
   }
@@ -615,137 +3881,107 @@ int main(int argc, char **argv) {
     }
   }
 
-  // db init
+  zsql_phase_end(ZSQL_PHASE_OPTIONS, started);
 
-  if (sqlite3_initialize() != SQLITE_OK) {
-    err = zsql_error_from_text("failed to initialize sqlite", err);
-    goto exit;
-  }
+  // requests go to a running server when there is one, and otherwise
+  // straight to the database. debugging always goes to the database, so that
+  // the scores it lists are printed here, and so do lists, which trace matches
+  // through the snapshot, streams, which keep what each search matched for the
+  // next, and prunes, which forget every dir found gone together
 
-  sqlite3 *conn;
-  if ((err = zsql_open(&conn)) != NULL) {
+  zsql_client client = {
+      .socket_path = NULL, .conn = NULL, .snapshot = {.stale = 1}};
+  if (!DEBUGGING && behavior != ZSQL_BEHAVIOR_STREAM &&
+      behavior != ZSQL_BEHAVIOR_LIST && behavior != ZSQL_BEHAVIOR_PRUNE &&
+      (err = zsql_data_path(socket_file, 0, &client.socket_path)) != NULL) {
     goto exit;
   }
 
-  if ((err = zsql_migrate(conn)) != NULL) {
-    goto cleanup_sql;
-  }
-
   // behavior
 
   switch (behavior) {
   case ZSQL_BEHAVIOR_ADD: {
-    if ((err = zsql_add(conn, argv[optind], strlen(argv[optind]))) != NULL) {
-      goto cleanup_sql;
+    if ((err = zsql_client_add(&client, argv[optind],
+                               strlen(argv[optind]))) != NULL) {
+      goto cleanup_client;
     }
     break;
   }
+  case ZSQL_BEHAVIOR_STREAM:
+    if ((err = zsql_client_conn(&client)) != NULL) {
+      goto cleanup_client;
+    }
+    if ((err = zsql_client_snapshot(&client)) != NULL) {
+      goto cleanup_client;
+    }
+    if ((err = zsql_stream(client.conn, &client.snapshot, case_sensitivity,
+                           list_limit, terminator)) != NULL) {
+      goto cleanup_client;
+    }
+    break;
+  case ZSQL_BEHAVIOR_PRUNE:
+    if ((err = zsql_client_conn(&client)) != NULL) {
+      goto cleanup_client;
+    }
+    if ((err = zsql_prune(client.conn, terminator)) != NULL) {
+      goto cleanup_client;
+    }
+    break;
   case ZSQL_BEHAVIOR_FORGET:
+  case ZSQL_BEHAVIOR_LIST:
   case ZSQL_BEHAVIOR_SEARCH: {
-    size_t argl_length = argc - optind;
-    size_t *argl = malloc(argl_length * sizeof(*argl));
-    if (argl == NULL) {
-      err = zsql_error_from_errno(err);
-      goto cleanup_sql;
-    }
-
-    size_t search_length = 0;
-    for (size_t arg_idx = 0; arg_idx < argl_length; ++arg_idx) {
-      search_length += (argl[arg_idx] = strlen(argv[optind + arg_idx]));
+    // normalizing the search counts as parsing options
+    const uint64_t normalize_started = zsql_clock();
+    int32_t *runes;
+    size_t runes_length;
+    utf8proc_option_t utf8proc_options;
+    if ((err = zsql_parse_search(argv + optind, (size_t)(argc - optind),
+                                 case_sensitivity, &runes, &runes_length,
+                                 &utf8proc_options)) != NULL) {
+      goto cleanup_client;
     }
+    zsql_phase_end(ZSQL_PHASE_OPTIONS, normalize_started);
 
-    // smart case
-
-    utf8proc_option_t utf8proc_options = UTF8PROC_COMPAT | UTF8PROC_COMPOSE |
-                                         UTF8PROC_IGNORE | UTF8PROC_LUMP |
-                                         UTF8PROC_STRIPNA;
-    if (case_sensitivity == ZSQL_CASE_IGNORE) {
-      utf8proc_options |= UTF8PROC_CASEFOLD;
-    } else if (case_sensitivity == ZSQL_CASE_SMART) {
-      int32_t codepoint;
-      for (size_t arg_idx = 0; arg_idx < argl_length; ++arg_idx) {
-        size_t offset = 0;
-        while (offset < argl[arg_idx]) {
-          ssize_t status =
-              utf8proc_iterate((uint8_t *)argv[optind + arg_idx] + offset,
-                               argl[arg_idx] - offset, &codepoint);
-          if (status == UTF8PROC_ERROR_INVALIDUTF8) {
-            break;
-          } else if (status < 0) {
-            err = zsql_error_from_text(utf8proc_errmsg(status), err);
-            goto cleanup_sql;
-          } else {
-            offset += status;
-            if (utf8proc_isupper(codepoint)) {
-              case_sensitivity = ZSQL_CASE_SENSITIVE;
-              goto end_detectcase;
-            }
-          }
-        }
+    if (behavior == ZSQL_BEHAVIOR_FORGET) {
+      if ((err = zsql_forget(&client, runes, runes_length,
+                             utf8proc_options)) != NULL) {
+        goto cleanup_runes;
       }
-      case_sensitivity = ZSQL_CASE_IGNORE;
-      utf8proc_options |= UTF8PROC_CASEFOLD;
-    end_detectcase:;
-    }
-
-    // pessimistically allocate more space than is needed to avoid
-    // reallocating later except in pathological cases
-    search_length *= 2;
-    int32_t *runes = malloc(search_length * sizeof(*runes));
-    if (runes == NULL) {
-      err = zsql_error_from_errno(err);
-      goto cleanup_argl;
-    }
-
-    size_t runes_length = 0;
-    for (size_t arg_idx = 0; arg_idx < argl_length; ++arg_idx) {
-    retry_decompose:;
-      size_t remaining_length = search_length - runes_length;
-      ssize_t status = utf8proc_decompose((uint8_t *)argv[optind + arg_idx],
-                                          argl[arg_idx], runes + runes_length,
-                                          remaining_length, utf8proc_options);
-      if (status < 0) {
-        err = zsql_error_from_text(utf8proc_errmsg(status), err);
+    } else if (behavior == ZSQL_BEHAVIOR_LIST) {
+      if ((err = zsql_client_conn(&client)) != NULL) {
         goto cleanup_runes;
-      } else if ((size_t)status > remaining_length) {
-        search_length *= 2;
-        void *allocation = realloc(runes, search_length * sizeof(*runes));
-        if (allocation == NULL) {
-          err = zsql_error_from_errno(err);
-          goto cleanup_runes;
-        }
-        runes = allocation;
-        goto retry_decompose;
-      } else {
-        runes_length += status;
       }
-    }
-
-    if (behavior == ZSQL_BEHAVIOR_FORGET) {
-      if ((err = zsql_forget(conn, runes, runes_length, utf8proc_options)) !=
+      if ((err = zsql_client_snapshot(&client)) != NULL) {
+        goto cleanup_runes;
+      }
+      if ((err = zsql_list(client.conn, &client.snapshot, runes, runes_length,
+                           utf8proc_options, list_limit, terminator)) !=
           NULL) {
         goto cleanup_runes;
       }
     } else if (behavior == ZSQL_BEHAVIOR_SEARCH) {
-      if ((err = zsql_search(conn, runes, runes_length, utf8proc_options)) !=
-          NULL) {
+      if ((err = zsql_search(&client, runes, runes_length,
+                             utf8proc_options)) != NULL) {
         goto cleanup_runes;
       }
     }
 
   cleanup_runes:
     free(runes);
-  cleanup_argl:
-    free(argl);
     break;
   }
   default:
     err = zsql_error_from_text("inconsistent behavior", err);
-    goto exit;
+    goto cleanup_client;
   }
 
-cleanup_sql:
-  sqlite3_close(conn);
+cleanup_client:
+  sqlite3_close(client.conn);
+  zsql_index_free(&client.snapshot);
+  free(client.socket_path);
+  if (STATS) {
+    zsql_print_stats();
+  }
 exit:
   if (err != NULL) {
     zsql_error_print(err);
@@ -0,0 +1,127 @@
+#ifndef ZSQL_ZSQL_H
+#define ZSQL_ZSQL_H
+
+#include <sqlite3.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utf8proc.h>
+
+#include "error.h"
+
+// the database and the searches through it, shared by the server, the
+// snapshot, prunes, lists and streams
+
+typedef struct {
+  int64_t id;
+  float score;
+  // the dir's visited_seq while scoring, then its dense rank by recency among
+  // every matching dir, 1 being the most recent
+  int64_t recency;
+  double visits;
+} zsql_score;
+
+typedef struct {
+  const size_t length;
+  const int32_t *runes;
+  const uint64_t signature;
+  const utf8proc_option_t utf8proc_options;
+  // scored in place of the dirs table when not NULL
+  const struct zsql_index_impl *index;
+  // when not NULL, only these positions within index are scored, in order
+  const size_t *candidates;
+  size_t candidates_length;
+  // a final rank some matching dir is sure to reach, which only the best
+  // match has to beat. filled in by zsql_score_all
+  double rank_floor;
+  // every matching dir. filled in by zsql_score_all
+  zsql_score *scores;
+  size_t scores_length;
+  size_t scores_capacity;
+} zsql_query;
+
+static const utf8proc_option_t utf8proc_base_options =
+    UTF8PROC_COMPAT | UTF8PROC_COMPOSE | UTF8PROC_IGNORE | UTF8PROC_LUMP |
+    UTF8PROC_STRIPNA;
+
+// a profile is a dir normalized ahead of time, so that scoring it needs no
+// unicode processing: the normalized runes in host byte order, one bonus class
+// byte per rune as computed by fuzzy_bonus, then one byte giving the size of
+// each rune. pure ascii dirs, which normalization leaves alone apart from
+// folding case, keep their runes as single bytes and never touch utf8proc
+#define PROFILE_WIDTH_ASCII 1
+#define PROFILE_WIDTH_UTF32 sizeof(int32_t)
+
+extern int profile_parse(const uint8_t *profile, size_t profile_length,
+                         size_t *width, size_t *runes_length);
+
+// a copy of every dir's profiles and ranking columns, kept by a server so that
+// searches never have to read them back out of the database. it's reloaded
+// whenever another connection writes, as PRAGMA data_version tells, and is
+// otherwise kept up with the server's own writes. searches without a server
+// map one in from a snapshot instead, see snapshot_map.
+//
+// each column is kept apart from the rest, so that rejecting a dir by its
+// signature only ever reads signatures
+typedef struct zsql_index_impl {
+  // ordered by id
+  int64_t *ids;
+  // as stored, before aging.scale
+  double *visits;
+  int64_t *visited_seqs;
+  uint64_t *signatures;
+  // the nth dir's profile lies within profiles from profile_offsets[2n] up to
+  // profile_offsets[2n+1], and its folded profile from there up to
+  // profile_offsets[2n+2]
+  uint64_t *profile_offsets;
+  size_t length;
+  size_t capacity;
+  uint8_t *profiles;
+  size_t profiles_length;
+  size_t profiles_capacity;
+  double scale;
+  int64_t data_version;
+  // aging.generation as of the last write the index caught up with
+  int64_t generation;
+  // whether the index has fallen behind in a way only reloading can fix
+  int stale;
+  // the snapshot the columns lie within, if it's mapped. it's never grown
+  void *map;
+  size_t map_length;
+} zsql_index;
+
+typedef enum {
+  ZSQL_CASE_SMART,
+  ZSQL_CASE_SENSITIVE,
+  ZSQL_CASE_IGNORE
+} zsql_case_sensitivity;
+
+// the files within the data dir, see zsql_data_path
+extern const char *const socket_file;
+
+extern void zsql_index_free(zsql_index *index);
+extern zsql_error *zsql_index_read_aging(sqlite3 *conn, double *scale,
+                                         int64_t *generation);
+extern size_t zsql_index_find(const zsql_index *index, int64_t id);
+extern zsql_error *zsql_index_refresh(sqlite3 *conn, zsql_index *index);
+extern zsql_error *zsql_index_visit(sqlite3 *conn, zsql_index *index,
+                                    const char *dir, size_t length);
+extern zsql_error *zsql_data_path(const char *file, int create, char **path);
+extern zsql_error *zsql_connect(sqlite3 **conn);
+extern zsql_error *zsql_add(sqlite3 *conn, const char *dir, size_t length);
+extern zsql_error *zsql_delete(sqlite3 *conn, int64_t id, const char *dir,
+                               size_t length);
+extern zsql_error *zsql_fold_journal(sqlite3 *conn, zsql_index *index,
+                                     int *folded);
+extern zsql_error *zsql_match(sqlite3 *conn, sqlite3_stmt **stmt,
+                              zsql_query *query, int limit);
+extern int zsql_dir_gone(const char *dir, size_t length);
+extern zsql_error *zsql_find(sqlite3 *conn, const zsql_index *index,
+                             const int32_t *runes, size_t length,
+                             utf8proc_option_t utf8proc_options, int64_t *id,
+                             char **dir, size_t *dir_length);
+extern zsql_error *zsql_parse_search(char *const *args, size_t args_length,
+                                     zsql_case_sensitivity case_sensitivity,
+                                     int32_t **runes, size_t *runes_length,
+                                     utf8proc_option_t *utf8proc_options);
+
+#endif